@@ -18,60 +18,79 @@
  * */
 
 #include "animal.h"
+#include "grid.h"
 #include "save.h"
 
-#include <arpa/inet.h>
 #include <errno.h>
 #include <stdio.h>
-#include <stdlib.h>
+#include <string.h>
 
-#define RETURN_ERR (-1)
-int animal_write(const struct animal *a, FILE *dest, const char **err)
+#define ANIMAL_HEADER_SIZE (sizeof(uint32_t) + 4 * sizeof(uint16_t) \
+	+ N_CHEMICALS)
+
+void animal_write(const struct animal *a, struct buffer *dest)
+{
+	uint16_t ram_size = a->brain->ram_size;
+	uint8_t *at = buffer_add(dest,
+		ANIMAL_HEADER_SIZE + ram_size * sizeof(uint16_t));
+	encode32(at, a->brain->save_num);
+	uint16_t fields16[4] = {a->health, a->energy, a->instr_ptr, a->flags};
+	encode16(at + 4, fields16, 4);
+	memcpy(at + 12, a->stomach, N_CHEMICALS);
+	at += ANIMAL_HEADER_SIZE;
+	for (uint16_t i = 0, n; i < ram_size; i += n) {
+		const uint16_t *words = animal_ram_span(a, i, &n);
+		if (words)
+			encode16(at + i * sizeof(uint16_t), words, n);
+		else
+			memset(at + i * sizeof(uint16_t), 0,
+				n * sizeof(uint16_t));
+	}
+}
+
+/* Whether n bytes are all zero. */
+static bool all_zero(const uint8_t *bytes, size_t n)
 {
-	FWRITE(&a->brain->save_num, sizeof(a->brain->save_num), 1, dest, err);
-	uint16_t fields16[4] = {
-		htons(a->health), htons(a->energy), htons(a->instr_ptr),
-		htons(a->flags)
-	};
-	FWRITE(fields16, sizeof(*fields16), 4, dest, err);
-	FWRITE(a->stomach, sizeof(*a->stomach), N_CHEMICALS, dest, err);
-	for (uint16_t i = 0; i < a->brain->ram_size; ++i) {
-		uint16_t cell = htons(a->ram[i]);
-		FWRITE(&cell, sizeof(cell), 1, dest, err);
+	for (size_t i = 0; i < n; ++i) {
+		if (bytes[i])
+			return false;
 	}
-	return 0;
+	return true;
 }
-#undef RETURN_ERR
 
-#define RETURN_ERR NULL
-struct animal *animal_read(struct brain **species,
+#define RETURN_ERR 0
+uint32_t animal_read(struct grid *g,
+		struct brain **species,
 		uint32_t n_species,
-		FILE *src,
+		struct cursor *src,
 		const char **err)
 {
-	uint32_t brain_num;
-	FREAD(&brain_num, sizeof(brain_num), 1, src, err);
-	brain_num = ntohl(brain_num);
+	const uint8_t *bytes;
+	TAKE(bytes, ANIMAL_HEADER_SIZE, src, err);
+	uint32_t brain_num = decode32(bytes);
 	if (brain_num >= n_species) {
 		errno = ENODATA;
 		*err = "species number too high";
-		return NULL;
+		return 0;
 	}
 	struct brain *b = species[brain_num];
-	++b->refcount;
-	struct animal *a = malloc(offsetof(struct animal, ram)
-		+ b->ram_size * sizeof(uint16_t));
-	a->brain = b;
+	const uint8_t *ram;
+	TAKE(ram, b->ram_size * sizeof(uint16_t), src, err);
+	uint32_t handle = animal_new(b, 0, g);
+	struct animal *a = grid_animal(g, handle);
 	uint16_t fields16[4];
-	FREAD(fields16, sizeof(*fields16), 4, src, err);
-	a->health = ntohs(fields16[0]);
-	a->energy = ntohs(fields16[1]);
-	a->instr_ptr = ntohs(fields16[2]);
-	a->flags = ntohs(fields16[3]);
-	FREAD(a->stomach, sizeof(*a->stomach), N_CHEMICALS, src, err);
-	for (uint16_t i = 0; i < b->ram_size; ++i) {
-		FREAD(&a->ram[i], sizeof(a->ram[i]), 1, src, err);
-		a->ram[i] = ntohs(a->ram[i]);
+	decode16(fields16, bytes + 4, 4);
+	a->health = fields16[0];
+	a->energy = fields16[1];
+	a->instr_ptr = fields16[2];
+	a->flags = fields16[3];
+	memcpy(a->stomach, bytes + 12, N_CHEMICALS);
+	for (uint16_t i = 0, n; i < b->ram_size; i += n) {
+		animal_ram_span(a, i, &n);
+		const uint8_t *words = ram + i * sizeof(uint16_t);
+		/* Zero words are left to pages that need not exist. */
+		if (!all_zero(words, n * sizeof(uint16_t)))
+			decode16(animal_ram_ref(a, i), words, n);
 	}
-	return a;
+	return handle;
 }
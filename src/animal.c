@@ -19,8 +19,11 @@
 
 #include "animal.h"
 
+#include "arena.h"
 #include "brain.h"
 #include "grid.h"
+#include "jit.h"
+#include "registry.h"
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
@@ -61,32 +64,113 @@ enum {
 	bits_on(paste2(_##a##_line_, __LINE__)->flags, (errs)); \
 } while (0)
 
+/* The page table comes after the inline words, aligned for pointers. */
+#define PAGES_OFFSET ((offsetof(struct animal, ram) \
+	+ ANIMAL_INLINE_RAM * sizeof(uint16_t) + sizeof(uint16_t *) - 1) \
+	/ sizeof(uint16_t *) * sizeof(uint16_t *))
+
+static uint16_t **pages_of(const struct animal *a)
+{
+	return (uint16_t **)((char *)a + PAGES_OFFSET);
+}
+
+static size_t n_pages(uint16_t ram_size)
+{
+	if (ram_size <= ANIMAL_INLINE_RAM)
+		return 0;
+	return (ram_size - ANIMAL_INLINE_RAM + ANIMAL_PAGE_WORDS - 1)
+		/ ANIMAL_PAGE_WORDS;
+}
+
+/* How many words an animal takes past its header. */
+static uint16_t slot_words(uint16_t ram_size)
+{
+	if (ram_size <= ANIMAL_INLINE_RAM)
+		return ram_size;
+	return (PAGES_OFFSET - offsetof(struct animal, ram)
+		+ n_pages(ram_size) * sizeof(uint16_t *)) / sizeof(uint16_t);
+}
+
+/* The bytes of an animal which local instructions can touch. */
+static size_t local_size(const struct brain *b)
+{
+	return offsetof(struct animal, ram) + sizeof(uint16_t)
+		* (b->ram_size < ANIMAL_INLINE_RAM ?
+			b->ram_size : ANIMAL_INLINE_RAM);
+}
+
+uint16_t animal_ram(const struct animal *self, uint16_t idx)
+{
+	if (idx < ANIMAL_INLINE_RAM)
+		return self->ram[idx];
+	idx -= ANIMAL_INLINE_RAM;
+	const uint16_t *page = pages_of(self)[idx / ANIMAL_PAGE_WORDS];
+	return page ? page[idx % ANIMAL_PAGE_WORDS] : 0;
+}
+
+uint16_t *animal_ram_ref(struct animal *self, uint16_t idx)
+{
+	if (idx < ANIMAL_INLINE_RAM)
+		return &self->ram[idx];
+	idx -= ANIMAL_INLINE_RAM;
+	uint16_t **page = &pages_of(self)[idx / ANIMAL_PAGE_WORDS];
+	if (!*page)
+		*page = calloc(ANIMAL_PAGE_WORDS, sizeof(uint16_t));
+	return &(*page)[idx % ANIMAL_PAGE_WORDS];
+}
+
+const uint16_t *animal_ram_span(const struct animal *self, uint16_t idx,
+	uint16_t *n)
+{
+	uint16_t size = self->brain->ram_size;
+	if (idx < ANIMAL_INLINE_RAM) {
+		*n = (size < ANIMAL_INLINE_RAM ? size : ANIMAL_INLINE_RAM) - idx;
+		return &self->ram[idx];
+	}
+	uint16_t in_page = (idx - ANIMAL_INLINE_RAM) % ANIMAL_PAGE_WORDS;
+	*n = ANIMAL_PAGE_WORDS - in_page;
+	if (*n > size - idx)
+		*n = size - idx;
+	const uint16_t *page =
+		pages_of(self)[(idx - ANIMAL_INLINE_RAM) / ANIMAL_PAGE_WORDS];
+	return page ? page + in_page : NULL;
+}
+
 static int read_from(struct animal *a,
-	uint_fast8_t fmt,
+	uint_fast8_t arg,
 	uint16_t value,
 	uint16_t *dest)
 {
-	switch (fmt) {
-	case ARG_FMT_IMMEDIATE:
+	switch (arg) {
+	case ARG_IMM:
 		*dest = value;
 		break;
-	case ARG_FMT_FOLLOW_ONCE:
-		if (value < a->brain->ram_size)
-			*dest = a->ram[value];
+	case ARG_RAM:
+		*dest = a->ram[value];
+		break;
+	case ARG_IND:
+		if (a->ram[value] < a->brain->ram_size)
+			*dest = a->ram[a->ram[value]];
 		else {
 			set_error(a, FROOB);
 			return -1;
 		}
 		break;
-	case ARG_FMT_FOLLOW_TWICE:
-		if (value < a->brain->ram_size
-		 && a->ram[value] < a->brain->ram_size)
-			*dest = a->ram[a->ram[value]];
+	case ARG_PAGE:
+		*dest = animal_ram(a, value);
+		break;
+	case ARG_PAGE_IND:
+		value = animal_ram(a, value);
+		if (value < a->brain->ram_size)
+			*dest = animal_ram(a, value);
 		else {
 			set_error(a, FROOB);
 			return -1;
 		}
 		break;
+	case ARG_ROOB:
+		set_error(a, FROOB);
+		return -1;
 	default:
 		set_error(a, FINVAL_ARG);
 		return -1;
@@ -94,33 +178,37 @@ static int read_from(struct animal *a,
 	return 0;
 }
 
-static uint16_t *write_dest(struct animal *a, uint_fast8_t fmt, uint16_t value)
+static uint16_t *write_dest(struct animal *a, uint_fast8_t arg, uint16_t value)
 {
-	switch (fmt) {
-	case ARG_FMT_FOLLOW_ONCE:
-		if (value < a->brain->ram_size) {
-			return &a->ram[value];
+	switch (arg) {
+	case ARG_RAM:
+		return &a->ram[value];
+	case ARG_IND:
+		if (a->ram[value] < a->brain->ram_size) {
+			return &a->ram[a->ram[value]];
 		} else {
 			set_error(a, FROOB);
 			return NULL;
 		}
-	case ARG_FMT_FOLLOW_TWICE:
-		if (value < a->brain->ram_size
-		 && a->ram[value] < a->brain->ram_size) {
-			return &a->ram[a->ram[value]];
+	case ARG_PAGE:
+		return animal_ram_ref(a, value);
+	case ARG_PAGE_IND:
+		value = animal_ram(a, value);
+		if (value < a->brain->ram_size) {
+			return animal_ram_ref(a, value);
 		} else {
 			set_error(a, FROOB);
 			return NULL;
 		}
+	case ARG_ROOB:
+		set_error(a, FROOB);
+		return NULL;
 	default:
 		set_error(a, FINVAL_ARG);
 		return NULL;
 	}
 }
 
-#define get_arg(self, offset) \
-	((self)->brain->code[(self)->instr_ptr + (offset)])
-
 static int jump(struct animal *a, uint16_t dest)
 {
 	if (dest >= a->brain->code_size) {
@@ -132,29 +220,33 @@ static int jump(struct animal *a, uint16_t dest)
 	}
 }
 
-#define OP_CASE_NUMERIC_BINARY(name, action) \
-	case OP_##name: { \
+#define HANDLER(name) \
+	op_##name: \
+	sub_saturate(&self->energy, sludge_cost)
+
+#define OP_NUMERIC_BINARY(name, action) \
+	HANDLER(name); { \
 		uint16_t temp, \
-			 *dest = write_dest(self, instr.l_fmt, instr.left); \
-		if (!dest || read_from(self, instr.r_fmt, instr.right, &temp)) \
-			break; \
+			 *dest = write_dest(self, instr->l_arg, instr->left); \
+		if (!dest || read_from(self, instr->r_arg, instr->right, &temp)) \
+			goto next; \
 		*dest action##= temp; \
-	} break
+	} goto next
 
-#define OP_CASE_NUMERIC_UNARY(name, action) \
-	case OP_##name: { \
-		uint16_t *dest = write_dest(self, instr.l_fmt, instr.left); \
+#define OP_NUMERIC_UNARY(name, action) \
+	HANDLER(name); { \
+		uint16_t *dest = write_dest(self, instr->l_arg, instr->left); \
 		if (dest) \
 			(action); \
 		else \
 			goto error; \
-	} break;
+	} goto next
 
-#define OP_CASE_JUMP_COND(name, condition) \
-	case OP_##name: { \
+#define OP_JUMP_COND(name, condition) \
+	HANDLER(name); { \
 		uint16_t dest, test; \
-		if (read_from(self, instr.l_fmt, instr.left, &dest) \
-		 || read_from(self, instr.r_fmt, instr.right, &test)) \
+		if (read_from(self, instr->l_arg, instr->left, &dest) \
+		 || read_from(self, instr->r_arg, instr->right, &test)) \
 			goto error; \
 		if (condition) { \
 			if (jump(self, dest)) \
@@ -163,8 +255,185 @@ static int jump(struct animal *a, uint16_t dest)
 				goto jumped; \
 			} \
 		} \
-	} break
+	} goto next
+
+/* Specialized handlers are named after their opcode and argument classes.
+ * Their arguments are accessed without checking what was checked when the
+ * brain was compiled. */
+#define SPECIAL(name, l, r) \
+	op_##name##_##l##_##r: \
+	sub_saturate(&self->energy, sludge_cost)
 
+#define CHECK_IMM(value, fail)
+#define CHECK_RAM(value, fail)
+#define CHECK_IND(value, fail) \
+	if (self->ram[(value)] >= self->brain->ram_size) { \
+		set_error(self, FROOB); \
+		fail; \
+	}
+
+#define REF_IMM(value) (value)
+#define REF_RAM(value) (self->ram[(value)])
+#define REF_IND(value) (self->ram[self->ram[(value)]])
+
+/* Immediate jump targets are known to be in bounds. */
+#define JUMP_IMM(target) do { \
+	self->instr_ptr = (target); \
+	goto jumped; \
+} while (0)
+#define JUMP_RAM(target) do { \
+	if (jump(self, (target))) \
+		goto error; \
+	goto jumped; \
+} while (0)
+#define JUMP_IND JUMP_RAM
+
+#define SPECIAL_MOVE(name, l, r) \
+	SPECIAL(name, l, r); { \
+		CHECK_##l(instr->left, goto error); \
+		CHECK_##r(instr->right, goto error); \
+		uint16_t *dest = &REF_##l(instr->left); \
+		*dest = REF_##r(instr->right); \
+	} goto next;
+
+#define SPECIAL_XCHG(name, l, r) \
+	SPECIAL(name, l, r); { \
+		CHECK_##l(instr->left, goto error); \
+		CHECK_##r(instr->right, goto error); \
+		uint16_t *destl = &REF_##l(instr->left), \
+			 *destr = &REF_##r(instr->right), \
+			 temp = *destl; \
+		*destl = *destr; \
+		*destr = temp; \
+	} goto next;
+
+#define SPECIAL_SFLG(name, l, r) \
+	SPECIAL(name, l, r); { \
+		CHECK_##l(instr->left, goto error); \
+		self->flags = REF_##l(instr->left); \
+	} goto next;
+
+#define SPECIAL_NUMERIC_BINARY(name, action, l, r) \
+	SPECIAL(name, l, r); { \
+		CHECK_##l(instr->left, goto next); \
+		CHECK_##r(instr->right, goto next); \
+		uint16_t *dest = &REF_##l(instr->left); \
+		*dest action##= REF_##r(instr->right); \
+	} goto next;
+
+#define SPECIAL_NUMERIC_UNARY(name, action, l, r) \
+	SPECIAL(name, l, r); { \
+		CHECK_##l(instr->left, goto error); \
+		uint16_t *dest = &REF_##l(instr->left); \
+		(action); \
+	} goto next;
+
+#define SPECIAL_JUMP(name, l, r) \
+	SPECIAL(name, l, r); { \
+		CHECK_##l(instr->left, goto error); \
+		JUMP_##l(REF_##l(instr->left)); \
+	}
+
+#define SPECIAL_CMPR(name, l, r) \
+	SPECIAL(name, l, r); { \
+		CHECK_##l(instr->left, goto error); \
+		CHECK_##r(instr->right, goto error); \
+		compare(self, REF_##l(instr->left), REF_##r(instr->right)); \
+	} goto next;
+
+#define SPECIAL_JUMP_COND(name, condition, l, r) \
+	SPECIAL(name, l, r); { \
+		CHECK_##l(instr->left, goto error); \
+		CHECK_##r(instr->right, goto error); \
+		uint16_t dest = REF_##l(instr->left), \
+			 test = REF_##r(instr->right); \
+		if (condition) \
+			JUMP_##l(dest); \
+	} goto next;
+
+#define SPECIAL_GCHM(name, l, r) \
+	SPECIAL(name, l, r); { \
+		CHECK_##l(instr->left, goto error); \
+		CHECK_##r(instr->right, goto error); \
+		uint16_t *dest = &REF_##l(instr->left), \
+			 chem = REF_##r(instr->right); \
+		if (chem >= N_CHEMICALS) { \
+			set_error(self, FINVAL_ARG); \
+			goto error; \
+		} \
+		*dest = self->stomach[chem]; \
+	} goto next;
+
+/* These invoke m for every combination of argument classes which has a
+ * specialized handler. Unused arguments are treated as immediate. */
+#define EACH_DEST(m, ...) \
+	m(__VA_ARGS__, RAM, IMM) m(__VA_ARGS__, IND, IMM)
+#define EACH_SRC(m, ...) \
+	m(__VA_ARGS__, IMM, IMM) m(__VA_ARGS__, RAM, IMM) \
+	m(__VA_ARGS__, IND, IMM)
+#define EACH_DEST_DEST(m, ...) \
+	m(__VA_ARGS__, RAM, RAM) m(__VA_ARGS__, RAM, IND) \
+	m(__VA_ARGS__, IND, RAM) m(__VA_ARGS__, IND, IND)
+#define EACH_DEST_SRC(m, ...) \
+	m(__VA_ARGS__, RAM, IMM) m(__VA_ARGS__, RAM, RAM) \
+	m(__VA_ARGS__, RAM, IND) m(__VA_ARGS__, IND, IMM) \
+	m(__VA_ARGS__, IND, RAM) m(__VA_ARGS__, IND, IND)
+#define EACH_SRC_SRC(m, ...) \
+	m(__VA_ARGS__, IMM, IMM) m(__VA_ARGS__, IMM, RAM) \
+	m(__VA_ARGS__, IMM, IND) m(__VA_ARGS__, RAM, IMM) \
+	m(__VA_ARGS__, RAM, RAM) m(__VA_ARGS__, RAM, IND) \
+	m(__VA_ARGS__, IND, IMM) m(__VA_ARGS__, IND, RAM) \
+	m(__VA_ARGS__, IND, IND)
+
+/* This is the same list as the one of specialized handlers in execute. */
+#define EACH_SPECIAL(m) \
+	EACH_DEST_SRC(m, MOVE) \
+	EACH_DEST_DEST(m, XCHG) \
+	EACH_DEST(m, GFLG) \
+	EACH_SRC(m, SFLG) \
+	EACH_DEST(m, GIPT) \
+	EACH_DEST_SRC(m, AND) \
+	EACH_DEST_SRC(m, OR) \
+	EACH_DEST_SRC(m, XOR) \
+	EACH_DEST(m, NOT) \
+	EACH_DEST_SRC(m, SHFR) \
+	EACH_DEST_SRC(m, SHFL) \
+	EACH_DEST_SRC(m, ADD) \
+	EACH_DEST_SRC(m, SUB) \
+	EACH_DEST(m, INCR) \
+	EACH_DEST(m, DECR) \
+	EACH_SRC(m, JUMP) \
+	EACH_SRC_SRC(m, CMPR) \
+	EACH_SRC_SRC(m, JMPA) \
+	EACH_SRC_SRC(m, JPNA) \
+	EACH_SRC_SRC(m, JMPO) \
+	EACH_SRC_SRC(m, JPNO) \
+	EACH_DEST_SRC(m, GCHM) \
+	EACH_DEST(m, GHLT) \
+	EACH_DEST(m, GNRG)
+
+static void compare(struct animal *a, uint16_t left, uint16_t right)
+{
+	if (left > right) {
+		bits_on(a->flags, FUGREATER);
+		bits_off(a->flags, FULESSER | FEQUAL);
+	} else if (left < right) {
+		bits_on(a->flags, FULESSER);
+		bits_off(a->flags, FUGREATER | FEQUAL);
+	} else {
+		bits_on(a->flags, FEQUAL);
+		bits_off(a->flags, FULESSER | FUGREATER | FSLESSER |
+			FSGREATER);
+		return;
+	}
+	if ((int16_t)left > (int16_t)right) {
+		bits_on(a->flags, FSGREATER);
+		bits_off(a->flags, FSLESSER);
+	} else if ((int16_t)left < (int16_t)right) {
+		bits_on(a->flags, FSLESSER);
+		bits_off(a->flags, FSGREATER);
+	}
+}
 
 enum {
 	DIRECTION_UP,
@@ -174,52 +443,57 @@ enum {
 	DIRECTION_HERE,
 };
 
-static struct tile *in_direction(struct grid *g,
-	uint16_t direction,
-	size_t x, size_t y)
+/* Moves (x, y) one tile in a direction. Returns false if the direction is not
+ * valid. */
+static bool move(uint16_t direction, size_t *x, size_t *y)
 {
 	switch (direction) {
 	case DIRECTION_UP:
-		--y;
+		--*y;
 		break;
 	case DIRECTION_RIGHT:
-		++x;
+		++*x;
 		break;
 	case DIRECTION_DOWN:
-		++y;
+		++*y;
 		break;
 	case DIRECTION_LEFT:
-		--x;
+		--*x;
 		break;
 	case DIRECTION_HERE:
 		break;
 	default:
-		return (void *)(ptrdiff_t)-1;
+		return false;
 	}
-	return grid_get(g, x, y);
+	return true;
+}
+
+static struct tile *in_direction(struct grid *g,
+	uint16_t direction,
+	size_t x, size_t y)
+{
+	if (!move(direction, &x, &y))
+		return (void *)(ptrdiff_t)-1;
+	struct tile *t = grid_get_unck(g, x, y);
+	return t->is_border ? NULL : t;
 }
 
 static void transfer(struct animal *a,
-		uint8_t dest[N_CHEMICALS],
-		uint8_t src[N_CHEMICALS],
-		uint8_t num,
-		uint8_t id)
+		uint8_t *dest,
+		uint8_t *src,
+		uint8_t num)
 {
-	if (id >= N_CHEMICALS) {
-		set_error(a, FINVAL_ARG);
-		return;
-	}
 	bits_off(a->flags, FERRORS);
-	if (src[id] < num) {
+	if (*src < num) {
 		bits_on(a->flags, FEMPTY);
-		num = src[id];
+		num = *src;
 	}
-	if ((unsigned)dest[id] + (unsigned)num > UINT8_MAX) {
+	if ((unsigned)*dest + (unsigned)num > UINT8_MAX) {
 		bits_on(a->flags, FFULL);
-		num = UINT8_MAX - dest[id];
+		num = UINT8_MAX - *dest;
 	}
-	dest[id] += num;
-	src[id] -= num;
+	*dest += num;
+	*src -= num;
 }
 
 const struct tile *get_relative(const struct grid *g,
@@ -237,109 +511,156 @@ const struct tile *get_relative(const struct grid *g,
 	}
 	x += relative_x;
 	y += relative_y;
-	return grid_get_const(g, x, y);
+	const struct tile *t = grid_get_const_unck(g, x, y);
+	return t->is_border ? NULL : t;
 }
-void animal_step(struct animal *self, struct grid *g, size_t x, size_t y)
+
+/* The addresses of the instruction handlers. An instruction with arguments
+ * which always cause an error is given one of the failure handlers. */
+struct handlers {
+	const void *generic[N_OPCODES];
+	const void *special[N_OPCODES][ARG_IND + 1][ARG_IND + 1];
+	const void *invalid_opcode, *nop, *fail_roob, *fail_inval, *fail_coob;
+};
+
+#define OP_HANDLER(name) [OP_##name] = &&op_##name
+#define SPECIAL_HANDLER(name, l, r) \
+	[OP_##name][ARG_##l][ARG_##r] = &&op_##name##_##l##_##r,
+
+/* Executes the instruction at the instruction pointer, charging sludge_cost
+ * first unless the opcode is invalid. If self is NULL, nothing is executed and
+ * the handlers are returned instead, since they are labels only visible inside
+ * this function. */
+static const struct handlers *execute(struct animal *self,
+	struct grid *g,
+	size_t x, size_t y,
+	uint16_t sludge_cost)
 {
+	static const struct handlers handlers = {
+		.generic = {
+			OP_HANDLER(MOVE),
+			OP_HANDLER(XCHG),
+			OP_HANDLER(GFLG),
+			OP_HANDLER(SFLG),
+			OP_HANDLER(GIPT),
+			OP_HANDLER(AND),
+			OP_HANDLER(OR),
+			OP_HANDLER(XOR),
+			OP_HANDLER(NOT),
+			OP_HANDLER(SHFR),
+			OP_HANDLER(SHFL),
+			OP_HANDLER(ADD),
+			OP_HANDLER(SUB),
+			OP_HANDLER(INCR),
+			OP_HANDLER(DECR),
+			OP_HANDLER(JUMP),
+			OP_HANDLER(CMPR),
+			OP_HANDLER(JMPA),
+			OP_HANDLER(JPNA),
+			OP_HANDLER(JMPO),
+			OP_HANDLER(JPNO),
+			OP_HANDLER(PICK),
+			OP_HANDLER(DROP),
+			OP_HANDLER(LCHM),
+			OP_HANDLER(LNML),
+			OP_HANDLER(BABY),
+			OP_HANDLER(STEP),
+			OP_HANDLER(ATTK),
+			OP_HANDLER(CONV),
+			OP_HANDLER(EAT),
+			OP_HANDLER(GCHM),
+			OP_HANDLER(GHLT),
+			OP_HANDLER(GNRG),
+		},
+		.special = {
+			EACH_SPECIAL(SPECIAL_HANDLER)
+		},
+		.invalid_opcode = &&op_invalid,
+		.nop = &&op_nop,
+		.fail_roob = &&op_fail_roob,
+		.fail_inval = &&op_fail_inval,
+		.fail_coob = &&op_fail_coob,
+	};
+	if (!self)
+		return &handlers;
 	if (self->instr_ptr >= self->brain->code_size) {
 		self->energy = 0;
-		return;
-	}
-	struct instruction instr = self->brain->code[self->instr_ptr];
-	if (instr.opcode >= N_OPCODES) {
-		set_error(self, FINVAL_OPCODE);
-		goto error;
+		return NULL;
 	}
-	sub_saturate(&self->energy, grid_get_unck(g, x, y)
-		->chemicals[CHEM_SLUDGE] / 2);
-	switch (instr.opcode) {
+	const struct compiled *instr = &self->brain->compiled[self->instr_ptr];
+	goto *instr->handler;
+op_invalid:
+	set_error(self, FINVAL_OPCODE);
+	goto error;
 /* General */
-	case OP_MOVE: {
-		uint16_t *dest = write_dest(self, instr.l_fmt, instr.left);
-		if (!dest || read_from(self, instr.r_fmt, instr.right, dest))
+	HANDLER(MOVE); {
+		uint16_t *dest = write_dest(self, instr->l_arg, instr->left);
+		if (!dest || read_from(self, instr->r_arg, instr->right, dest))
 			goto error;
-	} break;
-	case OP_XCHG: {
+	} goto next;
+	HANDLER(XCHG); {
 		uint16_t temp, *destl, *destr;
-		if ((destl = write_dest(self, instr.l_fmt, instr.left)) == NULL
-		 || (destr = write_dest(self, instr.r_fmt, instr.right)) == NULL
+		if ((destl = write_dest(self, instr->l_arg, instr->left)) == NULL
+		 || (destr = write_dest(self, instr->r_arg, instr->right)) == NULL
 		)
 			goto error;
 		temp = *destl;
 		*destl = *destr;
 		*destr = temp;
-	} break;
-	case OP_GFLG: {
-		uint16_t *dest = write_dest(self, instr.l_fmt, instr.left);
+	} goto next;
+	HANDLER(GFLG); {
+		uint16_t *dest = write_dest(self, instr->l_arg, instr->left);
 		if (dest)
 			*dest = self->flags;
 		else
 			goto error;
-	} break;
-	case OP_SFLG: {
-		if (read_from(self, instr.l_fmt, instr.left, &self->flags))
+	} goto next;
+	HANDLER(SFLG); {
+		if (read_from(self, instr->l_arg, instr->left, &self->flags))
 			goto error;
-	} break;
-	case OP_GIPT: {
-		uint16_t *dest = write_dest(self, instr.l_fmt, instr.left);
+	} goto next;
+	HANDLER(GIPT); {
+		uint16_t *dest = write_dest(self, instr->l_arg, instr->left);
 		if (dest)
 			*dest = self->instr_ptr;
 		else
 			goto error;
-	} break;
+	} goto next;
 /* Bitwise */
-	OP_CASE_NUMERIC_BINARY(AND, &);
-	OP_CASE_NUMERIC_BINARY(OR, |);
-	OP_CASE_NUMERIC_BINARY(XOR, ^);
-	OP_CASE_NUMERIC_UNARY(NOT, *dest = ~*dest);
-	OP_CASE_NUMERIC_BINARY(SHFR, >>);
-	OP_CASE_NUMERIC_BINARY(SHFL, <<);
+	OP_NUMERIC_BINARY(AND, &);
+	OP_NUMERIC_BINARY(OR, |);
+	OP_NUMERIC_BINARY(XOR, ^);
+	OP_NUMERIC_UNARY(NOT, *dest = ~*dest);
+	OP_NUMERIC_BINARY(SHFR, >>);
+	OP_NUMERIC_BINARY(SHFL, <<);
 /* Arithmetic */
-	OP_CASE_NUMERIC_BINARY(ADD, +);
-	OP_CASE_NUMERIC_BINARY(SUB, -);
-	OP_CASE_NUMERIC_UNARY(INCR, ++*dest);
-	OP_CASE_NUMERIC_UNARY(DECR, --*dest);
+	OP_NUMERIC_BINARY(ADD, +);
+	OP_NUMERIC_BINARY(SUB, -);
+	OP_NUMERIC_UNARY(INCR, ++*dest);
+	OP_NUMERIC_UNARY(DECR, --*dest);
 /* Control flow */
-	case OP_JUMP: {
+	HANDLER(JUMP); {
 		uint16_t dest;
-		if (read_from(self, instr.l_fmt, instr.left, &dest)
+		if (read_from(self, instr->l_arg, instr->left, &dest)
 		 || jump(self, dest))
 			goto error;
 	} goto jumped;
-	case OP_CMPR: {
+	HANDLER(CMPR); {
 		uint16_t left, right;
-		if (read_from(self, instr.l_fmt, instr.left, &left)
-		 || read_from(self, instr.r_fmt, instr.right, &right))
-			goto error;
-		if (left > right) {
-			bits_on(self->flags, FUGREATER);
-			bits_off(self->flags, FULESSER | FEQUAL);
-		} else if (left < right) {
-			bits_on(self->flags, FULESSER);
-			bits_off(self->flags, FUGREATER | FEQUAL);
-		} else {
-			bits_on(self->flags, FEQUAL);
-			bits_off(self->flags, FULESSER | FUGREATER | FSLESSER |
-				FSGREATER);
-			break;
-		}
-		if ((int16_t)left > (int16_t)right) {
-			bits_on(self->flags, FSGREATER);
-			bits_off(self->flags, FSLESSER);
-		} else if ((int16_t)left < (int16_t)right) {
-			bits_on(self->flags, FSLESSER);
-			bits_off(self->flags, FSGREATER);
-		}
-	} break;
-	OP_CASE_JUMP_COND(JMPA, (self->flags | test) == self->flags);
-	OP_CASE_JUMP_COND(JPNA, (self->flags & test) == 0);
-	OP_CASE_JUMP_COND(JMPO, (self->flags & test) != 0);
-	OP_CASE_JUMP_COND(JPNO, (self->flags & test) != test);
+		if (read_from(self, instr->l_arg, instr->left, &left)
+		 || read_from(self, instr->r_arg, instr->right, &right))
+			goto error;
+		compare(self, left, right);
+	} goto next;
+	OP_JUMP_COND(JMPA, (self->flags | test) == self->flags);
+	OP_JUMP_COND(JPNA, (self->flags & test) == 0);
+	OP_JUMP_COND(JMPO, (self->flags & test) != 0);
+	OP_JUMP_COND(JPNO, (self->flags & test) != test);
 /* Special */
-	case OP_PICK: {
+	HANDLER(PICK); {
 		uint16_t direction, num_and_id;
-		if (read_from(self, instr.l_fmt, instr.left, &direction)
-		 || read_from(self, instr.r_fmt, instr.right, &num_and_id))
+		if (read_from(self, instr->l_arg, instr->left, &direction)
+		 || read_from(self, instr->r_arg, instr->right, &num_and_id))
 			goto error;
 		struct tile *targ = in_direction(g, direction, x, y);
 		if ((ptrdiff_t)targ == -1) {
@@ -352,12 +673,17 @@ void animal_step(struct animal *self, struct grid *g, size_t x, size_t y)
 		}
 		uint8_t num = num_and_id >> 8,
 			id = num_and_id & UINT8_MAX;
-		transfer(self, self->stomach, targ->chemicals, num, id);
-	} break;
-	case OP_DROP: {
+		if (id < N_CHEMICALS) {
+			grid_evaporate(g, targ, x, y);
+			transfer(self, &self->stomach[id],
+				grid_chemical(g, targ, id), num);
+		} else
+			set_error(self, FINVAL_ARG);
+	} goto next;
+	HANDLER(DROP); {
 		uint16_t direction, num_and_id;
-		if (read_from(self, instr.l_fmt, instr.left, &direction)
-		 || read_from(self, instr.r_fmt, instr.right, &num_and_id))
+		if (read_from(self, instr->l_arg, instr->left, &direction)
+		 || read_from(self, instr->r_arg, instr->right, &num_and_id))
 			goto error;
 		struct tile *targ = in_direction(g, direction, x, y);
 		if ((ptrdiff_t)targ == -1) {
@@ -370,13 +696,19 @@ void animal_step(struct animal *self, struct grid *g, size_t x, size_t y)
 		}
 		uint8_t num = num_and_id >> 8,
 			id = num_and_id & UINT8_MAX;
-		transfer(self, targ->chemicals, self->stomach, num, id);
-	} break;
-	case OP_LCHM: {
+		if (id < N_CHEMICALS) {
+			grid_evaporate(g, targ, x, y);
+			transfer(self, grid_chemical(g, targ, id),
+				&self->stomach[id], num);
+			grid_chemical_added(g, targ, id);
+		} else
+			set_error(self, FINVAL_ARG);
+	} goto next;
+	HANDLER(LCHM); {
 		uint16_t id_and_x_and_y, *dest =
-			write_dest(self, instr.l_fmt, instr.left);
+			write_dest(self, instr->l_arg, instr->left);
 		if (!dest
-		 || read_from(self, instr.r_fmt, instr.right, &id_and_x_and_y))
+		 || read_from(self, instr->r_arg, instr->right, &id_and_x_and_y))
 			goto error;
 		const struct tile *look = get_relative(g, id_and_x_and_y, x, y);
 		if (!look) {
@@ -388,13 +720,13 @@ void animal_step(struct animal *self, struct grid *g, size_t x, size_t y)
 			set_error(self, FINVAL_ARG);
 			goto error;
 		}
-		*dest = look->chemicals[id];
-	} break;
-	case OP_LNML: {
+		*dest = grid_amount(g, look, id, x, y);
+	} goto next;
+	HANDLER(LNML); {
 		uint16_t x_and_y,
-			 *dest = write_dest(self, instr.l_fmt, instr.left);
+			 *dest = write_dest(self, instr->l_arg, instr->left);
 		if (!dest
-		 || read_from(self, instr.r_fmt, instr.right, &x_and_y))
+		 || read_from(self, instr->r_arg, instr->right, &x_and_y))
 			goto error;
 		const struct tile *look = get_relative(g, x_and_y, x, y);
 		if (!look) {
@@ -402,14 +734,14 @@ void animal_step(struct animal *self, struct grid *g, size_t x, size_t y)
 			goto error;
 		}
 		if (look->animal)
-			*dest = look->animal->brain->signature;
+			*dest = grid_animal(g, look->animal)->brain->signature;
 		else
 			set_error(self, FEMPTY);
-	} break;
-	case OP_BABY: {
+	} goto next;
+	HANDLER(BABY); {
 		uint16_t direction, energy;
-		if (read_from(self, instr.l_fmt, instr.left, &direction)
-		 || read_from(self, instr.r_fmt, instr.right, &energy))
+		if (read_from(self, instr->l_arg, instr->left, &direction)
+		 || read_from(self, instr->r_arg, instr->right, &energy))
 			goto error;
 		struct tile *targ = in_direction(g, direction, x, y);
 		if ((ptrdiff_t)targ == -1) {
@@ -432,17 +764,26 @@ void animal_step(struct animal *self, struct grid *g, size_t x, size_t y)
 		self->energy -= energy;
 		self->stomach[CHEM_CODEA] -= codea;
 		self->stomach[CHEM_CODEB] -= codeb;
-		if (grid_next_mutant(g))
-			tile_set_animal(targ, animal_mutant(self->brain,
-				energy - self->brain->ram_size, g));
+		grid_wait_turn(g, y);
+		/* A tile can only be born onto once a tick, so its stream is
+		 * used only once. The stream is only made once it is this row's
+		 * turn, since the serial generator starts it from the state
+		 * other rows draw from. */
+		size_t targ_x = x, targ_y = y;
+		move(direction, &targ_x, &targ_y);
+		struct random_stream r = grid_stream(g, RANDOM_BIRTH,
+			(uint64_t)targ_y * g->width + targ_x);
+		if (grid_next_mutant(g, &r))
+			tile_set_animal(targ, g, animal_mutant(self->brain,
+				energy - self->brain->ram_size, g, &r));
 		else
-			tile_set_animal(targ, animal_new(self->brain,
-				energy - self->brain->ram_size));
-		targ->animal->health = g->health;
-	} break;
-	case OP_STEP: {
+			tile_set_animal(targ, g, animal_new(self->brain,
+				energy - self->brain->ram_size, g));
+		grid_animal(g, targ->animal)->health = g->health;
+	} goto next;
+	HANDLER(STEP); {
 		uint16_t direction;
-		if (read_from(self, instr.l_fmt, instr.left, &direction))
+		if (read_from(self, instr->l_arg, instr->left, &direction))
 			goto error;
 		struct tile *dest = in_direction(g, direction, x, y);
 		if ((ptrdiff_t)dest == -1) {
@@ -453,13 +794,14 @@ void animal_step(struct animal *self, struct grid *g, size_t x, size_t y)
 			set_error(self, FBLOCKED);
 			goto error;
 		}
-		tile_set_animal(dest, self);
-		tile_clear_animal(grid_get_unck(g, x, y));
-	} break;
-	case OP_ATTK: {
+		struct tile *here = grid_get_unck(g, x, y);
+		tile_set_animal(dest, g, here->animal);
+		tile_clear_animal(here, g);
+	} goto next;
+	HANDLER(ATTK); {
 		uint16_t direction, power;
-		if (read_from(self, instr.l_fmt, instr.left, &direction)
-		 || read_from(self, instr.r_fmt, instr.right, &power))
+		if (read_from(self, instr->l_arg, instr->left, &direction)
+		 || read_from(self, instr->r_arg, instr->right, &power))
 			goto error;
 		struct tile *targ = in_direction(g, direction, x, y);
 		if ((ptrdiff_t)targ == -1) {
@@ -475,12 +817,12 @@ void animal_step(struct animal *self, struct grid *g, size_t x, size_t y)
 			goto error;
 		}
 		sub_saturate(&self->energy, power / 2);
-		sub_saturate(&targ->animal->health, power);
-	} break;
-	case OP_CONV: {
+		sub_saturate(&grid_animal(g, targ->animal)->health, power);
+	} goto next;
+	HANDLER(CONV); {
 		uint16_t c1, c2;
-		if (read_from(self, instr.l_fmt, instr.left, &c1)
-		 || read_from(self, instr.r_fmt, instr.right, &c2))
+		if (read_from(self, instr->l_arg, instr->left, &c1)
+		 || read_from(self, instr->r_arg, instr->right, &c2))
 			goto error;
 		if (c1 >= N_CHEMICALS || c2 >= N_CHEMICALS) {
 			set_error(self, FINVAL_ARG);
@@ -499,11 +841,11 @@ void animal_step(struct animal *self, struct grid *g, size_t x, size_t y)
 			set_error(self, FEMPTY);
 			goto error;
 		}
-	} break;
-	case OP_EAT: {
+	} goto next;
+	HANDLER(EAT); {
 		uint16_t chem, amount;
-		if (read_from(self, instr.l_fmt, instr.left, &chem)
-		 || read_from(self, instr.r_fmt, instr.right, &amount))
+		if (read_from(self, instr->l_arg, instr->left, &chem)
+		 || read_from(self, instr->r_arg, instr->right, &amount))
 			goto error;
 		if (chem >= N_CHEMICALS) {
 			set_error(self, FINVAL_ARG);
@@ -524,27 +866,27 @@ void animal_step(struct animal *self, struct grid *g, size_t x, size_t y)
 			add_saturate(&self->energy, energy);
 			add_saturate(&self->health, health);
 		}
-	} break;
-	case OP_GCHM: {
+	} goto next;
+	HANDLER(GCHM); {
 		uint16_t chem,
-			 *dest = write_dest(self, instr.l_fmt, instr.left);
-		if (!dest || read_from(self, instr.r_fmt, instr.right, &chem))
+			 *dest = write_dest(self, instr->l_arg, instr->left);
+		if (!dest || read_from(self, instr->r_arg, instr->right, &chem))
 			goto error;
 		if (chem >= N_CHEMICALS) {
 			set_error(self, FINVAL_ARG);
 			goto error;
 		}
 		*dest = self->stomach[chem];
-	} break;
-	case OP_GHLT: {
-		uint16_t *dest = write_dest(self, instr.l_fmt, instr.left);
+	} goto next;
+	HANDLER(GHLT); {
+		uint16_t *dest = write_dest(self, instr->l_arg, instr->left);
 		if (dest)
 			*dest = self->health;
 		else
 			goto error;
-	} break;
-	case OP_GNRG: {
-		uint16_t *dest = write_dest(self, instr.l_fmt, instr.left);
+	} goto next;
+	HANDLER(GNRG); {
+		uint16_t *dest = write_dest(self, instr->l_arg, instr->left);
 		if (dest)
 			*dest = self->energy - GNRG_COST;
 	       		/* We don't have to deal with underflow because if it
@@ -552,41 +894,539 @@ void animal_step(struct animal *self, struct grid *g, size_t x, size_t y)
 			 * able to react. */
 		else
 			goto error;
-	} break;
-	default: {
-		set_error(self, FINVAL_OPCODE);
-	} goto error;
-	}
+	} goto next;
+/* Specialized */
+	EACH_DEST_SRC(SPECIAL_MOVE, MOVE)
+	EACH_DEST_DEST(SPECIAL_XCHG, XCHG)
+	EACH_DEST(SPECIAL_NUMERIC_UNARY, GFLG, *dest = self->flags)
+	EACH_SRC(SPECIAL_SFLG, SFLG)
+	EACH_DEST(SPECIAL_NUMERIC_UNARY, GIPT, *dest = self->instr_ptr)
+	EACH_DEST_SRC(SPECIAL_NUMERIC_BINARY, AND, &)
+	EACH_DEST_SRC(SPECIAL_NUMERIC_BINARY, OR, |)
+	EACH_DEST_SRC(SPECIAL_NUMERIC_BINARY, XOR, ^)
+	EACH_DEST(SPECIAL_NUMERIC_UNARY, NOT, *dest = ~*dest)
+	EACH_DEST_SRC(SPECIAL_NUMERIC_BINARY, SHFR, >>)
+	EACH_DEST_SRC(SPECIAL_NUMERIC_BINARY, SHFL, <<)
+	EACH_DEST_SRC(SPECIAL_NUMERIC_BINARY, ADD, +)
+	EACH_DEST_SRC(SPECIAL_NUMERIC_BINARY, SUB, -)
+	EACH_DEST(SPECIAL_NUMERIC_UNARY, INCR, ++*dest)
+	EACH_DEST(SPECIAL_NUMERIC_UNARY, DECR, --*dest)
+	EACH_SRC(SPECIAL_JUMP, JUMP)
+	EACH_SRC_SRC(SPECIAL_CMPR, CMPR)
+	EACH_SRC_SRC(SPECIAL_JUMP_COND, JMPA, (self->flags | test) == self->flags)
+	EACH_SRC_SRC(SPECIAL_JUMP_COND, JPNA, (self->flags & test) == 0)
+	EACH_SRC_SRC(SPECIAL_JUMP_COND, JMPO, (self->flags & test) != 0)
+	EACH_SRC_SRC(SPECIAL_JUMP_COND, JPNO, (self->flags & test) != test)
+	EACH_DEST_SRC(SPECIAL_GCHM, GCHM)
+	EACH_DEST(SPECIAL_NUMERIC_UNARY, GHLT, *dest = self->health)
+	EACH_DEST(SPECIAL_NUMERIC_UNARY, GNRG, *dest = self->energy - GNRG_COST)
+/* Failures */
+	HANDLER(nop);
+	goto next;
+	HANDLER(fail_roob);
+	set_error(self, FROOB);
+	goto error;
+	HANDLER(fail_inval);
+	set_error(self, FINVAL_ARG);
+	goto error;
+	HANDLER(fail_coob);
+	set_error(self, FCOOB);
+	goto error;
+next:
 	++self->instr_ptr;
 jumped:
 	bits_off(self->flags, FERRORS);
-	sub_saturate(&self->energy, op_info[instr.opcode].energy);
-	return;
+	sub_saturate(&self->energy, instr->energy);
+	return NULL;
 error:
 	++self->instr_ptr;
 	sub_saturate(&self->energy, 1);
-	return;
+	return NULL;
+}
+
+/* How each instruction uses its arguments. */
+enum {
+	ROLE_NONE,
+	ROLE_SRC,
+	ROLE_DEST,
+	ROLE_TARGET,	/* A source which is a jump destination. */
+};
+
+#define ROLES(name, left, right, quiet) \
+	[OP_##name] = {ROLE_##left, ROLE_##right, quiet}
+
+static const struct arg_roles {
+	uint8_t left, right;
+	bool quiet; /* Whether argument errors are ignored. */
+} op_roles[N_OPCODES] = {
+	/*	Name	Left	Right	Quiet */
+	ROLES(MOVE,	DEST,	SRC,	false),
+	ROLES(XCHG,	DEST,	DEST,	false),
+	ROLES(GFLG,	DEST,	NONE,	false),
+	ROLES(SFLG,	SRC,	NONE,	false),
+	ROLES(GIPT,	DEST,	NONE,	false),
+	ROLES(AND,	DEST,	SRC,	true),
+	ROLES(OR,	DEST,	SRC,	true),
+	ROLES(XOR,	DEST,	SRC,	true),
+	ROLES(NOT,	DEST,	NONE,	false),
+	ROLES(SHFR,	DEST,	SRC,	true),
+	ROLES(SHFL,	DEST,	SRC,	true),
+	ROLES(ADD,	DEST,	SRC,	true),
+	ROLES(SUB,	DEST,	SRC,	true),
+	ROLES(INCR,	DEST,	NONE,	false),
+	ROLES(DECR,	DEST,	NONE,	false),
+	ROLES(JUMP,	TARGET,	NONE,	false),
+	ROLES(CMPR,	SRC,	SRC,	false),
+	ROLES(JMPA,	TARGET,	SRC,	false),
+	ROLES(JPNA,	TARGET,	SRC,	false),
+	ROLES(JMPO,	TARGET,	SRC,	false),
+	ROLES(JPNO,	TARGET,	SRC,	false),
+	ROLES(PICK,	SRC,	SRC,	false),
+	ROLES(DROP,	SRC,	SRC,	false),
+	ROLES(LCHM,	DEST,	SRC,	false),
+	ROLES(LNML,	DEST,	SRC,	false),
+	ROLES(BABY,	SRC,	SRC,	false),
+	ROLES(STEP,	SRC,	NONE,	false),
+	ROLES(ATTK,	SRC,	SRC,	false),
+	ROLES(CONV,	SRC,	SRC,	false),
+	ROLES(EAT,	SRC,	SRC,	false),
+	ROLES(GCHM,	DEST,	SRC,	false),
+	ROLES(GHLT,	DEST,	NONE,	false),
+	ROLES(GNRG,	DEST,	NONE,	false),
+};
+
+static uint_fast8_t classify(const struct brain *b,
+	uint_fast8_t role,
+	uint_fast8_t fmt,
+	uint16_t value)
+{
+	switch (role) {
+	case ROLE_NONE:
+		return ARG_IMM;
+	case ROLE_DEST:
+		if (fmt == ARG_FMT_IMMEDIATE)
+			return ARG_INVAL;
+		break;
+	default:
+		if (fmt == ARG_FMT_IMMEDIATE)
+			return ARG_IMM;
+		break;
+	}
+	switch (fmt) {
+	case ARG_FMT_FOLLOW_ONCE:
+		if (value >= b->ram_size)
+			return ARG_ROOB;
+		return value < ANIMAL_INLINE_RAM ? ARG_RAM : ARG_PAGE;
+	case ARG_FMT_FOLLOW_TWICE:
+		if (value >= b->ram_size)
+			return ARG_ROOB;
+		return b->ram_size <= ANIMAL_INLINE_RAM ? ARG_IND : ARG_PAGE_IND;
+	default:
+		return ARG_INVAL;
+	}
+}
+
+/* Returns the handler for an instruction whose arguments always cause the same
+ * error, or NULL if the instruction can get past its arguments. Arguments are
+ * read left to right, and the first error is the one reported. */
+static const void *static_failure(const struct handlers *h,
+	const struct arg_roles *roles,
+	uint_fast8_t l_arg,
+	uint_fast8_t r_arg)
+{
+	uint_fast8_t args[2] = {l_arg, r_arg};
+	bool uncertain = false;
+	for (size_t i = 0; i < 2; ++i) {
+		switch (args[i]) {
+		case ARG_IND:
+		case ARG_PAGE_IND:
+			uncertain = true;
+			break;
+		case ARG_ROOB:
+			/* An uncertain argument would fail with FROOB too. */
+			return roles->quiet ? h->nop : h->fail_roob;
+		case ARG_INVAL:
+			if (roles->quiet)
+				return h->nop;
+			return uncertain ? NULL : h->fail_inval;
+		}
+	}
+	return NULL;
+}
+
+bool animal_is_local(const struct brain *brain, uint16_t idx)
+{
+	const struct handlers *h = execute(NULL, NULL, 0, 0, 0);
+	const struct compiled *c = &brain->compiled[idx];
+	uint_fast8_t opcode = BRAIN_INSTR(brain, idx).opcode;
+	return opcode < N_OPCODES && c->l_arg <= ARG_IND && c->r_arg <= ARG_IND
+	    && c->handler == h->special[opcode][c->l_arg][c->r_arg];
+}
+
+/* Animals can sleep in loops of idle instructions: local ones which depend only
+ * on the animal's flags, instruction pointer and a fixed set of RAM words. */
+#define IDLE_MAX_RAM 64
+/* The most steps an idle loop is run to find where its state repeats, first
+ * and at most. The steps double with each failure in a row, as does the wait
+ * before trying again, so loops that never repeat cost less and less. */
+#define IDLE_FIRST_STEPS 16
+#define IDLE_MAX_STEPS 256
+/* How many ticks an animal waits after first failing to sleep before trying
+ * again, and at most. */
+#define IDLE_RETRY 64
+#define IDLE_MAX_RETRY 32768
+/* Room for the bytes of an animal which local instructions can touch. */
+#define IDLE_COPY_SIZE (offsetof(struct animal, ram) \
+	+ ANIMAL_INLINE_RAM * sizeof(uint16_t))
+
+struct idle {
+	bool *closed;	/* Whether execution from each instruction stays in
+			 * idle instructions forever. */
+	size_t n_ram;
+	uint16_t ram[];	/* The RAM words that idle instructions use. */
+};
+
+static bool is_idle(const struct brain *brain, uint16_t idx)
+{
+	const struct compiled *c = &brain->compiled[idx];
+	uint_fast8_t opcode = BRAIN_INSTR(brain, idx).opcode;
+	if (!animal_is_local(brain, idx)
+	 || opcode == OP_GHLT || opcode == OP_GNRG
+	 || c->l_arg == ARG_IND || c->r_arg == ARG_IND)
+		return false;
+	/* Jumps must go to fixed places. */
+	return op_roles[opcode].left != ROLE_TARGET || c->l_arg == ARG_IMM;
+}
+
+static void compile_idle(struct brain *brain)
+{
+	uint16_t size = brain->code_size;
+	free(brain->idle);
+	bool *closed = malloc(size * sizeof(*closed));
+	for (uint16_t i = 0; i < size; ++i)
+		closed[i] = is_idle(brain, i);
+	/* Instructions leading out of the closed set are removed from it until
+	 * none are left. Going backwards, falling through takes one pass. */
+	bool changed;
+	do {
+		changed = false;
+		for (uint16_t i = size; i-- > 0; ) {
+			if (!closed[i])
+				continue;
+			uint_fast8_t opcode = BRAIN_INSTR(brain, i).opcode;
+			bool stays = opcode == OP_JUMP
+				|| (i + 1 < size && closed[i + 1]);
+			if (op_roles[opcode].left == ROLE_TARGET)
+				stays = stays && closed[brain->compiled[i].left];
+			if (!stays) {
+				closed[i] = false;
+				changed = true;
+			}
+		}
+	} while (changed);
+	uint8_t *used = calloc(brain->ram_size / 8 + 1, 1);
+	size_t n_ram = 0;
+	for (uint16_t i = 0; i < size; ++i) {
+		if (!closed[i])
+			continue;
+		const struct compiled *c = &brain->compiled[i];
+		uint16_t args[2] = {c->left, c->right};
+		uint_fast8_t classes[2] = {c->l_arg, c->r_arg};
+		for (size_t a = 0; a < 2; ++a) {
+			uint16_t w = args[a];
+			if (classes[a] == ARG_RAM && !(used[w / 8] & 1 << w % 8)) {
+				used[w / 8] |= 1 << w % 8;
+				++n_ram;
+			}
+		}
+	}
+	if (n_ram > IDLE_MAX_RAM) {
+		memset(closed, 0, size * sizeof(*closed));
+		n_ram = 0;
+	}
+	struct idle *idle = malloc(offsetof(struct idle, ram)
+		+ n_ram * sizeof(*idle->ram) + size * sizeof(*closed));
+	idle->closed = (bool *)&idle->ram[n_ram];
+	memcpy(idle->closed, closed, size * sizeof(*closed));
+	idle->n_ram = 0;
+	for (uint16_t w = 0; n_ram > 0 && w < brain->ram_size; ++w)
+		if (used[w / 8] & 1 << w % 8)
+			idle->ram[idle->n_ram++] = w;
+	free(used);
+	free(closed);
+	brain->idle = idle;
+}
+
+void animal_compile(struct brain *brain)
+{
+	const struct handlers *h = execute(NULL, NULL, 0, 0, 0);
+	struct compiled *compiled = realloc(brain->compiled,
+		brain->code_size * sizeof(*compiled));
+	for (uint16_t i = 0; i < brain->code_size; ++i) {
+		const struct instruction *instr = &BRAIN_INSTR(brain, i);
+		struct compiled *c = &compiled[i];
+		c->left = instr->left;
+		c->right = instr->right;
+		if (instr->opcode >= N_OPCODES) {
+			c->handler = h->invalid_opcode;
+			c->energy = 0;
+			c->l_arg = c->r_arg = ARG_INVAL;
+			continue;
+		}
+		const struct arg_roles *roles = &op_roles[instr->opcode];
+		c->energy = op_info[instr->opcode].energy;
+		c->l_arg = classify(brain, roles->left, instr->l_fmt, instr->left);
+		c->r_arg =
+			classify(brain, roles->right, instr->r_fmt, instr->right);
+		if ((c->handler =
+			static_failure(h, roles, c->l_arg, c->r_arg)) != NULL)
+			continue;
+		if (roles->left == ROLE_TARGET && c->l_arg == ARG_IMM
+		 && c->left >= brain->code_size) {
+			/* Only taken jumps can fail because of their targets. */
+			c->handler = instr->opcode == OP_JUMP ?
+				h->fail_coob : h->generic[instr->opcode];
+			continue;
+		}
+		c->handler = h->generic[instr->opcode];
+		if (c->l_arg <= ARG_IND && c->r_arg <= ARG_IND
+		 && h->special[instr->opcode][c->l_arg][c->r_arg])
+			c->handler = h->special[instr->opcode][c->l_arg][c->r_arg];
+	}
+	brain->compiled = compiled;
+	compile_idle(brain);
+}
+
+#ifdef JIT_CHECK
+/* Runs the interpreter on a copy of the animal and aborts if the native code
+ * for the same instruction does anything different. */
+static void check_jit(struct animal *self, uint16_t sludge_cost)
+{
+	size_t size = local_size(self->brain);
+	struct animal *expected = malloc(size);
+	memcpy(expected, self, size);
+	uint16_t instr_ptr = self->instr_ptr;
+	execute(expected, NULL, 0, 0, sludge_cost);
+	self->brain->jit->entry[instr_ptr](self, sludge_cost);
+	if (memcmp(expected, self, size)) {
+		const struct instruction *instr =
+			&BRAIN_INSTR(self->brain, instr_ptr);
+		fprintf(stderr, "JIT mismatch at instruction %u (%s %u:%u %u:%u)\n"
+			"expected energy %u, ip %u, flags %#x; "
+			"got energy %u, ip %u, flags %#x\n",
+			instr_ptr, op_info[instr->opcode].name,
+			instr->l_fmt, instr->left, instr->r_fmt, instr->right,
+			expected->energy, expected->instr_ptr, expected->flags,
+			self->energy, self->instr_ptr, self->flags);
+		abort();
+	}
+	free(expected);
+}
+#endif
+
+void animal_step(struct animal *self, struct grid *g, size_t x, size_t y)
+{
+	uint16_t sludge_cost = g->chemicals[CHEM_SLUDGE][grid_index(g, x, y)] / 2;
+	const struct jit *jit = __atomic_load_n(&self->brain->jit,
+		__ATOMIC_ACQUIRE);
+	if (jit && self->instr_ptr < self->brain->code_size
+	 && jit->entry[self->instr_ptr]) {
+#ifdef JIT_CHECK
+		check_jit(self, sludge_cost);
+#else
+		jit->entry[self->instr_ptr](self, sludge_cost);
+#endif
+	} else {
+		execute(self, g, x, y, sludge_cost);
+	}
+}
+
+/* Where an idle animal's state starts repeating, and how much energy it spends
+ * getting there and going around once. */
+struct orbit {
+	uint16_t start, period;
+	uint32_t start_cost, period_cost;
+};
+
+static void idle_state(const struct animal *a,
+	const struct idle *idle,
+	uint16_t *state)
+{
+	state[0] = a->instr_ptr;
+	state[1] = a->flags;
+	for (size_t i = 0; i < idle->n_ram; ++i)
+		state[i + 2] = a->ram[idle->ram[i]];
+}
+
+/* Runs a step of a copy of an idle animal, returning the energy it cost. */
+static uint32_t idle_step(struct animal *copy)
+{
+	copy->energy = UINT16_MAX;
+	execute(copy, NULL, 0, 0, 0);
+	return UINT16_MAX - copy->energy;
+}
+
+static size_t hash_state(const uint16_t *state, size_t state_len)
+{
+	uint64_t hash = 0;
+	for (size_t i = 0; i < state_len; ++i)
+		hash = (hash ^ state[i]) * 0x9e3779b97f4a7c15;
+	return hash >> 32;
+}
+
+/* Runs a copy of an idle animal until its state repeats, finding earlier
+ * states through a table of their hashes. costs[i] is set to the energy spent
+ * by the first i steps. Returns -1 if the state does not repeat within
+ * max_steps steps, which is at most IDLE_MAX_STEPS. */
+static int find_orbit(const struct animal *self,
+	size_t max_steps,
+	struct orbit *orbit,
+	uint32_t costs[IDLE_MAX_STEPS + 1])
+{
+	const struct idle *idle = self->brain->idle;
+	size_t state_len = idle->n_ram + 2,
+	       size = local_size(self->brain);
+	_Alignas(struct animal) char bytes[IDLE_COPY_SIZE];
+	struct animal *copy = (struct animal *)bytes;
+	uint16_t states[(IDLE_MAX_STEPS + 1) * (IDLE_MAX_RAM + 2)];
+	/* Each slot holds one more than the step of a state, or 0 if it is
+	 * empty. At most half of the slots are used. */
+	uint16_t slots[4 * IDLE_MAX_STEPS];
+	size_t n_slots = 4 * IDLE_FIRST_STEPS;
+	while (n_slots < 2 * (max_steps + 1))
+		n_slots *= 2;
+	memset(slots, 0, n_slots * sizeof(*slots));
+	memcpy(copy, self, size);
+	costs[0] = 0;
+	for (size_t step = 0; ; ++step) {
+		uint16_t *state = &states[step * state_len];
+		idle_state(copy, idle, state);
+		size_t at = hash_state(state, state_len) & (n_slots - 1);
+		for (; slots[at] != 0; at = (at + 1) & (n_slots - 1)) {
+			size_t prev = slots[at] - 1;
+			if (!memcmp(&states[prev * state_len], state,
+				state_len * sizeof(*state))) {
+				orbit->start = prev;
+				orbit->period = step - prev;
+				orbit->start_cost = costs[prev];
+				orbit->period_cost = costs[step] - costs[prev];
+				return 0;
+			}
+		}
+		if (step == max_steps)
+			return -1;
+		slots[at] = step + 1;
+		costs[step + 1] = costs[step] + idle_step(copy);
+	}
+}
+
+bool animal_sleep(struct animal *self, uint16_t tick)
+{
+	const struct brain *brain = self->brain;
+	if (self->instr_ptr >= brain->code_size
+	 || !brain->idle->closed[self->instr_ptr])
+		return false;
+	if (self->sleep_wait > 0) {
+		--self->sleep_wait;
+		return false;
+	}
+	struct orbit orbit;
+	uint32_t costs[IDLE_MAX_STEPS + 1];
+	size_t max_steps = (size_t)IDLE_FIRST_STEPS << self->sleep_fails;
+	if (max_steps > IDLE_MAX_STEPS)
+		max_steps = IDLE_MAX_STEPS;
+	if (find_orbit(self, max_steps, &orbit, costs)) {
+		uint32_t wait = (uint32_t)IDLE_RETRY << self->sleep_fails;
+		if (wait < IDLE_MAX_RETRY)
+			++self->sleep_fails;
+		else
+			wait = IDLE_MAX_RETRY;
+		self->sleep_wait = wait;
+		return false;
+	}
+	self->sleep_fails = 0;
+	/* Find the number of steps after which the energy runs out. Every
+	 * step costs energy, so it is at most the current energy. */
+	uint32_t steps, energy = self->energy;
+	if (energy <= costs[orbit.start + orbit.period]) {
+		for (steps = 1; costs[steps] < energy; ++steps) ;
+	} else {
+		uint32_t left = energy - orbit.start_cost,
+			 laps = (left - 1) / orbit.period_cost,
+			 rest = left - laps * orbit.period_cost;
+		for (steps = 1; costs[orbit.start + steps] - orbit.start_cost
+				< rest; ++steps) ;
+		steps += orbit.start + laps * orbit.period;
+	}
+	if (steps < 2)
+		return false;
+	self->sleep_start = tick;
+	self->sleep_steps = steps;
+	/* Waking only needs the orbit, so it is kept instead of being found
+	 * again. A lap costing more than any energy can only be gone around
+	 * if none is left. */
+	self->orbit_start = orbit.start;
+	self->orbit_period = orbit.period;
+	self->orbit_cost = orbit.period_cost < UINT16_MAX ?
+		orbit.period_cost : UINT16_MAX;
+	return true;
+}
+
+void animal_wake(struct animal *self, uint16_t tick)
+{
+	uint16_t steps = tick - self->sleep_start,
+		 start = self->orbit_start,
+		 period = self->orbit_period;
+	if (steps > self->sleep_steps)
+		steps = self->sleep_steps;
+	self->sleep_steps = 0;
+	uint32_t laps = 0;
+	if (steps > start + period) {
+		laps = (steps - start) / period;
+		steps = start + (steps - start) % period;
+	}
+	/* The state repeats each lap, so only the energy is affected by them. */
+	while (steps--)
+		execute(self, NULL, 0, 0, 0);
+	uint32_t lost = laps * self->orbit_cost;
+	self->energy = lost >= self->energy ? 0 : self->energy - lost;
 }
 
-struct animal *animal_new(struct brain *brain, uint16_t energy)
+uint32_t animal_new(struct brain *brain, uint16_t energy, struct grid *g)
 {
-	struct animal *self = malloc(offsetof(struct animal, ram)
-		+ brain->ram_size * sizeof(uint16_t));
-	++brain->refcount;
+	uint32_t handle = arena_alloc(g->animals, slot_words(brain->ram_size));
+	struct animal *self = arena_get(g->animals, handle);
+	/* Other threads may be adding or removing members too. Births happen one at
+	 * a time, so only one thread compiles, and only once. */
+	if (__atomic_add_fetch(&brain->refcount, 1, __ATOMIC_RELAXED)
+		>= JIT_THRESHOLD && !brain->jit_tried) {
+		brain->jit_tried = true;
+		__atomic_store_n(&brain->jit, jit_compile(brain),
+			__ATOMIC_RELEASE);
+	}
 	self->brain = brain;
 	self->energy = energy;
 	self->instr_ptr = 0;
 	self->flags = 0;
+	self->sleep_start = self->sleep_steps = self->sleep_wait = 0;
+	self->sleep_fails = 0;
 	memset(self->stomach, 0, N_CHEMICALS);
-	memset(self->ram, 0, brain->ram_size * sizeof(uint16_t));
-	return self;
+	if (brain->ram_size <= ANIMAL_INLINE_RAM) {
+		memset(self->ram, 0, brain->ram_size * sizeof(uint16_t));
+	} else {
+		memset(self->ram, 0, ANIMAL_INLINE_RAM * sizeof(uint16_t));
+		memset(pages_of(self), 0,
+			n_pages(brain->ram_size) * sizeof(uint16_t *));
+	}
+	return handle;
 }
 
-struct animal *animal_mutant(struct brain *brain,
+uint32_t animal_mutant(struct brain *brain,
 	uint16_t energy,
-	struct grid *g)
+	struct grid *g,
+	struct random_stream *r)
 {
-	return animal_new(brain_mutate(brain, g), energy);
+	return animal_new(brain_mutate(brain, g, r), energy, g);
 }
 
 bool animal_is_dead(const struct animal *self)
@@ -594,17 +1434,26 @@ bool animal_is_dead(const struct animal *self)
 	return self->energy == 0 || self->health == 0;
 }
 
-void animal_spill_guts(const struct animal *self, struct tile *t)
+void animal_spill_guts(const struct animal *self,
+	struct grid *g,
+	struct tile *t)
 {
-	for (size_t i = 0; i < N_CHEMICALS; ++i)
-		if (UINT8_MAX - t->chemicals[i] < self->stomach[i])
-			t->chemicals[i] = UINT8_MAX;
+	for (size_t i = 0; i < N_CHEMICALS; ++i) {
+		uint8_t *c = grid_chemical(g, t, i);
+		if (UINT8_MAX - *c < self->stomach[i])
+			*c = UINT8_MAX;
 		else
-			t->chemicals[i] += self->stomach[i];
+			*c += self->stomach[i];
+		grid_chemical_added(g, t, i);
+	}
 }
 
-void animal_free(struct animal *self)
+void animal_free(struct grid *g, uint32_t handle)
 {
-	--self->brain->refcount;
-	free(self);
+	struct animal *self = arena_get(g->animals, handle);
+	for (size_t i = 0; i < n_pages(self->brain->ram_size); ++i)
+		free(pages_of(self)[i]);
+	if (__atomic_sub_fetch(&self->brain->refcount, 1, __ATOMIC_RELAXED) == 0)
+		registry_died_out(g->species, self->brain);
+	arena_release(g->animals, handle);
 }
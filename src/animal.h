@@ -28,37 +28,92 @@
 #include <stdint.h>
 #include <stdio.h>
 
+/* An animal keeps up to ANIMAL_INLINE_RAM words of RAM in itself. The rest is
+ * kept in pages of ANIMAL_PAGE_WORDS words, each allocated when it is first
+ * written. Words of pages not yet allocated read as zero. */
+#define ANIMAL_INLINE_RAM 32
+#define ANIMAL_PAGE_WORDS 32
+
 struct animal {
 	struct brain *brain;
 	uint16_t health;
 	uint16_t energy;
 	uint16_t instr_ptr;
 	uint16_t flags;
+	/* An animal is asleep while sleep_steps is nonzero. It has skipped
+	 * the steps since the tick sleep_start, and it wakes after sleep_steps
+	 * of them at the latest. While awake, sleep_wait counts down the ticks
+	 * until it may try to sleep again. */
+	uint16_t sleep_start, sleep_steps, sleep_wait;
+	/* While asleep, its state repeats every orbit_period steps after the
+	 * first orbit_start, each time costing orbit_cost energy, or
+	 * UINT16_MAX if more. */
+	uint16_t orbit_start, orbit_period, orbit_cost;
+	/* How many times in a row it failed to find an orbit. */
+	uint8_t sleep_fails;
 	uint8_t stomach[N_CHEMICALS];
-	uint16_t ram[];
+	uint16_t ram[];	/* The words kept inline, then the table of pages. */
 };
 
-struct animal *animal_new(struct brain *brain, uint16_t energy);
+/* Makes an animal in the arena of the grid, returning its handle. */
+uint32_t animal_new(struct brain *brain, uint16_t energy, struct grid *g);
 
-struct animal *animal_mutant(struct brain *brain,
+uint32_t animal_mutant(struct brain *brain,
 	uint16_t energy,
-	struct grid *g);
+	struct grid *g,
+	struct random_stream *r);
+
+void animal_compile(struct brain *brain);
+
+/* Whether the instruction at idx has a specialized handler. Such instructions
+ * only touch the animal executing them: its RAM, flags, instruction pointer and
+ * energy, and reading its health and stomach. */
+bool animal_is_local(const struct brain *brain, uint16_t idx);
 
 void animal_step(struct animal *self, struct grid *grid, size_t x, size_t y);
 
+/* Puts the animal to sleep instead of stepping on this tick if it is in a loop
+ * of local instructions whose outcome is known until its energy runs out. The
+ * sludge cost on the animal's tile must be zero. Returns whether it slept. */
+bool animal_sleep(struct animal *self, uint16_t tick);
+
+/* Runs the steps an animal skipped while asleep up to the given tick. */
+void animal_wake(struct animal *self, uint16_t tick);
+
 bool animal_is_dead(const struct animal *self);
 
+/* Reads a word of RAM known to be within bounds. */
+uint16_t animal_ram(const struct animal *self, uint16_t idx);
+
+/* Gets a word of RAM known to be within bounds for writing, allocating its
+ * page if it has none. */
+uint16_t *animal_ram_ref(struct animal *self, uint16_t idx);
+
+/* Gets where the words of RAM from idx (within bounds) on are kept, setting *n
+ * to how many of them are kept one after another. Returns NULL for words of a
+ * page not yet allocated. animal_ram_ref(self, idx) gets the same words for
+ * writing. */
+const uint16_t *animal_ram_span(const struct animal *self, uint16_t idx,
+	uint16_t *n);
+
 struct tile;
 
-void animal_spill_guts(const struct animal *self, struct tile *t);
+void animal_spill_guts(const struct animal *self,
+	struct grid *g,
+	struct tile *t);
+
+struct buffer;
+struct cursor;
 
-int animal_write(const struct animal *self, FILE *dest, const char **err);
+void animal_write(const struct animal *self, struct buffer *dest);
 
-struct animal *animal_read(struct brain **species,
+/* Reads an animal into the arena of the grid, returning its handle or 0. */
+uint32_t animal_read(struct grid *g,
+	struct brain **species,
 	uint32_t n_species,
-	FILE *src,
+	struct cursor *src,
 	const char **err);
 
-void animal_free(struct animal *self);
+void animal_free(struct grid *g, uint32_t handle);
 
 #endif /* Header guard */
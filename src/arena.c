@@ -0,0 +1,144 @@
+/*
+ * The code for keeping animals together in memory.
+ *
+ * Copyright (C) 2018 Jude Melton-Houghton
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * */
+
+#include "arena.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Class k holds animals taking up to 2^k words past their headers. The class
+ * is kept in the low bits of a handle and one more than the slot number in the
+ * rest. */
+#define N_CLASSES 17
+#define CLASS_BITS 5
+
+/* Segment s of a class has FIRST_SLOTS << s slots, so a class grows without
+ * moving the animals it has. This many segments hold every slot number that
+ * fits in a handle. */
+#define FIRST_SLOTS 64
+#define N_SEGMENTS 22
+
+struct class {
+	size_t slot_size;
+	char *segments[N_SEGMENTS];
+	uint32_t n_used;	/* Slots ever given out. */
+	uint32_t *free;		/* Slots put back, the last used again first. */
+	size_t n_free, free_cap;
+};
+
+struct arena {
+	pthread_mutex_t lock;
+	struct class classes[N_CLASSES];
+};
+
+static unsigned class_of(uint16_t words)
+{
+	return words <= 1 ? 0 : 32 - __builtin_clz(words - 1u);
+}
+
+/* Finds segment s holding slot i and how far into it the slot is. */
+static unsigned segment_of(uint32_t i, size_t *offset)
+{
+	uint32_t n = i / FIRST_SLOTS + 1;
+	unsigned s = 31 - __builtin_clz(n);
+	*offset = i - FIRST_SLOTS * ((1u << s) - 1);
+	return s;
+}
+
+struct arena *arena_new(void)
+{
+	struct arena *self = calloc(1, sizeof(*self));
+	pthread_mutex_init(&self->lock, NULL);
+	for (unsigned k = 0; k < N_CLASSES; ++k) {
+		size_t align = _Alignof(struct animal),
+		       size = offsetof(struct animal, ram)
+			+ (sizeof(uint16_t) << k);
+		self->classes[k].slot_size = (size + align - 1) / align * align;
+	}
+	return self;
+}
+
+static uint32_t alloc_in(struct arena *self, unsigned k)
+{
+	struct class *c = &self->classes[k];
+	uint32_t i;
+	pthread_mutex_lock(&self->lock);
+	if (c->n_free > 0) {
+		i = c->free[--c->n_free];
+	} else {
+		size_t offset;
+		i = c->n_used++;
+		unsigned s = segment_of(i, &offset);
+		if (!c->segments[s])
+			c->segments[s] = malloc(((size_t)FIRST_SLOTS << s)
+				* c->slot_size);
+	}
+	pthread_mutex_unlock(&self->lock);
+	return (i + 1) << CLASS_BITS | k;
+}
+
+uint32_t arena_alloc(struct arena *self, uint16_t words)
+{
+	return alloc_in(self, class_of(words));
+}
+
+struct animal *arena_get(const struct arena *self, uint32_t handle)
+{
+	const struct class *c = &self->classes[handle % (1 << CLASS_BITS)];
+	size_t offset;
+	unsigned s = segment_of((handle >> CLASS_BITS) - 1, &offset);
+	return (struct animal *)(c->segments[s] + offset * c->slot_size);
+}
+
+void arena_release(struct arena *self, uint32_t handle)
+{
+	struct class *c = &self->classes[handle % (1 << CLASS_BITS)];
+	pthread_mutex_lock(&self->lock);
+	if (c->n_free == c->free_cap) {
+		c->free_cap = c->free_cap * 2 + 16;
+		c->free = realloc(c->free, c->free_cap * sizeof(*c->free));
+	}
+	c->free[c->n_free++] = (handle >> CLASS_BITS) - 1;
+	pthread_mutex_unlock(&self->lock);
+}
+
+uint32_t arena_copy(struct arena *self, const struct arena *from,
+	uint32_t handle)
+{
+	unsigned k = handle % (1 << CLASS_BITS);
+	uint32_t copy = alloc_in(self, k);
+	memcpy(arena_get(self, copy), arena_get(from, handle),
+		self->classes[k].slot_size);
+	return copy;
+}
+
+void arena_free(struct arena *self)
+{
+	if (!self)
+		return;
+	for (unsigned k = 0; k < N_CLASSES; ++k) {
+		for (unsigned s = 0; s < N_SEGMENTS; ++s)
+			free(self->classes[k].segments[s]);
+		free(self->classes[k].free);
+	}
+	pthread_mutex_destroy(&self->lock);
+	free(self);
+}
@@ -0,0 +1,51 @@
+/*
+ * The interface for keeping animals together in memory.
+ *
+ * Copyright (C) 2018 Jude Melton-Houghton
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * */
+
+#ifndef _ARENA_H
+
+#define _ARENA_H
+
+#include "animal.h"
+#include <stdint.h>
+
+/* An arena keeps animals in slots, with the animals of about the same size side
+ * by side. Animals are referred to by 32-bit handles, and handle 0 is never
+ * given out. An animal never moves while it has its slot. */
+struct arena;
+
+struct arena *arena_new(void);
+
+/* Gets a slot for an animal taking the given number of words past its header,
+ * returning its handle. Slots that were put back are used again first. Other
+ * threads may be getting and putting back slots at the same time. */
+uint32_t arena_alloc(struct arena *self, uint16_t words);
+
+struct animal *arena_get(const struct arena *self, uint32_t handle);
+
+/* Puts back the slot of a handle. */
+void arena_release(struct arena *self, uint32_t handle);
+
+/* Copies the animal of a handle from another arena into a new slot, returning
+ * the new handle. The copy takes over whatever the animal points to. */
+uint32_t arena_copy(struct arena *self, const struct arena *from,
+	uint32_t handle);
+
+void arena_free(struct arena *self);
+
+#endif /* Header guard */
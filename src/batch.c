@@ -0,0 +1,464 @@
+/*
+ * The code for executing animals in batches.
+ *
+ * Copyright (C) 2018 Jude Melton-Houghton
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * */
+
+#include "batch.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define FERRORS \
+	(FINVAL_ARG | FROOB | FCOOB | FINVAL_OPCODE | FEMPTY | FFULL | FBLOCKED)
+
+/* A deferred step. The health is recorded because a later attack may lower it
+ * before the step runs. */
+struct lane {
+	struct animal *animal;
+	uint16_t sludge_cost, health;
+};
+
+/* The deferred steps sharing a brain and instruction pointer. */
+struct group {
+	const struct brain *brain;
+	uint16_t instr_ptr;
+	size_t n_lanes, cap;
+	struct lane *lanes;
+};
+
+struct batch {
+	/* Indices into groups plus one, with zero marking an empty slot. */
+	size_t *table;
+	size_t table_cap;
+	struct group *groups;
+	size_t n_groups, groups_cap;
+};
+
+struct batch *batch_new(void)
+{
+	struct batch *self = calloc(1, sizeof(*self));
+	self->table_cap = 64;
+	self->table = calloc(self->table_cap, sizeof(*self->table));
+	return self;
+}
+
+static size_t hash(const struct brain *brain, uint16_t instr_ptr)
+{
+	size_t h = (uintptr_t)brain ^ (size_t)instr_ptr << 4;
+	h ^= h >> 17;
+	h *= 0x9E3779B97F4A7C15u;
+	return h ^ h >> 29;
+}
+
+static size_t *find_slot(struct batch *self,
+	const struct brain *brain,
+	uint16_t instr_ptr)
+{
+	size_t mask = self->table_cap - 1,
+	       i = hash(brain, instr_ptr) & mask;
+	for (;; i = (i + 1) & mask) {
+		size_t *slot = &self->table[i];
+		if (*slot == 0)
+			return slot;
+		const struct group *grp = &self->groups[*slot - 1];
+		if (grp->brain == brain && grp->instr_ptr == instr_ptr)
+			return slot;
+	}
+}
+
+static void grow_table(struct batch *self)
+{
+	free(self->table);
+	self->table_cap *= 2;
+	self->table = calloc(self->table_cap, sizeof(*self->table));
+	for (size_t g = 0; g < self->n_groups; ++g) {
+		const struct group *grp = &self->groups[g];
+		*find_slot(self, grp->brain, grp->instr_ptr) = g + 1;
+	}
+}
+
+static struct group *get_group(struct batch *self,
+	const struct brain *brain,
+	uint16_t instr_ptr)
+{
+	size_t *slot = find_slot(self, brain, instr_ptr);
+	if (*slot != 0)
+		return &self->groups[*slot - 1];
+	if (self->n_groups == self->groups_cap) {
+		self->groups_cap = self->groups_cap * 2 + 8;
+		self->groups = realloc(self->groups,
+			self->groups_cap * sizeof(*self->groups));
+		memset(self->groups + self->n_groups, 0,
+			(self->groups_cap - self->n_groups)
+			* sizeof(*self->groups));
+	}
+	struct group *grp = &self->groups[self->n_groups++];
+	grp->brain = brain;
+	grp->instr_ptr = instr_ptr;
+	grp->n_lanes = 0;
+	*slot = self->n_groups;
+	if (self->n_groups * 2 > self->table_cap)
+		grow_table(self);
+	return grp;
+}
+
+bool batch_defer(struct batch *self, struct animal *a, uint16_t sludge_cost)
+{
+	const struct brain *brain = a->brain;
+	if (a->instr_ptr >= brain->code_size
+	 || !animal_is_local(brain, a->instr_ptr))
+		return false;
+	struct group *grp = get_group(self, brain, a->instr_ptr);
+	if (grp->n_lanes == grp->cap) {
+		grp->cap = grp->cap * 2 + 16;
+		grp->lanes = realloc(grp->lanes, grp->cap * sizeof(*grp->lanes));
+	}
+	struct lane *ln = &grp->lanes[grp->n_lanes++];
+	ln->animal = a;
+	ln->sludge_cost = sludge_cost;
+	ln->health = a->health;
+	return true;
+}
+
+/* Sixteen 16-bit lanes fill an AVX2 register. */
+#define N_LANES 16
+
+typedef uint16_t vec __attribute__((vector_size(N_LANES * sizeof(uint16_t))));
+typedef int16_t svec __attribute__((vector_size(N_LANES * sizeof(int16_t))));
+
+/* Everything the vector code calls is inlined into each version of
+ * execute_lanes so that it uses that version's instruction set and never
+ * crosses into code built for another. Calling conventions therefore never
+ * matter, and vectors are only passed through macros. */
+#define VEC_HELPER static inline __attribute__((always_inline))
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+/* Masks have every bit of a lane set or clear. */
+#define blend(mask, yes, no) (((yes) & (mask)) | ((no) & ~(mask)))
+
+#define sub_saturate(dest, src) (((dest) - (src)) & (vec)((dest) >= (src)))
+
+/* Finds the RAM word an argument refers to, or returns NULL if an indirect
+ * index is out of bounds. */
+static uint16_t *lane_ref(struct animal *a, uint_fast8_t arg, uint16_t value)
+{
+	if (arg == ARG_RAM)
+		return &a->ram[value];
+	uint16_t idx = a->ram[value];
+	return idx < a->brain->ram_size ? &a->ram[idx] : NULL;
+}
+
+static bool lane_read(struct animal *a,
+	uint_fast8_t arg,
+	uint16_t value,
+	uint16_t *dest)
+{
+	if (arg == ARG_IMM) {
+		*dest = value;
+		return true;
+	}
+	uint16_t *ref = lane_ref(a, arg, value);
+	if (ref)
+		*dest = *ref;
+	return ref != NULL;
+}
+
+/* The operands of up to N_LANES steps, gathered from their animals. These are
+ * plain arrays since vector layout depends on the instruction set. */
+struct lanes {
+	size_t n;
+	uint16_t *dest[N_LANES], *dest2[N_LANES];
+	uint16_t left[N_LANES], right[N_LANES], energy[N_LANES],
+		 flags[N_LANES], health[N_LANES], sludge_cost[N_LANES],
+		 error[N_LANES],	/* The error to set, or zero. */
+		 skip[N_LANES];		/* Quiet failures, which succeed
+					 * without writing. */
+};
+
+VEC_HELPER vec load(const uint16_t lanes[N_LANES])
+{
+	vec v;
+	memcpy(&v, lanes, sizeof(v));
+	return v;
+}
+
+VEC_HELPER void gather(struct lanes *v,
+	const struct compiled *c,
+	uint_fast8_t opcode,
+	const struct lane *lanes)
+{
+	for (size_t i = 0; i < v->n; ++i) {
+		struct animal *a = lanes[i].animal;
+		uint16_t left = 0, right = 0, error = 0, skip = 0;
+		uint16_t *dest = NULL, *dest2 = NULL;
+		switch (opcode) {
+		case OP_MOVE:
+		case OP_GCHM:
+			if (!(dest = lane_ref(a, c->l_arg, c->left))
+			 || !lane_read(a, c->r_arg, c->right, &right))
+				error = FROOB;
+			else if (opcode == OP_GCHM) {
+				if (right >= N_CHEMICALS)
+					error = FINVAL_ARG;
+				else
+					right = a->stomach[right];
+			}
+			break;
+		case OP_AND:
+		case OP_OR:
+		case OP_XOR:
+		case OP_SHFR:
+		case OP_SHFL:
+		case OP_ADD:
+		case OP_SUB:
+			if (!(dest = lane_ref(a, c->l_arg, c->left))
+			 || !lane_read(a, c->r_arg, c->right, &right))
+				skip = UINT16_MAX;
+			else
+				left = *dest;
+			break;
+		case OP_XCHG:
+			if (!(dest = lane_ref(a, c->l_arg, c->left))
+			 || !(dest2 = lane_ref(a, c->r_arg, c->right)))
+				error = FROOB;
+			else {
+				left = *dest;
+				right = *dest2;
+			}
+			break;
+		case OP_GFLG:
+		case OP_GIPT:
+		case OP_NOT:
+		case OP_INCR:
+		case OP_DECR:
+		case OP_GHLT:
+		case OP_GNRG:
+			if (!(dest = lane_ref(a, c->l_arg, c->left)))
+				error = FROOB;
+			else
+				left = *dest;
+			break;
+		case OP_SFLG:
+		case OP_JUMP:
+			if (!lane_read(a, c->l_arg, c->left, &left))
+				error = FROOB;
+			break;
+		default: /* Comparisons and conditional jumps */
+			if (!lane_read(a, c->l_arg, c->left, &left)
+			 || !lane_read(a, c->r_arg, c->right, &right))
+				error = FROOB;
+			break;
+		}
+		v->dest[i] = dest;
+		v->dest2[i] = dest2;
+		v->left[i] = left;
+		v->right[i] = right;
+		v->error[i] = error;
+		v->skip[i] = skip;
+		v->energy[i] = a->energy;
+		v->flags[i] = a->flags;
+		v->health[i] = lanes[i].health;
+		v->sludge_cost[i] = lanes[i].sludge_cost;
+	}
+}
+
+VEC_HELPER void execute_lanes_body(const struct brain *brain,
+	uint16_t instr_ptr,
+	const struct lane *lanes,
+	size_t n)
+{
+	const struct compiled *c = &brain->compiled[instr_ptr];
+	uint_fast8_t opcode = BRAIN_INSTR(brain, instr_ptr).opcode;
+	struct lanes v;
+	memset(&v, 0, sizeof(v));
+	v.n = n;
+	gather(&v, c, opcode, lanes);
+	vec left = load(v.left), right = load(v.right),
+	    energy = sub_saturate(load(v.energy), load(v.sludge_cost)),
+	    flags = load(v.flags),
+	    error = load(v.error),
+	    result = left,
+	    result2 = right,
+	    next = (vec){0} + (uint16_t)(instr_ptr + 1),
+	    taken = (vec){0};
+	switch (opcode) {
+	case OP_MOVE:
+	case OP_GCHM:
+		result = right;
+		break;
+	case OP_XCHG:
+		result = right;
+		result2 = left;
+		break;
+	case OP_GFLG:
+		result = flags;
+		break;
+	case OP_SFLG:
+		flags = blend((vec)(error != 0), flags, left);
+		break;
+	case OP_GIPT:
+		result = (vec){0} + instr_ptr;
+		break;
+	case OP_AND:
+		result = left & right;
+		break;
+	case OP_OR:
+		result = left | right;
+		break;
+	case OP_XOR:
+		result = left ^ right;
+		break;
+	case OP_NOT:
+		result = ~left;
+		break;
+	case OP_SHFR:
+	case OP_SHFL: {
+		/* The interpreter promotes to int before shifting. */
+		vec amount = right & 31, in_range = (vec)(amount < 16);
+		amount &= 15;
+		result = (opcode == OP_SHFR ? left >> amount : left << amount)
+			& in_range;
+	} break;
+	case OP_ADD:
+		result = left + right;
+		break;
+	case OP_SUB:
+		result = left - right;
+		break;
+	case OP_INCR:
+		result = left + 1;
+		break;
+	case OP_DECR:
+		result = left - 1;
+		break;
+	case OP_JUMP:
+		taken = ~taken;
+		break;
+	case OP_CMPR: {
+		/* Like compare in animal.c */
+		vec eq = (vec)(left == right),
+		    ugt = (vec)(left > right),
+		    sgt = (vec)((svec)left > (svec)right),
+		    unequal = blend(ugt,
+			(flags & (uint16_t)~(FULESSER | FEQUAL)) | FUGREATER,
+			(flags & (uint16_t)~(FUGREATER | FEQUAL)) | FULESSER);
+		unequal = blend(sgt,
+			(unequal & (uint16_t)~FSLESSER) | FSGREATER,
+			(unequal & (uint16_t)~FSGREATER) | FSLESSER);
+		vec compared = blend(eq,
+			(flags & (uint16_t)~(FULESSER | FUGREATER | FSLESSER
+				| FSGREATER)) | FEQUAL,
+			unequal);
+		flags = blend((vec)(error != 0), flags, compared);
+	} break;
+	case OP_JMPA:
+		taken = (vec)((right & ~flags) == 0);
+		break;
+	case OP_JPNA:
+		taken = (vec)((flags & right) == 0);
+		break;
+	case OP_JMPO:
+		taken = (vec)((flags & right) != 0);
+		break;
+	case OP_JPNO:
+		taken = (vec)((flags & right) != right);
+		break;
+	case OP_GHLT:
+		result = load(v.health);
+		break;
+	case OP_GNRG:
+		result = energy - GNRG_COST;
+		break;
+	}
+	if (c->l_arg != ARG_IMM
+	 && (opcode == OP_JUMP || (opcode >= OP_JMPA && opcode <= OP_JPNO))) {
+		/* Immediate targets were checked when compiling. */
+		vec coob = taken & (vec)(left >= brain->code_size)
+			 & (vec)(error == 0);
+		error = blend(coob, (vec){0} + FCOOB, error);
+	}
+	vec failed = (vec)(error != 0);
+	taken &= ~failed;
+	next = blend(taken, left, next);
+	flags = blend(failed,
+		(flags & (uint16_t)~FERRORS) | error,
+		flags & (uint16_t)~FERRORS);
+	energy = blend(failed,
+		sub_saturate(energy, (vec){0} + 1),
+		sub_saturate(energy, (vec){0} + c->energy));
+	vec write = ~failed & ~load(v.skip);
+	for (size_t i = 0; i < n; ++i) {
+		struct animal *a = lanes[i].animal;
+		if (write[i]) {
+			if (v.dest[i])
+				*v.dest[i] = result[i];
+			if (v.dest2[i])
+				*v.dest2[i] = result2[i];
+		}
+		a->energy = energy[i];
+		a->flags = flags[i];
+		a->instr_ptr = next[i];
+	}
+}
+
+/* Every version of the vector code is the same, but built for different
+ * instruction sets. */
+__attribute__((target("avx2")))
+static void execute_lanes_avx2(const struct brain *brain,
+	uint16_t instr_ptr,
+	const struct lane *lanes,
+	size_t n)
+{
+	execute_lanes_body(brain, instr_ptr, lanes, n);
+}
+
+static void execute_lanes_default(const struct brain *brain,
+	uint16_t instr_ptr,
+	const struct lane *lanes,
+	size_t n)
+{
+	execute_lanes_body(brain, instr_ptr, lanes, n);
+}
+
+void batch_run(struct batch *self)
+{
+	void (*execute_lanes)(const struct brain *, uint16_t,
+		const struct lane *, size_t) =
+		__builtin_cpu_supports("avx2") ?
+		execute_lanes_avx2 : execute_lanes_default;
+	for (size_t g = 0; g < self->n_groups; ++g) {
+		struct group *grp = &self->groups[g];
+		for (size_t i = 0; i < grp->n_lanes; i += N_LANES) {
+			size_t n = grp->n_lanes - i;
+			execute_lanes(grp->brain, grp->instr_ptr, grp->lanes + i,
+				n < N_LANES ? n : N_LANES);
+		}
+	}
+	memset(self->table, 0, self->table_cap * sizeof(*self->table));
+	self->n_groups = 0;
+}
+
+void batch_free(struct batch *self)
+{
+	if (!self)
+		return;
+	for (size_t g = 0; g < self->groups_cap; ++g)
+		free(self->groups[g].lanes);
+	free(self->groups);
+	free(self->table);
+	free(self);
+}
@@ -0,0 +1,47 @@
+/*
+ * The interface for executing animals in batches.
+ *
+ * Copyright (C) 2018 Jude Melton-Houghton
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * */
+
+#ifndef _BATCH_H
+
+#define _BATCH_H
+
+#include "animal.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A batch collects the steps of animals whose instructions only touch
+ * themselves, grouped by brain and instruction pointer, and executes each group
+ * at once with SIMD lanes. Nothing else can observe these animals before the
+ * tick ends, except by attacking them, so running them late gives the same
+ * results as running them in scan order. */
+struct batch;
+
+struct batch *batch_new(void);
+
+/* Defers the step of an animal if its instruction is local, returning whether
+ * it was deferred. sludge_cost is charged when the step runs. */
+bool batch_defer(struct batch *self, struct animal *a, uint16_t sludge_cost);
+
+/* Executes all deferred steps. */
+void batch_run(struct batch *self);
+
+void batch_free(struct batch *self);
+
+#endif /* Header guard */
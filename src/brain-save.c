@@ -20,65 +20,55 @@
 #include "brain.h"
 #include "save.h"
 
-#include <arpa/inet.h>
 #include <stdlib.h>
 
-#define RETURN_ERR (-1)
-static int write_instruction(const struct instruction *i,
-	FILE *dest,
-	const char **err)
+#define INSTRUCTION_SIZE 6
+
+static void write_instruction(const struct instruction *i, uint8_t *dest)
 {
-	uint8_t op[2];
-	op[0] = i->opcode;
-	op[1] = (i->l_fmt << 4) | i->r_fmt;
-	FWRITE(op, sizeof(*op), 2, dest, err);
-	uint16_t args[2] = {htons(i->left), htons(i->right)};
-	FWRITE(args, sizeof(*args), 2, dest, err);
-	return 0;
+	dest[0] = i->opcode;
+	dest[1] = (i->l_fmt << 4) | i->r_fmt;
+	uint16_t args[2] = {i->left, i->right};
+	encode16(dest + 2, args, 2);
 }
 
-static int read_instruction(struct instruction *dest,
-	FILE *src,
-	const char **err)
+static void read_instruction(struct instruction *dest, const uint8_t *src)
 {
-	uint8_t op[2];
-	FREAD(op, sizeof(*op), 2, src, err);
-	dest->opcode = op[0];
-	dest->l_fmt = op[1] >> 4;
-	dest->r_fmt = op[1] & 3;
+	dest->opcode = src[0];
+	dest->l_fmt = src[1] >> 4;
+	dest->r_fmt = src[1] & 3;
 	uint16_t args[2];
-	FREAD(args, sizeof(*args), 2, src, err);
-	dest->left = ntohs(args[0]);
-	dest->right = ntohs(args[1]);
-	return 0;
+	decode16(args, src + 2, 2);
+	dest->left = args[0];
+	dest->right = args[1];
 }
 
-int brain_write(const struct brain *b, FILE *dest, const char **err)
+void brain_write(const struct brain *b, struct buffer *dest)
 {
-	uint16_t header[3] = {
-		htons(b->signature), htons(b->ram_size), htons(b->code_size)
-	};
-	FWRITE(header, sizeof(*header), 3, dest, err);
+	uint16_t header[3] = {b->signature, b->ram_size, b->code_size};
+	uint8_t *at = buffer_add(dest,
+		sizeof(header) + b->code_size * INSTRUCTION_SIZE);
+	encode16(at, header, 3);
+	at += sizeof(header);
 	for (uint16_t i = 0; i < b->code_size; ++i) {
-		if (write_instruction(&b->code[i], dest, err))
-			return -1;
+		write_instruction(&BRAIN_INSTR(b, i), at);
+		at += INSTRUCTION_SIZE;
 	}
-	return 0;
 }
-#undef RETURN_ERR
 
 #define RETURN_ERR NULL
-struct brain *brain_read(FILE *src, const char **err)
+struct brain *brain_read(struct cursor *src, const char **err)
 {
+	const uint8_t *bytes;
 	uint16_t fields16[3];
-	FREAD(fields16, sizeof(*fields16), 3, src, err);
-	struct brain *b = malloc(offsetof(struct brain, code) +
-			ntohs(fields16[2]) * sizeof(struct instruction));
-	b->signature = ntohs(fields16[0]);
-	b->ram_size = ntohs(fields16[1]);
-	b->code_size = ntohs(fields16[2]);
-	for (uint16_t i = 0; i < b->code_size; ++i)
-		if (read_instruction(&b->code[i], src, err))
-			return NULL;
+	TAKE(bytes, sizeof(fields16), src, err);
+	decode16(fields16, bytes, 3);
+	uint16_t code_size = fields16[2];
+	TAKE(bytes, code_size * INSTRUCTION_SIZE, src, err);
+	struct instruction *code = malloc(code_size * sizeof(*code));
+	for (uint16_t i = 0; i < code_size; ++i)
+		read_instruction(&code[i], bytes + i * INSTRUCTION_SIZE);
+	struct brain *b = brain_new(fields16[0], fields16[1], code_size, code);
+	free(code);
 	return b;
 }
@@ -20,6 +20,8 @@
 #include "brain.h"
 
 #include "grid.h"
+#include "jit.h"
+#include "registry.h"
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
@@ -65,70 +67,156 @@ const struct opcode_info op_info[N_OPCODES] = {
 
 static const struct opcode_info nop_info = {"NOP"};
 
-struct brain *brain_new(uint16_t signature, uint16_t ram_size, uint16_t code_size)
+static struct code_chunk *new_chunk(void)
 {
-	struct brain *self = malloc(offsetof(struct brain, code) + code_size * sizeof(struct instruction));
-	self->next = NULL;
+	struct code_chunk *chunk = malloc(sizeof(*chunk));
+	chunk->refcount = 1;
+	chunk->hashed = false;
+	return chunk;
+}
+
+static void release_chunk(struct code_chunk *chunk)
+{
+	if (--chunk->refcount == 0)
+		free(chunk);
+}
+
+static size_t n_chunks(uint16_t code_size)
+{
+	return (code_size + BRAIN_CHUNK - 1) / BRAIN_CHUNK;
+}
+
+/* Allocates a brain with room for the chunks of code_size instructions but no
+ * chunks yet. */
+static struct brain *alloc_brain(uint16_t code_size)
+{
+	struct brain *self = malloc(offsetof(struct brain, chunks)
+		+ n_chunks(code_size) * sizeof(struct code_chunk *));
+	self->next_same_hash = NULL;
+	self->hash = 0;
+	self->compiled = NULL;
+	self->idle = NULL;
+	self->jit = NULL;
+	self->jit_tried = false;
 	self->refcount = 0;
+	return self;
+}
+
+struct brain *brain_new(uint16_t signature,
+	uint16_t ram_size,
+	uint16_t code_size,
+	const struct instruction code[])
+{
+	struct brain *self = alloc_brain(code_size);
 	self->signature = signature;
 	self->ram_size = ram_size;
 	self->code_size = code_size;
-	memset(self->code, -1, code_size * sizeof(struct instruction));
+	for (size_t i = 0; i < n_chunks(code_size); ++i)
+		self->chunks[i] = new_chunk();
+	for (uint16_t i = 0; i < code_size; ++i)
+		BRAIN_INSTR(self, i) = code[i];
+	animal_compile(self);
 	return self;
 }
 
+/* Allocates a brain like b but with room for code_size instructions and no
+ * members. The population is not copied because other threads may change it.
+ * The chunks are left to the caller. */
+static struct brain *copy_header(const struct brain *b, uint16_t code_size)
+{
+	struct brain *c = alloc_brain(code_size);
+	c->save_num = b->save_num;
+	c->signature = b->signature;
+	c->ram_size = b->ram_size;
+	c->code_size = b->code_size;
+	return c;
+}
+
 static struct brain *copy_brain(const struct brain *b)
 {
-	struct brain *c = malloc(offsetof(struct brain, code) + b->code_size * sizeof(*b->code));
-	memcpy(c, b, offsetof(struct brain, code) + b->code_size * sizeof(*b->code));
-	c->refcount = 0;
-	c->next = NULL;
+	struct brain *c = copy_header(b, b->code_size);
+	for (size_t i = 0; i < n_chunks(b->code_size); ++i) {
+		c->chunks[i] = b->chunks[i];
+		++c->chunks[i]->refcount;
+	}
 	return c;
 }
 
-static struct brain *copy_shift_brain(const struct brain *b, uint16_t i, uint16_t n)
+/* Gets an instruction of a brain to change, first copying its chunk if it is
+ * shared. */
+static struct instruction *writable(struct brain *b, uint16_t idx)
+{
+	struct code_chunk **chunk = &b->chunks[idx / BRAIN_CHUNK];
+	if ((*chunk)->refcount > 1) {
+		struct code_chunk *copy = new_chunk();
+		memcpy(copy->code, (*chunk)->code, sizeof(copy->code));
+		release_chunk(*chunk);
+		*chunk = copy;
+	}
+	(*chunk)->hashed = false;
+	return &(*chunk)->code[idx % BRAIN_CHUNK];
+}
+
+/* Copies b with n instructions at i removed and then room for m instructions
+ * made at i. The chunks before the one holding i are shared. */
+static struct brain *copy_splice_brain(const struct brain *b,
+	uint16_t i, uint16_t n, uint16_t m)
 {
-	struct brain *c = malloc(offsetof(struct brain, code) + (b->code_size + n) * sizeof(*b->code));
-	memcpy(c, b, offsetof(struct brain, code) + i * sizeof(*b->code));
-	memcpy(&c->code[i + n], &b->code[i], b->code_size - i);
-	c->refcount = 0;
-	c->next = NULL;
+	uint16_t code_size = b->code_size - n + m;
+	struct brain *c = copy_header(b, code_size);
+	size_t first = i / BRAIN_CHUNK;
+	for (size_t k = 0; k < first; ++k) {
+		c->chunks[k] = b->chunks[k];
+		++c->chunks[k]->refcount;
+	}
+	for (size_t k = first; k < n_chunks(code_size); ++k)
+		c->chunks[k] = new_chunk();
+	for (uint16_t j = first * BRAIN_CHUNK; j < code_size; ++j) {
+		if (j < i)
+			BRAIN_INSTR(c, j) = BRAIN_INSTR(b, j);
+		else if (j >= i + m)
+			BRAIN_INSTR(c, j) = BRAIN_INSTR(b, j - m + n);
+	}
 	return c;
 }
 
+static struct brain *copy_shift_brain(const struct brain *b, uint16_t i, uint16_t n)
+{
+	return copy_splice_brain(b, i, 0, n);
+}
+
 static struct brain *copy_remove_brain(const struct brain *b, uint16_t i, uint16_t n)
 {
-	struct brain *c = malloc(offsetof(struct brain, code) + (b->code_size - n) * sizeof(*b->code));
-	memcpy(c, b, offsetof(struct brain, code) + i * sizeof(*b->code));
-	memcpy(&c->code[i], &b->code[i + n], b->code_size - i - n);
-	c->refcount = 0;
-	c->next = NULL;
-	return c;
+	return copy_splice_brain(b, i, n, 0);
 }
 
-static void random_instruction(struct instruction *instr, struct grid *g)
+static void random_instruction(struct instruction *instr,
+	struct grid *g,
+	struct random_stream *r)
 {
-	instr->opcode = grid_rand(g);
-	instr->l_fmt = grid_rand(g);
-	instr->r_fmt = grid_rand(g);
-	instr->left = grid_rand(g);
-	instr->right = grid_rand(g);
+	instr->opcode = grid_rand(g, r);
+	instr->l_fmt = grid_rand(g, r);
+	instr->r_fmt = grid_rand(g, r);
+	instr->left = grid_rand(g, r);
+	instr->right = grid_rand(g, r);
 }
 
+/* The new value is drawn before the index. */
 #define MKIND_CASE_INSTR_FIELD(kind, field) \
 	case MKIND_##kind: { \
 		b = copy_brain(self); \
-		b->code[grid_rand(g) % self->code_size].field = grid_rand(g); \
+		uint32_t value = grid_rand(g, r); \
+		writable(b, grid_rand(g, r) % self->code_size)->field = value; \
 	} break
 
 #define MKIND_CASE_INSTR_FMT(kind, field) \
 	case MKIND_##kind: { \
 		b = copy_brain(self); \
-		uint8_t r = grid_rand(g); \
-		size_t idx = grid_rand(g) % self->code_size; \
-		if (b->code[idx].field == r % 4) \
-			++r; \
-		b->code[idx].field = r; \
+		uint8_t fmt = grid_rand(g, r); \
+		size_t idx = grid_rand(g, r) % self->code_size; \
+		if (BRAIN_INSTR(b, idx).field == fmt % 4) \
+			++fmt; \
+		writable(b, idx)->field = fmt; \
 	} break
 
 enum {
@@ -151,17 +239,20 @@ enum {
 #define MAX_RAM 1024
 #define MAX_ROT_SIZE 32
 
-struct brain *brain_mutate(const struct brain *self, struct grid *g)
+struct brain *brain_mutate(const struct brain *self,
+	struct grid *g,
+	struct random_stream *r)
 {
 	struct brain *b;
-	switch(grid_rand(g) % N_MKIND) {
+	switch(grid_rand(g, r) % N_MKIND) {
 	case MKIND_RAM_SIZE: {
 		b = copy_brain(self);
-		b->ram_size = (b->ram_size + (grid_rand(g) & 1) * 2 - 1) % MAX_RAM;
+		b->ram_size = (b->ram_size + (grid_rand(g, r) & 1) * 2 - 1)
+			% MAX_RAM;
 	} break;
 	case MKIND_SIGNATURE: {
 		b = copy_brain(self);
-		b->signature = grid_rand(g);
+		b->signature = grid_rand(g, r);
 	} break;
 	MKIND_CASE_INSTR_FIELD(OPCODE, opcode);
 	MKIND_CASE_INSTR_FMT(INSTR_LFMT, l_fmt);
@@ -169,46 +260,123 @@ struct brain *brain_mutate(const struct brain *self, struct grid *g)
 	MKIND_CASE_INSTR_FIELD(INSTR_LEFT, left);
 	MKIND_CASE_INSTR_FIELD(INSTR_RIGHT, right);
 	case MKIND_ADD: {
-		uint16_t idx = grid_rand(g) % self->code_size;
+		uint16_t idx = grid_rand(g, r) % self->code_size;
 		b = copy_shift_brain(self, idx, 1);
-		random_instruction(&b->code[idx], g);
+		random_instruction(writable(b, idx), g, r);
 		++b->code_size;
 	} break;
 	case MKIND_REPLACE: {
 		b = copy_brain(self);
-		random_instruction(&b->code[grid_rand(g) % self->code_size], g);
+		uint16_t idx = grid_rand(g, r) % self->code_size;
+		random_instruction(writable(b, idx), g, r);
 	} break;
 	case MKIND_REMOVE: {
 		if (self->code_size == 1) {
 			b = copy_brain(self);
 			break;
 		}
-		b = copy_remove_brain(self, grid_rand(g) % self->code_size, 1);
+		uint16_t idx = grid_rand(g, r) % self->code_size;
+		b = copy_remove_brain(self, idx, 1);
 		--b->code_size;
 	} break;
 	case MKIND_DUPLICATE: {
-		uint16_t idx = grid_rand(g) % self->code_size;
+		uint16_t idx = grid_rand(g, r) % self->code_size;
 		b = copy_shift_brain(self, idx, 1);
-		b->code[idx + 1] = b->code[idx];
+		*writable(b, idx) = BRAIN_INSTR(self, idx);
 		++b->code_size;
 	} break;
 	case MKIND_ROTATE: {
-		uint16_t size1 = grid_rand(g) % MAX_ROT_SIZE % self->code_size,
-			 size2 = grid_rand(g) % MAX_ROT_SIZE % (self->code_size - size1);
+		uint16_t size1 = grid_rand(g, r) % MAX_ROT_SIZE
+				% self->code_size,
+			 size2 = grid_rand(g, r) % MAX_ROT_SIZE
+				% (self->code_size - size1);
 		uint16_t i;
 		if (size1 + size2 == self->code_size)
 			i = 0;
 		else
-			i = grid_rand(g) % (self->code_size - size1 - size2);
+			i = grid_rand(g, r) % (self->code_size - size1 - size2);
 		b = copy_brain(self);
-		memcpy(&b->code[i], &self->code[i + size1], size2 * sizeof(*self->code));
-		memcpy(&b->code[i + size2], &self->code[i], size1 * sizeof(*self->code));
+		for (uint16_t j = 0; j < size2; ++j)
+			*writable(b, i + j) = BRAIN_INSTR(self, i + size1 + j);
+		for (uint16_t j = 0; j < size1; ++j)
+			*writable(b, i + size2 + j) = BRAIN_INSTR(self, i + j);
 	} break;
 	}
-	b->next = g->species;
-	g->species = b;
-	return b;
+	struct brain *species = registry_add(g->species, b);
+	if (species == b)
+		animal_compile(b);
+	return species;
+}
+
+static size_t hash_chunk(const struct code_chunk *chunk, uint16_t size)
+{
+	uint64_t h = 0;
+	for (uint16_t i = 0; i < size; ++i) {
+		const struct instruction *instr = &chunk->code[i];
+		h ^= instr->opcode | instr->l_fmt << 8 | instr->r_fmt << 10
+			| (uint64_t)instr->left << 16
+			| (uint64_t)instr->right << 32;
+		h *= 0x9E3779B97F4A7C15u;
+		h ^= h >> 29;
+	}
+	return h;
+}
+
+size_t brain_hash(const struct brain *self)
+{
+	uint64_t h = (uint64_t)self->signature << 16 | self->ram_size;
+	for (size_t i = 0; i < n_chunks(self->code_size); ++i) {
+		/* Brains only share a chunk if they use the same number of
+		 * its instructions, so its hash can be kept. */
+		struct code_chunk *chunk = self->chunks[i];
+		if (!chunk->hashed) {
+			uint16_t size = self->code_size - i * BRAIN_CHUNK;
+			chunk->hash = hash_chunk(chunk,
+				size < BRAIN_CHUNK ? size : BRAIN_CHUNK);
+			chunk->hashed = true;
+		}
+		h ^= chunk->hash;
+		h *= 0x9E3779B97F4A7C15u;
+		h ^= h >> 29;
+	}
+	return h;
+}
+
+bool brain_equal(const struct brain *a, const struct brain *b)
+{
+	if (a->signature != b->signature || a->ram_size != b->ram_size
+	 || a->code_size != b->code_size)
+		return false;
+	for (size_t i = 0; i < n_chunks(a->code_size); ++i) {
+		const struct code_chunk *ca = a->chunks[i], *cb = b->chunks[i];
+		if (ca == cb)
+			continue;
+		if (ca->hashed && cb->hashed && ca->hash != cb->hash)
+			return false;
+		/* The unused bits beside the formats may differ. */
+		uint16_t size = a->code_size - i * BRAIN_CHUNK;
+		for (uint16_t j = 0; j < size && j < BRAIN_CHUNK; ++j) {
+			const struct instruction *ia = &ca->code[j],
+						 *ib = &cb->code[j];
+			if (ia->opcode != ib->opcode || ia->l_fmt != ib->l_fmt
+			 || ia->r_fmt != ib->r_fmt || ia->left != ib->left
+			 || ia->right != ib->right)
+				return false;
+		}
+	}
+	return true;
+}
+
+void brain_free(struct brain *self)
+{
+	for (size_t i = 0; i < n_chunks(self->code_size); ++i)
+		release_chunk(self->chunks[i]);
+	jit_free(self->jit);
+	free(self->compiled);
+	free(self->idle);
+	free(self);
 }
+
 void brain_print(const struct brain *self, FILE *dest)
 {
 	fprintf(dest, "signature:\t%04x\n", self->signature);
@@ -216,20 +384,21 @@ void brain_print(const struct brain *self, FILE *dest)
 	fprintf(dest, "population:\t%lu\n", self->refcount);
 	fprintf(dest, "code:\n");
 	for (uint16_t i = 0; i < self->code_size; ++i) {
+		const struct instruction *instr = &BRAIN_INSTR(self, i);
 		const struct opcode_info *info;
-		if (self->code[i].opcode < N_OPCODES)
-			info = &op_info[self->code[i].opcode];
+		if (instr->opcode < N_OPCODES)
+			info = &op_info[instr->opcode];
 		else
 			info = &nop_info;
 		fprintf(dest, " %s\t", info->name);
 		switch (info->n_args) {
 		case 1:
-			fprintf(dest, "%u[%04x]\n", self->code[i].l_fmt, self->code[i].left);
+			fprintf(dest, "%u[%04x]\n", instr->l_fmt, instr->left);
 			break;
 		case 2:
 			fprintf(dest, "%u[%04x]  %u[%04x]\n",
-				self->code[i].l_fmt, self->code[i].left,
-				self->code[i].r_fmt, self->code[i].right);
+				instr->l_fmt, instr->left,
+				instr->r_fmt, instr->right);
 			break;
 		default:
 			fprintf(dest, "\n");
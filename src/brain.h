@@ -21,15 +21,13 @@
 
 #define _BRAIN_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
 #define GNRG_COST 1
 
-#define SLLIST_FOR_EACH(list, item) \
-	for ((item) = (list); (item) != NULL; (item) = (item)->next)
-
 struct instruction {
 	uint8_t opcode;
 	uint8_t l_fmt : 2,
@@ -37,28 +35,99 @@ struct instruction {
 	uint16_t left, right;
 };
 
+/* The classes that an argument is sorted into when its brain is compiled.
+ * Every check that can be made knowing only the brain is made then. */
+enum arg_class {
+	ARG_IMM,	/* The value is used directly. */
+	ARG_RAM,	/* The value is an index known to be within RAM. */
+	ARG_IND,	/* The value is an index known to be within RAM of
+			 * another index which must still be checked. */
+	ARG_PAGE,	/* Like ARG_RAM, but the word is kept in a page. */
+	ARG_PAGE_IND,	/* Like ARG_IND, but either word may be kept in a
+			 * page. */
+	ARG_ROOB,	/* The value is always out of RAM's bounds. */
+	ARG_INVAL,	/* The format is not allowed where it is used. */
+};
+
+/* An instruction decoded ahead of time so that the interpreter does not have
+ * to unpack it each tick. handler is the address of the code which executes
+ * the instruction, specialized for the classes of its arguments. The classes
+ * are determined by the formats and by what the brain makes provable. */
+struct compiled {
+	const void *handler;
+	uint16_t left, right;
+	uint8_t l_arg, r_arg;
+	uint16_t energy;
+};
+
+/* Code is kept in chunks of BRAIN_CHUNK instructions. Brains share a chunk
+ * until one of them changes it, so a chunk never changes once it is shared. */
+#define BRAIN_CHUNK 64
+
+struct code_chunk {
+	size_t refcount;
+	size_t hash;	/* Of the instructions, once hashed is true. */
+	bool hashed;
+	struct instruction code[BRAIN_CHUNK];
+};
+
+/* The instruction at idx in the code of a brain. */
+#define BRAIN_INSTR(brain, idx) \
+	((brain)->chunks[(idx) / BRAIN_CHUNK]->code[(idx) % BRAIN_CHUNK])
+
+struct idle;
+struct jit;
+
 struct brain {
-	struct brain *next;
+	/* The next species with its hash in the same bucket of the registry. */
+	struct brain *next_same_hash;
+	size_t hash;
+	uint32_t id;
+	bool queued;	/* Whether it is queued to be checked for extinction. */
+	struct compiled *compiled;
+	struct idle *idle;
+	struct jit *jit;
+	/* Whether compiling has been tried, so that a failure is not tried
+	 * again on every birth. */
+	bool jit_tried;
 	size_t refcount;
 	uint32_t save_num;
 	uint16_t signature;
 	uint16_t ram_size, code_size;
-	struct instruction code[];
+	struct code_chunk *chunks[];
 };
 
 struct brain *brain_new(uint16_t signature,
 	uint16_t ram_size,
-	uint16_t code_size);
+	uint16_t code_size,
+	const struct instruction code[]);
 
 struct grid;
+struct random_stream;
 
-struct brain *brain_mutate(const struct brain *self, struct grid *g);
+/* Makes a mutant of a brain using random numbers from a stream. It is the
+ * species of the grid with the same contents if there is one, or a new species
+ * otherwise. */
+struct brain *brain_mutate(const struct brain *self,
+	struct grid *g,
+	struct random_stream *r);
+
+/* Hashes the signature, RAM size and code of a brain. */
+size_t brain_hash(const struct brain *self);
+
+/* Whether two brains have the same signature, RAM size and code. */
+bool brain_equal(const struct brain *a, const struct brain *b);
 
 void brain_print(const struct brain *self, FILE *dest);
 
-int brain_write(const struct brain *self, FILE *dest, const char **err);
+struct buffer;
+struct cursor;
+
+void brain_write(const struct brain *self, struct buffer *dest);
+
+struct brain *brain_read(struct cursor *src, const char **err);
 
-struct brain *brain_read(FILE *src, const char **err);
+void brain_free(struct brain *self);
 
 enum opcode {
 /* General */
@@ -0,0 +1,109 @@
+/*
+ * The code for gathering bytes to write and reading them back.
+ *
+ * Copyright (C) 2018 Jude Melton-Houghton
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * */
+
+#include "buffer.h"
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+uint8_t *buffer_add(struct buffer *self, size_t n)
+{
+	if (self->cap - self->size < n) {
+		do
+			self->cap = self->cap * 2 + 4096;
+		while (self->cap - self->size < n);
+		self->bytes = realloc(self->bytes, self->cap);
+	}
+	uint8_t *added = self->bytes + self->size;
+	self->size += n;
+	return added;
+}
+
+void buffer_free(struct buffer *self)
+{
+	free(self->bytes);
+	self->bytes = NULL;
+	self->size = self->cap = 0;
+}
+
+const uint8_t *cursor_take(struct cursor *self, size_t n)
+{
+	if ((size_t)(self->end - self->at) < n)
+		return NULL;
+	const uint8_t *taken = self->at;
+	self->at += n;
+	return taken;
+}
+
+/* Swaps the bytes of each of the four words packed into a 64-bit word, or does
+ * nothing where the host is big-endian already. */
+static uint64_t swap_words(uint64_t x)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	const uint64_t low = UINT64_C(0x00ff00ff00ff00ff);
+	return (x & low) << 8 | (x >> 8 & low);
+#else
+	return x;
+#endif
+}
+
+void encode16(uint8_t *dest, const uint16_t *src, size_t n)
+{
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		uint64_t x;
+		memcpy(&x, src + i, sizeof(x));
+		x = swap_words(x);
+		memcpy(dest + 2 * i, &x, sizeof(x));
+	}
+	for (; i < n; ++i) {
+		uint16_t word = htons(src[i]);
+		memcpy(dest + 2 * i, &word, sizeof(word));
+	}
+}
+
+void decode16(uint16_t *dest, const uint8_t *src, size_t n)
+{
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		uint64_t x;
+		memcpy(&x, src + 2 * i, sizeof(x));
+		x = swap_words(x);
+		memcpy(dest + i, &x, sizeof(x));
+	}
+	for (; i < n; ++i) {
+		uint16_t word;
+		memcpy(&word, src + 2 * i, sizeof(word));
+		dest[i] = ntohs(word);
+	}
+}
+
+void encode32(uint8_t *dest, uint32_t n)
+{
+	n = htonl(n);
+	memcpy(dest, &n, sizeof(n));
+}
+
+uint32_t decode32(const uint8_t *src)
+{
+	uint32_t n;
+	memcpy(&n, src, sizeof(n));
+	return ntohl(n);
+}
@@ -0,0 +1,57 @@
+/*
+ * The interface for gathering bytes to write and reading them back.
+ *
+ * Copyright (C) 2018 Jude Melton-Houghton
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * */
+
+#ifndef _BUFFER_H
+
+#define _BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A buffer gathers bytes in memory so that they can be written in one go. */
+struct buffer {
+	uint8_t *bytes;
+	size_t size, cap;
+};
+
+/* Makes room for n more bytes at the end, returning where they go. */
+uint8_t *buffer_add(struct buffer *self, size_t n);
+
+void buffer_free(struct buffer *self);
+
+/* A cursor takes bytes from memory in order. */
+struct cursor {
+	const uint8_t *at, *end;
+};
+
+/* Takes the next n bytes, or returns NULL if fewer are left. */
+const uint8_t *cursor_take(struct cursor *self, size_t n);
+
+/* Puts n words big-endian, as in the record formats. Several words are
+ * swapped at once. */
+void encode16(uint8_t *dest, const uint16_t *src, size_t n);
+
+/* Gets n big-endian words. */
+void decode16(uint16_t *dest, const uint8_t *src, size_t n);
+
+void encode32(uint8_t *dest, uint32_t n);
+
+uint32_t decode32(const uint8_t *src);
+
+#endif /* Header guard */
@@ -0,0 +1,347 @@
+/*
+ * The code for saving grids as chains of saves and deltas.
+ *
+ * Copyright (C) 2018 Jude Melton-Houghton
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * */
+
+/* For mkstemp, fchmod, pread and MAP_ANONYMOUS. */
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include "chain.h"
+
+#include "grid.h"
+#include "registry.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* A new save is made once there are this many deltas, or once the deltas are
+ * bigger than the save, so that loading does not take too long. */
+#define MAX_DELTAS 32
+
+/* What the process writing a checkpoint tells the next one. It is kept in
+ * memory shared by them. */
+struct shared {
+	/* Whether the rest is right for the files on disk. */
+	bool valid;
+	uint32_t n_deltas;
+	long save_size, delta_size;
+	uint8_t save_id[GRID_SAVE_ID_SIZE];
+	/* The fingerprint of each block as last saved. */
+	uint64_t sums[];
+};
+
+struct chain {
+	char *file_name;
+	struct shared *shared;
+	size_t shared_size;
+	/* The process writing the latest checkpoint, or 0. */
+	pid_t writer;
+	/* Whether the state given to the latest checkpoint was saved. */
+	bool saved;
+	bool packed;
+	/* Whether saves go to standard output. */
+	bool streamed;
+	/* The mode new files get when there is no save to take it from. */
+	mode_t mode;
+};
+
+static char *delta_name(const char *file_name, uint32_t n)
+{
+	size_t size = strlen(file_name) + sizeof(".delta.4294967295");
+	char *name = malloc(size);
+	snprintf(name, size, "%s.delta.%u", file_name, (unsigned)n);
+	return name;
+}
+
+/* Reads a whole file into memory. */
+static uint8_t *read_file(const char *file_name, size_t *size)
+{
+	FILE *file = fopen(file_name, "rb");
+	if (!file)
+		return NULL;
+	uint8_t *bytes = NULL;
+	long end;
+	if (fseek(file, 0, SEEK_END) == 0 && (end = ftell(file)) >= 0
+	 && fseek(file, 0, SEEK_SET) == 0) {
+		bytes = malloc(end > 0 ? end : 1);
+		*size = fread(bytes, 1, end, file);
+	}
+	fclose(file);
+	return bytes;
+}
+
+struct grid *chain_read(const char *file_name, const char **err)
+{
+	if (!strcmp(file_name, "-"))
+		return grid_read(stdin, err);
+	FILE *file = fopen(file_name, "rb");
+	if (!file) {
+		*err = "could not open the save";
+		return NULL;
+	}
+	struct grid *g = grid_read(file, err);
+	uint8_t id[GRID_SAVE_ID_SIZE];
+	bool has_id = g && fseek(file, 0, SEEK_SET) == 0
+		&& fread(id, sizeof(id), 1, file) == 1;
+	fclose(file);
+	uint32_t n = 1;
+	for (; has_id; ++n) {
+		char *name = delta_name(file_name, n);
+		size_t size;
+		uint8_t *delta = read_file(name, &size);
+		free(name);
+		if (!delta)
+			break;
+		int applied = grid_apply_delta(g, delta, size, id, n, err);
+		free(delta);
+		if (applied < 0) {
+			grid_free(g);
+			return NULL;
+		}
+		if (!applied)
+			break;
+	}
+	/* The saved amounts are what they were when the last delta was
+	 * written, but some tiles still say they evaporated before. The
+	 * species whose members were all replaced are gone, as they would be
+	 * after the update that killed them. */
+	if (n > 1) {
+		grid_mark_evaporated(g);
+		registry_free_extinct(g->species);
+	}
+	return g;
+}
+
+struct chain *chain_new(const char *file_name, const struct grid *g,
+	bool packed)
+{
+	struct chain *self = calloc(1, sizeof(*self));
+	self->file_name = strdup(file_name);
+	self->packed = packed;
+	self->saved = true;
+	self->streamed = !strcmp(file_name, "-");
+	/* The umask can only be read by setting it, so it is read once. */
+	mode_t mask = umask(0);
+	umask(mask);
+	self->mode = 0666 & ~mask;
+	if (self->streamed)
+		return self;
+	self->shared_size = sizeof(*self->shared)
+		+ grid_n_blocks(g) * sizeof(*self->shared->sums);
+	self->shared = mmap(NULL, self->shared_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (self->shared == MAP_FAILED) {
+		/* Without shared memory, every checkpoint is a new save. */
+		self->shared_size = 0;
+		self->shared = NULL;
+	}
+	return self;
+}
+
+/* Writes a new save, or a delta of the blocks with new fingerprints if sums is
+ * not NULL, to a new file beside the file name, syncs it, then renames it over
+ * the file name. The old file stays whole until the new one is. Returns the
+ * size written, or -1 on error. */
+static long write_file(struct chain *self, struct grid *g,
+	const char *file_name, const uint64_t *sums,
+	const char **err)
+{
+	struct shared *s = self->shared;
+	size_t len = strlen(file_name);
+	char *temp = malloc(len + sizeof(".XXXXXX")),
+	     *dir = strdup(file_name);
+	memcpy(temp, file_name, len);
+	memcpy(temp + len, ".XXXXXX", sizeof(".XXXXXX"));
+	int fd = mkstemp(temp), ret = -1;
+	FILE *file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+	struct stat st;
+	long size = -1;
+	uint8_t id[GRID_SAVE_ID_SIZE];
+	/* mkstemp makes files only the owner can read. */
+	if (file && stat(self->file_name, &st) == 0)
+		fchmod(fd, st.st_mode & 0777);
+	else if (file)
+		fchmod(fd, self->mode);
+	if (!file) {
+		*err = "could not make a temporary file";
+	} else if (!(sums ? grid_write_delta(g, s->sums, sums, s->save_id,
+			s->n_deltas + 1, file, err)
+		: self->packed ? grid_write_packed(g, file, err)
+		: grid_write(g, file, err))) {
+		*err = "could not sync the save";
+		if (fflush(file) == 0 && fsync(fd) == 0
+		 && (size = ftell(file)) >= 0
+		 && (sums || pread(fd, id, sizeof(id), 0) == sizeof(id))) {
+			*err = "could not replace the save";
+			ret = rename(temp, file_name);
+		}
+	}
+	if (file)
+		fclose(file);
+	else if (fd >= 0)
+		close(fd);
+	if (ret) {
+		unlink(temp);
+	} else {
+		/* The rename lasts once the directory is synced. */
+		int dir_fd = open(dirname(dir), O_RDONLY);
+		if (dir_fd >= 0) {
+			fsync(dir_fd);
+			close(dir_fd);
+		}
+		if (!sums && s)
+			memcpy(s->save_id, id, sizeof(id));
+	}
+	free(temp);
+	free(dir);
+	return ret ? -1 : size;
+}
+
+/* Saves the grid as the next delta, or as a new save if it is time for one. A
+ * delta is only made while fewer than half of the blocks have changed, and
+ * never down standard output. */
+static int save(struct chain *self, struct grid *g, const char **err)
+{
+	if (self->streamed) {
+		if (grid_write_stream(g, stdout, err))
+			return -1;
+		*err = "could not flush the save";
+		return fflush(stdout) ? -1 : 0;
+	}
+	struct shared *s = self->shared;
+	size_t n_blocks = grid_n_blocks(g), changed = n_blocks;
+	uint64_t *sums = NULL;
+	long size;
+	if (s && s->valid && s->n_deltas < MAX_DELTAS
+	 && s->delta_size <= s->save_size) {
+		sums = malloc(n_blocks * sizeof(*sums));
+		changed = grid_sum_blocks(g, sums, s->sums);
+	}
+	if (s)
+		s->valid = false;
+
+	if (changed < n_blocks / 2) {
+		char *name = delta_name(self->file_name, s->n_deltas + 1);
+		size = write_file(self, g, name, sums, err);
+		free(name);
+		if (size >= 0) {
+			memcpy(s->sums, sums, n_blocks * sizeof(*sums));
+			++s->n_deltas;
+			s->delta_size += size;
+			s->valid = true;
+		}
+		free(sums);
+		return size >= 0 ? 0 : -1;
+	}
+
+	size = write_file(self, g, self->file_name, NULL, err);
+	if (size >= 0) {
+		/* The deltas of the old save are no use now. */
+		for (uint32_t n = 1; ; ++n) {
+			char *name = delta_name(self->file_name, n);
+			int gone = unlink(name);
+			free(name);
+			if (gone)
+				break;
+		}
+	}
+	if (s && size >= 0) {
+		if (sums)
+			memcpy(s->sums, sums, n_blocks * sizeof(*sums));
+		else
+			grid_sum_blocks(g, s->sums, NULL);
+		s->n_deltas = 0;
+		s->save_size = size;
+		s->delta_size = 0;
+		s->valid = true;
+	}
+	free(sums);
+	return size >= 0 ? 0 : -1;
+}
+
+/* Returns whether the latest checkpoint has been written, waiting for it if
+ * wait is true. */
+static bool written(struct chain *self, bool wait)
+{
+	if (self->writer <= 0)
+		return true;
+	int status;
+	pid_t done;
+	while ((done = waitpid(self->writer, &status, wait ? 0 : WNOHANG))
+		== -1 && errno == EINTR) ;
+	if (done == 0)
+		return false;
+	if (done < 0 || !WIFEXITED(status)
+	 || WEXITSTATUS(status) != EXIT_SUCCESS) {
+		fprintf(stderr, "The checkpoint was not written.\n");
+		/* The writer may have stopped partway. */
+		if (self->shared)
+			self->shared->valid = false;
+	}
+	self->writer = 0;
+	return true;
+}
+
+bool chain_checkpoint(struct chain *self, struct grid *g)
+{
+	const char *err;
+	self->saved = written(self, false);
+	if (!self->saved)
+		return false;
+	fflush(NULL);
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (save(self, g, &err)) {
+			fprintf(stderr, "%s; %s.\n", strerror(errno), err);
+			_exit(EXIT_FAILURE);
+		}
+		_exit(EXIT_SUCCESS);
+	}
+	if (pid > 0)
+		self->writer = pid;
+	else if (save(self, g, &err))
+		fprintf(stderr, "%s; %s.\n", strerror(errno), err);
+	return true;
+}
+
+void chain_finish(struct chain *self, struct grid *g)
+{
+	const char *err;
+	written(self, true);
+	/* The last state is saved even if it came while a checkpoint was
+	 * being written. */
+	if (!self->saved && save(self, g, &err))
+		fprintf(stderr, "%s; %s.\n", strerror(errno), err);
+	self->saved = true;
+}
+
+void chain_free(struct chain *self)
+{
+	if (self->shared)
+		munmap(self->shared, self->shared_size);
+	free(self->file_name);
+	free(self);
+}
@@ -0,0 +1,56 @@
+/*
+ * The interface for saving grids as chains of saves and deltas.
+ *
+ * Copyright (C) 2018 Jude Melton-Houghton
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * */
+
+#ifndef _CHAIN_H
+
+#define _CHAIN_H
+
+#include <stdbool.h>
+
+/* A chain keeps a grid in a save followed by deltas, each holding what changed
+ * since the one before. The deltas go in files named after the save with
+ * ".delta.1", ".delta.2" and so on added. Once there are enough of them, a new
+ * save is made in place of them all. The file name "-" stands for standard
+ * input to read from and standard output to write to, where each checkpoint is
+ * a whole stream save after the one before. */
+struct chain;
+
+struct grid;
+
+/* Reads a grid from a save and applies the deltas that follow it. */
+struct grid *chain_read(const char *file_name, const char **err);
+
+/* Starts a chain for a grid to be saved in a file, in packed saves if packed is
+ * true. The first checkpoint makes a new save. */
+struct chain *chain_new(const char *file_name, const struct grid *g,
+	bool packed);
+
+/* Saves the grid while it goes on being simulated, returning whether it did. A
+ * forked copy of the process writes the save or delta, sharing memory with this
+ * one until either changes it, so only taking the copy pauses the simulation.
+ * Nothing is saved while the last checkpoint is still being written. */
+bool chain_checkpoint(struct chain *self, struct grid *g);
+
+/* Waits for the latest checkpoint to be written, then saves the grid if that
+ * checkpoint was skipped. */
+void chain_finish(struct chain *self, struct grid *g);
+
+void chain_free(struct chain *self);
+
+#endif /* Header guard */
@@ -0,0 +1,161 @@
+/*
+ * The code for moving chemicals along many tiles at once.
+ *
+ * Copyright (C) 2018 Jude Melton-Houghton
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * */
+
+#include "flow.h"
+
+#if defined(__x86_64__)
+
+#include <immintrin.h>
+
+/* A bit for each tile of a span, the leftmost lowest. */
+typedef uint32_t span_mask;
+
+#define AVX2 __attribute__((target("avx2")))
+
+static inline AVX2 span_mask equal(__m256i v, uint8_t n)
+{
+	return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(n)));
+}
+
+static inline AVX2 span_mask above_four(__m256i v)
+{
+	return _mm256_movemask_epi8(
+		_mm256_cmpeq_epi8(_mm256_max_epu8(v, _mm256_set1_epi8(5)), v));
+}
+
+/* Turns each bit of m into a byte of one or zero. */
+static inline AVX2 __m256i ones(span_mask m)
+{
+	const __m256i which_byte = _mm256_setr_epi8(
+		0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+		2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+	__m256i bytes = _mm256_shuffle_epi8(_mm256_set1_epi32(m), which_byte);
+	bytes = _mm256_and_si256(bytes,
+		_mm256_set1_epi64x(0x8040201008040201));
+	return _mm256_min_epu8(bytes, _mm256_set1_epi8(1));
+}
+
+/* Where the tiles of a span and those around it are kept. */
+struct span {
+	size_t here, above, below, left, right;
+};
+
+static AVX2 void flow_chemical(struct grid *g, enum chemical id,
+	const struct span *s, size_t x, size_t y, bool evaporates,
+	struct span_flowable *marks)
+{
+	uint8_t *plane = g->chemicals[id], *here = plane + s->here,
+		*left_of = plane + s->left, *right_of = plane + s->right;
+	__m256i amounts = _mm256_loadu_si256((__m256i *)here),
+		above = _mm256_loadu_si256((__m256i *)(plane + s->above)),
+		below = _mm256_loadu_si256((__m256i *)(plane + s->below));
+	span_mask room = ~equal(amounts, UINT8_MAX);
+	/* A tile flows if it has more than four units once a unit from the tile
+	 * on its left is counted. Which tiles flow is found like the carries of
+	 * an addition: more than four starts a flow and exactly four passes one
+	 * along. */
+	uint64_t start = above_four(amounts),
+		 start_or_pass = start | equal(amounts, 4);
+	span_mask flows = ((start_or_pass + start) ^ start_or_pass ^ start) >> 1;
+	amounts = _mm256_add_epi8(amounts, ones(flows << 1 & room));
+	/* Which neighbours each tile could flow to. Border tiles are full. */
+	span_mask up = ~equal(above, UINT8_MAX), down = ~equal(below, UINT8_MAX),
+		  right = room >> 1, left;
+	if (*right_of != UINT8_MAX)
+		right |= (span_mask)1 << (FLOW_SPAN - 1);
+	/* A tile is left full only if it flowed nowhere but left and did not
+	 * evaporate. Then it cannot flow left either if the tile to its left
+	 * was left full, and so on from the start of the span. */
+	bool left_full = *left_of == UINT8_MAX;
+	span_mask full = evaporates ? 0 :
+		flows & equal(amounts, UINT8_MAX) & ~up & ~right & ~down,
+		  stuck = left_full ? full & ~(full + 1) : 0;
+	left = ~(stuck << 1 | left_full);
+	__m256i out = _mm256_add_epi8(
+		_mm256_add_epi8(ones(flows & up), ones(flows & right)),
+		_mm256_add_epi8(ones(flows & down), ones(flows & left)));
+	amounts = _mm256_sub_epi8(amounts, out);
+	if (evaporates)
+		amounts = _mm256_subs_epu8(amounts, _mm256_set1_epi8(1));
+	/* Units flowing left arrive after a tile has evaporated. */
+	amounts = _mm256_add_epi8(amounts, ones((flows & left) >> 1));
+	_mm256_storeu_si256((__m256i *)here, amounts);
+	marks->here[id] = above_four(amounts);
+	/* Neighbours that got a unit may have had four before. */
+	marks->above[id] = marks->below[id] = 0;
+	if (flows & up) {
+		above = _mm256_add_epi8(above, ones(flows & up));
+		_mm256_storeu_si256((__m256i *)(plane + s->above), above);
+		marks->above[id] = above_four(above);
+	}
+	if (flows & down) {
+		below = _mm256_add_epi8(below, ones(flows & down));
+		_mm256_storeu_si256((__m256i *)(plane + s->below), below);
+		marks->below[id] = above_four(below);
+	}
+	if (flows & left & 1 && ++*left_of == 5)
+		grid_mark_flowable(g, id, x - 1, y, 1, 0);
+	if (flows & right & (span_mask)1 << (FLOW_SPAN - 1) && ++*right_of == 5)
+		grid_mark_flowable(g, id, x + FLOW_SPAN, y, 1, 0);
+}
+
+static AVX2 void evaporate_chemical(uint8_t *here)
+{
+	__m256i amounts = _mm256_loadu_si256((__m256i *)here);
+	amounts = _mm256_subs_epu8(amounts, _mm256_set1_epi8(1));
+	_mm256_storeu_si256((__m256i *)here, amounts);
+}
+
+bool flow_span(struct grid *g,
+	uint16_t flowing, uint16_t evaporating,
+	size_t x, size_t y, struct span_flowable *marks)
+{
+	if (!__builtin_cpu_supports("avx2"))
+		return false;
+	struct span s = {
+		.here = grid_index(g, x, y),
+		.above = grid_index(g, x, y - 1),
+		.below = grid_index(g, x, y + 1),
+		.left = grid_index(g, x - 1, y),
+		.right = grid_index(g, x + FLOW_SPAN, y),
+	};
+	for (uint16_t moving = flowing | evaporating; moving != 0;
+		moving &= moving - 1) {
+		unsigned idx = __builtin_ctz(moving);
+		if (flowing >> idx & 1)
+			flow_chemical(g, idx, &s, x, y,
+				evaporating >> idx & 1, marks);
+		else
+			evaporate_chemical(g->chemicals[idx] + s.here);
+	}
+	return true;
+}
+
+#else /* defined(__x86_64__) */
+
+bool flow_span(struct grid *g,
+	uint16_t flowing, uint16_t evaporating,
+	size_t x, size_t y, struct span_flowable *marks)
+{
+	(void)g, (void)flowing, (void)evaporating, (void)x, (void)y;
+	(void)marks;
+	return false;
+}
+
+#endif /* defined(__x86_64__) */
@@ -0,0 +1,50 @@
+/*
+ * The interface for moving chemicals along many tiles at once.
+ *
+ * Copyright (C) 2018 Jude Melton-Houghton
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * */
+
+#ifndef _FLOW_H
+
+#define _FLOW_H
+
+#include "grid.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* How many tiles flow_span works on. */
+#define FLOW_SPAN 32
+
+/* The flowable bits of a flowed span for each chemical, a bit for each tile.
+ * The bits of the span itself are all found again, while those of the rows
+ * above and below are only ever set. */
+struct span_flowable {
+	uint32_t here[N_CHEMICALS], above[N_CHEMICALS], below[N_CHEMICALS];
+};
+
+/* Flows and evaporates the chemicals of the FLOW_SPAN tiles of row y starting
+ * at x, with the same results as updating the tiles one after another when no
+ * animal acts in between. flowing and evaporating have a bit for each chemical
+ * moving this tick. The flowable bits of the span and the tiles above and below
+ * it are put in marks for each flowing chemical rather than in the grid, so
+ * that the caller can set each word at once. Returns false without doing
+ * anything if the CPU cannot do the tiles at once. */
+bool flow_span(struct grid *g,
+	uint16_t flowing, uint16_t evaporating,
+	size_t x, size_t y, struct span_flowable *marks);
+
+#endif /* Header guard */
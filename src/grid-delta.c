@@ -0,0 +1,452 @@
+/*
+ * The code for writing and applying the deltas between saves of a grid.
+ *
+ * Copyright (C) 2018 Jude Melton-Houghton
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * */
+
+/* For be64toh. */
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include "save.h"
+
+#include "animal.h"
+#include "grid.h"
+#include "registry.h"
+#include <endian.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A delta holds the blocks of DELTA_BLOCK by DELTA_BLOCK tiles which changed
+ * since the save before it. Blocks are told to have changed by fingerprints of
+ * their contents, so nothing needs to note each change as it is made. */
+#define DELTA_VERSION 1
+#define DELTA_BLOCK 64
+
+#if N_CHEMICALS > 15
+	#error "The chemicals of a tile no longer fit in its fingerprint!"
+#endif
+
+/* What comes before the fields of the grid. */
+#define DELTA_START (2 * sizeof(uint32_t) + GRID_SAVE_ID_SIZE)
+#define FIELDS_SIZE (3 * sizeof(uint16_t) + 4 * sizeof(uint32_t) \
+	+ 2 * sizeof(uint8_t))
+#define CHECKSUM_SIZE sizeof(uint64_t)
+
+struct block {
+	size_t x, y, width, height;
+};
+
+static uint64_t mix(uint64_t sum, uint64_t word)
+{
+	sum = (sum << 29 | sum >> 35) ^ word;
+	return sum * UINT64_C(0x9e3779b97f4a7c15);
+}
+
+static size_t blocks_per_row(const struct grid *g)
+{
+	return (g->width + DELTA_BLOCK - 1) / DELTA_BLOCK;
+}
+
+size_t grid_n_blocks(const struct grid *self)
+{
+	return blocks_per_row(self)
+		* ((self->height + DELTA_BLOCK - 1) / DELTA_BLOCK);
+}
+
+static struct block get_block(const struct grid *g, size_t b)
+{
+	struct block k;
+	k.x = b % blocks_per_row(g) * DELTA_BLOCK;
+	k.y = b / blocks_per_row(g) * DELTA_BLOCK;
+	k.width = g->width - k.x < DELTA_BLOCK ? g->width - k.x : DELTA_BLOCK;
+	k.height = g->height - k.y < DELTA_BLOCK ?
+		g->height - k.y : DELTA_BLOCK;
+	return k;
+}
+
+/* Gets how many tiles of row y from x on come one after another without
+ * leaving the block or going past 64. */
+static size_t run_in(const struct grid *g, const struct block *k,
+	size_t x, size_t y)
+{
+	size_t run = grid_run(g, x, y);
+	if (run > k->x + k->width - x)
+		run = k->x + k->width - x;
+	return run < 64 ? run : 64;
+}
+
+static uint64_t sum_animal(const struct animal *a)
+{
+	uint64_t sum = mix(0, a->brain->hash);
+	sum = mix(sum, (uint64_t)a->health << 48 | (uint64_t)a->energy << 32
+		| (uint64_t)a->instr_ptr << 16 | a->flags);
+	uint64_t stomach[2] = {0};
+	memcpy(stomach, a->stomach, N_CHEMICALS);
+	sum = mix(mix(sum, stomach[0]), stomach[1]);
+	for (uint16_t i = 0, n; i < a->brain->ram_size; i += n) {
+		const uint16_t *words = animal_ram_span(a, i, &n);
+		for (uint16_t j = 0; words && j < n; ++j) {
+			if (words[j])
+				sum = mix(sum, (uint64_t)(i + j) << 16
+					| words[j]);
+		}
+	}
+	return sum;
+}
+
+/* Gets the fingerprint of a block. Empty tiles are left out, so an empty block
+ * comes to zero. */
+static uint64_t sum_block(const struct grid *g, const struct block *k)
+{
+	uint64_t sum = 0;
+	for (size_t y = k->y; y < k->y + k->height; ++y) {
+		size_t run;
+		for (size_t x = k->x; x < k->x + k->width; x += run) {
+			run = run_in(g, k, x, y);
+			if (!grid_in_use(g, x, y))
+				continue;
+			size_t i = grid_index(g, x, y);
+			for (size_t j = 0; j < run; ++j) {
+				const struct tile *t = &g->tiles[i + j];
+				uint8_t contents[16] = {0};
+				for (enum chemical id = 0; id < N_CHEMICALS;
+					++id)
+					contents[id] = g->chemicals[id][i + j];
+				contents[15] = t->animal ? 2 : t->is_solid;
+				uint64_t words[2];
+				memcpy(words, contents, sizeof(words));
+				if (!(words[0] | words[1]))
+					continue;
+				sum = mix(sum, (y - k->y) * DELTA_BLOCK
+					+ x + j - k->x);
+				sum = mix(mix(sum, words[0]), words[1]);
+				if (t->animal)
+					sum = mix(sum, sum_animal(
+						grid_animal(g, t->animal)));
+			}
+		}
+	}
+	return sum;
+}
+
+size_t grid_sum_blocks(struct grid *self, uint64_t *sums,
+	const uint64_t *old)
+{
+	grid_catch_up_all(self);
+	size_t changed = 0;
+	for (size_t b = 0; b < grid_n_blocks(self); ++b) {
+		struct block k = get_block(self, b);
+		sums[b] = sum_block(self, &k);
+		changed += !old || sums[b] != old[b];
+	}
+	return changed;
+}
+
+static uint64_t checksum(const uint8_t *bytes, size_t size)
+{
+	uint64_t sum = size, word;
+	size_t i;
+	for (i = 0; i + sizeof(word) <= size; i += sizeof(word)) {
+		memcpy(&word, bytes + i, sizeof(word));
+		sum = mix(sum, be64toh(word));
+	}
+	word = 0;
+	memcpy(&word, bytes + i, size - i);
+	return mix(sum, be64toh(word));
+}
+
+static bool bit_at(const uint8_t *bits, size_t k)
+{
+	return bits[k / 8] >> k % 8 & 1;
+}
+
+/* Puts a block: its number, the amounts of each chemical row by row, bits for
+ * the rocks and for the animals, then the animals. The species of the animals
+ * not yet numbered are put in species. */
+static void put_block(const struct grid *g, size_t b,
+	struct buffer *dest,
+	struct buffer *species,
+	uint32_t *n_species)
+{
+	struct block k = get_block(g, b);
+	size_t n_tiles = k.width * k.height, n_bytes = (n_tiles + 7) / 8;
+	uint8_t *at = buffer_add(dest, sizeof(uint32_t)
+		+ N_CHEMICALS * n_tiles + 2 * n_bytes);
+	encode32(at, b);
+	uint8_t *amounts = at + sizeof(uint32_t),
+		*solid = amounts + N_CHEMICALS * n_tiles,
+		*occupied = solid + n_bytes;
+	memset(amounts, 0, N_CHEMICALS * n_tiles + 2 * n_bytes);
+	for (size_t y = k.y; y < k.y + k.height; ++y) {
+		size_t run;
+		for (size_t x = k.x; x < k.x + k.width; x += run) {
+			run = run_in(g, &k, x, y);
+			if (!grid_in_use(g, x, y))
+				continue;
+			size_t i = grid_index(g, x, y),
+			       first = (y - k.y) * k.width + x - k.x;
+			for (enum chemical id = 0; id < N_CHEMICALS; ++id)
+				memcpy(amounts + id * n_tiles + first,
+					&g->chemicals[id][i], run);
+			for (size_t j = 0; j < run; ++j) {
+				const struct tile *t = &g->tiles[i + j];
+				uint8_t *bits = t->animal ? occupied : solid;
+				if (t->animal || t->is_solid)
+					bits[(first + j) / 8] |=
+						1 << (first + j) % 8;
+			}
+		}
+	}
+	/* Writing animals may move the buffer. */
+	size_t occupied_at = occupied - dest->bytes;
+	for (size_t n = 0; n < n_tiles; ++n) {
+		if (!bit_at(dest->bytes + occupied_at, n))
+			continue;
+		const struct tile *t = grid_get_const_unck(g,
+			k.x + n % k.width, k.y + n / k.width);
+		const struct animal *a = grid_animal(g, t->animal);
+		if (a->brain->save_num == UINT32_MAX) {
+			a->brain->save_num = (*n_species)++;
+			brain_write(a->brain, species);
+		}
+		animal_write(a, dest);
+	}
+}
+
+#define RETURN_ERR (-1)
+int grid_write_delta(struct grid *g, const uint64_t *old,
+	const uint64_t *sums, const uint8_t *save_id, uint32_t seq,
+	FILE *dest, const char **err)
+{
+	for (uint32_t id = 0; id < registry_end(g->species); ++id) {
+		struct brain *b = registry_get(g->species, id);
+		if (b)
+			b->save_num = UINT32_MAX;
+	}
+
+	struct buffer delta = {0}, species = {0}, blocks = {0};
+	uint32_t n_species = 0, n_blocks = 0;
+	buffer_add(&blocks, sizeof(uint32_t));
+	for (size_t b = 0; b < grid_n_blocks(g); ++b) {
+		if (sums[b] == old[b])
+			continue;
+		put_block(g, b, &blocks, &species, &n_species);
+		++n_blocks;
+	}
+	encode32(blocks.bytes, n_blocks);
+
+	uint8_t *at = buffer_add(&delta, DELTA_START + FIELDS_SIZE
+		+ sizeof(uint32_t));
+	encode32(at, DELTA_VERSION);
+	memcpy(at + 4, save_id, GRID_SAVE_ID_SIZE);
+	encode32(at + 4 + GRID_SAVE_ID_SIZE, seq);
+	at += DELTA_START;
+	uint16_t fields16[3] = {g->tick, g->drop_interval, g->health};
+	encode16(at, fields16, 3);
+	encode32(at + 6, g->random);
+	encode32(at + 10, g->mutate_chance);
+	encode32(at + 14, g->width);
+	encode32(at + 18, g->height);
+	at[22] = g->drop_amount;
+	at[23] = g->random_kind;
+	encode32(at + 24, n_species);
+	memcpy(buffer_add(&delta, species.size), species.bytes, species.size);
+	memcpy(buffer_add(&delta, blocks.size), blocks.bytes, blocks.size);
+	uint64_t sum = checksum(delta.bytes, delta.size);
+	at = buffer_add(&delta, CHECKSUM_SIZE);
+	encode32(at, sum >> 32);
+	encode32(at + 4, sum);
+
+	bool failed = fwrite(delta.bytes, 1, delta.size, dest) != delta.size;
+	buffer_free(&delta);
+	buffer_free(&species);
+	buffer_free(&blocks);
+	if (failed)
+		FAIL(fwrite, err);
+	return 0;
+}
+#undef RETURN_ERR
+
+/* Empties the tiles of a block. */
+static void clear_block(struct grid *g, const struct block *k)
+{
+	for (size_t y = k->y; y < k->y + k->height; ++y) {
+		size_t run;
+		for (size_t x = k->x; x < k->x + k->width; x += run) {
+			run = run_in(g, k, x, y);
+			if (!grid_in_use(g, x, y))
+				continue;
+			size_t i = grid_index(g, x, y);
+			for (size_t j = 0; j < run; ++j) {
+				struct tile *t = &g->tiles[i + j];
+				if (t->animal) {
+					animal_free(g, t->animal);
+					tile_clear_animal(t, g);
+				}
+				t->is_solid = false;
+			}
+			uint64_t all = run < 64 ?
+				((uint64_t)1 << run) - 1 : UINT64_MAX;
+			for (enum chemical id = 0; id < N_CHEMICALS; ++id) {
+				memset(&g->chemicals[id][i], 0, run);
+				grid_mark_flowable(g, id, x, y, 0, all);
+			}
+		}
+	}
+}
+
+#define RETURN_ERR (-1)
+/* Replaces the contents of a block with those taken from src. */
+static int load_block(struct grid *g,
+	struct brain **species,
+	uint32_t n_species,
+	struct cursor *src,
+	const char **err)
+{
+	const uint8_t *bytes;
+	TAKE(bytes, sizeof(uint32_t), src, err);
+	uint32_t b = decode32(bytes);
+	if (b >= grid_n_blocks(g)) {
+		errno = EPROTO;
+		*err = "block number too high";
+		return -1;
+	}
+	struct block k = get_block(g, b);
+	size_t n_tiles = k.width * k.height, n_bytes = (n_tiles + 7) / 8;
+	TAKE(bytes, N_CHEMICALS * n_tiles + 2 * n_bytes, src, err);
+	const uint8_t *solid = bytes + N_CHEMICALS * n_tiles,
+		      *occupied = solid + n_bytes;
+	clear_block(g, &k);
+	for (size_t y = k.y; y < k.y + k.height; ++y) {
+		size_t run;
+		for (size_t x = k.x; x < k.x + k.width; x += run) {
+			run = run_in(g, &k, x, y);
+			size_t first = (y - k.y) * k.width + x - k.x;
+			for (enum chemical id = 0; id < N_CHEMICALS; ++id)
+				grid_load_amounts(g, id,
+					bytes + id * n_tiles + first, x, y,
+					run);
+		}
+	}
+	for (size_t n = 0; n < n_tiles; ++n) {
+		size_t x = k.x + n % k.width, y = k.y + n / k.width;
+		if (bit_at(occupied, n)) {
+			uint32_t a =
+				animal_read(g, species, n_species, src, err);
+			if (!a)
+				return -1;
+			struct tile *t = grid_get_unck(g, x, y);
+			tile_set_animal(t, g, a);
+			t->newly_occupied = false;
+		} else if (bit_at(solid, n)) {
+			grid_set_solid_unck(g, x, y, 1, 1, true);
+		}
+	}
+	return 0;
+}
+
+/* Takes the blocks of a delta from src after its species have been read. */
+static int load_blocks(struct grid *g,
+	struct brain **species,
+	uint32_t n_species,
+	struct cursor *src,
+	const char **err)
+{
+	const uint8_t *bytes;
+	TAKE(bytes, sizeof(uint32_t), src, err);
+	uint32_t n_blocks = decode32(bytes);
+	for (uint32_t i = 0; i < n_blocks; ++i) {
+		if (load_block(g, species, n_species, src, err))
+			return -1;
+	}
+	if (src->at != src->end) {
+		errno = EPROTO;
+		*err = "delta size mismatch";
+		return -1;
+	}
+	return 0;
+}
+
+int grid_apply_delta(struct grid *g, const uint8_t *delta, size_t size,
+	const uint8_t *save_id, uint32_t seq, const char **err)
+{
+	if (size < DELTA_START + CHECKSUM_SIZE) {
+		errno = EPROTO;
+		*err = "unexpected end of file";
+		return -1;
+	}
+	if (decode32(delta) != DELTA_VERSION) {
+		errno = EPROTONOSUPPORT;
+		*err = "delta format version mismatch";
+		return -1;
+	}
+	if (memcmp(delta + 4, save_id, GRID_SAVE_ID_SIZE)
+	 || decode32(delta + 4 + GRID_SAVE_ID_SIZE) != seq)
+		return 0;
+	size -= CHECKSUM_SIZE;
+	if (checksum(delta, size) != ((uint64_t)decode32(delta + size) << 32
+		| decode32(delta + size + 4))) {
+		errno = EPROTO;
+		*err = "delta checksum mismatch";
+		return -1;
+	}
+
+	struct cursor src = {delta + DELTA_START, delta + size};
+	const uint8_t *bytes;
+	TAKE(bytes, FIELDS_SIZE + sizeof(uint32_t), &src, err);
+	if (decode32(bytes + 14) != g->width
+	 || decode32(bytes + 18) != g->height) {
+		errno = EPROTO;
+		*err = "delta size mismatch";
+		return -1;
+	}
+	if (bytes[23] >= N_RANDOM_KINDS) {
+		errno = EPROTO;
+		*err = "unknown random generator";
+		return -1;
+	}
+	uint16_t fields16[3];
+	decode16(fields16, bytes, 3);
+	g->tick = fields16[0];
+	g->drop_interval = fields16[1];
+	g->health = fields16[2];
+	g->random = decode32(bytes + 6);
+	g->mutate_chance = decode32(bytes + 10);
+	g->drop_amount = bytes[22];
+	g->random_kind = bytes[23];
+
+	uint32_t n_species = decode32(bytes + 24);
+	if (n_species > (size_t)(src.end - src.at)) {
+		errno = EPROTO;
+		*err = "unexpected end of file";
+		return -1;
+	}
+	struct brain **species = calloc(n_species, sizeof(*species));
+	int failed = 0;
+	for (uint32_t i = 0; i < n_species && !failed; ++i) {
+		struct brain *b = brain_read(&src, err);
+		if (b)
+			species[i] = registry_add(g->species, b);
+		else
+			failed = -1;
+	}
+	if (!failed)
+		failed = load_blocks(g, species, n_species, &src, err);
+	free(species);
+	return failed ? failed : 1;
+}
+#undef RETURN_ERR
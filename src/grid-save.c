@@ -17,164 +17,357 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  * */
 
+/* For fileno and madvise. */
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
 #include "save.h"
 
 #include "animal.h"
 #include "grid.h"
+#include "registry.h"
 #include <arpa/inet.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define STORED_TILE_SIZE (sizeof(uint32_t) + N_CHEMICALS)
 
+/* How many bytes of tiles are gathered before they are written. */
+#define TILE_BUFFER_SIZE (1 << 16)
+
+void grid_catch_up_all(struct grid *g)
+{
+	for (size_t i = 0; i < g->width * g->height; ++i) {
+		if (!grid_in_use(g, i % g->width, i / g->width))
+			continue;
+		const struct tile *t =
+			grid_get_const_unck(g, i % g->width, i / g->width);
+		struct animal *a = t->animal ? grid_animal(g, t->animal) : NULL;
+		if (a && a->sleep_steps > 0)
+			animal_wake(a, g->tick);
+	}
+	grid_evaporate_all(g);
+}
+
+int grid_write(struct grid *g, FILE *dest, const char **err)
+{
+	grid_catch_up_all(g);
+	return grid_write_sections(g, dest, false, err);
+}
+
+int grid_write_packed(struct grid *g, FILE *dest, const char **err)
+{
+	grid_catch_up_all(g);
+	return grid_write_sections(g, dest, true, err);
+}
+
+int grid_write_stream(struct grid *g, FILE *dest, const char **err)
+{
+	grid_catch_up_all(g);
+	return grid_write_stream_sections(g, dest, err);
+}
+
+/* Puts everything before the tiles. */
+static void write_head(struct grid *g, struct buffer *dest)
+{
+	uint8_t *at = buffer_add(dest, 4 * sizeof(uint32_t)
+		+ 3 * sizeof(uint16_t) + 2 * sizeof(uint8_t));
+	encode32(at, 5);
+	uint16_t fields16[3] = {g->tick, g->drop_interval, g->health};
+	encode16(at + 4, fields16, 3);
+	encode32(at + 10, g->random);
+	encode32(at + 14, g->mutate_chance);
+	at[18] = g->drop_amount;
+	at[19] = g->random_kind;
+	size_t n_species_at = 20;
+	uint32_t n_species = 0;
+	for (uint32_t id = 0; id < registry_end(g->species); ++id) {
+		struct brain *b = registry_get(g->species, id);
+		if (!b)
+			continue;
+		b->save_num = n_species++;
+		brain_write(b, dest);
+	}
+	encode32(dest->bytes + n_species_at, n_species);
+	at = buffer_add(dest, 2 * sizeof(uint32_t));
+	encode32(at, g->width);
+	encode32(at + 4, g->height);
+}
+
+/* Puts the run of tiles of row y from x on. Their animals are put in animals,
+ * which come after all tiles_left tiles still to be put. */
+static void write_tiles(const struct grid *g, size_t x, size_t y, size_t run,
+	size_t tiles_left,
+	struct buffer *dest,
+	struct buffer *animals)
+{
+	uint8_t *at = buffer_add(dest, run * STORED_TILE_SIZE);
+	if (!grid_in_use(g, x, y)) {
+		memset(at, 0, run * STORED_TILE_SIZE);
+		return;
+	}
+	size_t i = grid_index(g, x, y);
+	for (enum chemical id = 0; id < N_CHEMICALS; ++id) {
+		const uint8_t *amounts = &g->chemicals[id][i];
+		for (size_t j = 0; j < run; ++j)
+			at[j * STORED_TILE_SIZE + sizeof(uint32_t) + id] =
+				amounts[j];
+	}
+	const struct tile *t = grid_get_const_unck(g, x, y);
+	for (size_t j = 0; j < run; ++j, at += STORED_TILE_SIZE) {
+		/* The animal is found this far from its tile. */
+		uint32_t animal_off = t[j].is_solid;
+		if (t[j].animal) {
+			animal_off = (tiles_left - j) * STORED_TILE_SIZE
+				+ animals->size;
+			animal_write(grid_animal(g, t[j].animal), animals);
+		}
+		encode32(at, animal_off);
+	}
+}
+
 #define RETURN_ERR (-1)
-static int write_tile(const struct tile *t,
-	uint32_t animal_off,
-	FILE *dest,
-	const char **err)
+int grid_write_v5(struct grid *g, FILE *dest, const char **err)
 {
-	animal_off = htonl(animal_off);
-	FWRITE(&animal_off, sizeof(animal_off), 1, dest, err);
-	FWRITE(t->chemicals, sizeof(*t->chemicals), N_CHEMICALS, dest, err);
+	grid_catch_up_all(g);
+
+	struct buffer head = {0}, tiles = {0}, animals = {0};
+	write_head(g, &head);
+	size_t written = fwrite(head.bytes, 1, head.size, dest);
+	bool failed = written != head.size;
+	size_t tiles_left = g->width * g->height;
+	for (size_t y = 0; y < g->height && !failed; ++y) {
+		size_t run;
+		for (size_t x = 0; x < g->width; x += run) {
+			run = grid_run(g, x, y);
+			write_tiles(g, x, y, run, tiles_left, &tiles, &animals);
+			tiles_left -= run;
+		}
+		if (tiles.size >= TILE_BUFFER_SIZE || y == g->height - 1) {
+			failed = fwrite(tiles.bytes, 1, tiles.size, dest)
+				!= tiles.size;
+			tiles.size = 0;
+		}
+	}
+	if (!failed && animals.size > 0)
+		failed = fwrite(animals.bytes, 1, animals.size, dest)
+			!= animals.size;
+	buffer_free(&head);
+	buffer_free(&tiles);
+	buffer_free(&animals);
+	if (failed)
+		FAIL(fwrite, err);
 	return 0;
 }
+#undef RETURN_ERR
 
-int grid_write(struct grid *g, FILE *dest, const char **err)
+#define RETURN_ERR (-1)
+/* Reads the run of n (at most 64) stored tiles of row y from x on. The save
+ * ends at end. */
+static int read_tiles(struct grid *g,
+	struct brain **species,
+	uint32_t n_species,
+	size_t x, size_t y, size_t n,
+	const uint8_t *stored,
+	const uint8_t *end,
+	const char **err)
 {
-	uint32_t version = htonl(SERIALIZATION_VERSION);
-	FWRITE(&version, sizeof(version), 1, dest, err);
-
-	uint16_t fields16[3] = {
-		htons(g->tick), htons(g->drop_interval), htons(g->health)
-	};
-	FWRITE(fields16, sizeof(*fields16), 3, dest, err);
-	uint32_t fields32[2] = {htonl(g->random), htonl(g->mutate_chance)};
-	FWRITE(fields32, sizeof(*fields32), 2, dest, err);
-	FWRITE(&g->drop_amount, sizeof(g->drop_amount), 1, dest, err);
-
-	long n_species_off;
-	FTELL(&n_species_off, dest, err);
-	uint32_t n_species;
-	FSEEK(dest, sizeof(n_species), SEEK_CUR, err);
-	struct brain *b;
-	n_species = 0;
-	SLLIST_FOR_EACH(g->species, b) {
-		b->save_num = htonl(n_species++);
-		if (brain_write(b, dest, err))
-			return -1;
-	}
-	n_species = htonl(n_species);
-	long species_end;
-	FTELL(&species_end, dest, err);
-	if (fseek(dest, n_species_off, SEEK_SET))
-		FAIL(fseek, err);
-	FWRITE(&n_species, sizeof(n_species), 1, dest, err);
-	if (fseek(dest, species_end, SEEK_SET))
-		FAIL(fseek, err);
-
-	uint32_t dimensions[2] = {htonl(g->width), htonl(g->height)};
-	FWRITE(dimensions, sizeof(*dimensions), 2, dest, err);
-	long next_tile, next_animal;
-	FTELL(&next_tile, dest, err);
-	next_animal = next_tile + g->width * g->height * STORED_TILE_SIZE;
-	for (size_t i = 0; i < g->width * g->height; ++i) {
-		const struct tile *t = &g->tiles[i];
-		if (t->animal) {
-			if (write_tile(t, next_animal - next_tile, dest, err))
-				return -1;
-			next_tile += STORED_TILE_SIZE;
-			FSEEK(dest, next_animal, SEEK_SET, err);
-			if (animal_write(t->animal, dest, err))
+	for (enum chemical id = 0; id < N_CHEMICALS; ++id) {
+		uint8_t amounts[64];
+		for (size_t j = 0; j < n; ++j)
+			amounts[j] = stored[j * STORED_TILE_SIZE
+				+ sizeof(uint32_t) + id];
+		grid_load_amounts(g, id, amounts, x, y, n);
+	}
+	for (size_t j = 0; j < n; ++j, stored += STORED_TILE_SIZE) {
+		uint32_t animal = decode32(stored);
+		if (animal > 1) {
+			if (animal > (size_t)(end - stored)) {
+				errno = EPROTO;
+				*err = "unexpected end of file";
 				return -1;
-			FTELL(&next_animal, dest, err);
-			FSEEK(dest, next_tile, SEEK_SET, err);
-		} else {
-			if (write_tile(t, t->is_solid, dest, err))
+			}
+			struct cursor at = {stored + animal, end};
+			uint32_t a =
+				animal_read(g, species, n_species, &at, err);
+			if (!a)
 				return -1;
-			next_tile += STORED_TILE_SIZE;
+			struct tile *t = grid_get_unck(g, x + j, y);
+			tile_set_animal(t, g, a);
+			t->newly_occupied = false;
+		} else if (animal == 1) {
+			grid_set_solid_unck(g, x + j, y, 1, 1, true);
 		}
 	}
 	return 0;
 }
 #undef RETURN_ERR
 
+static void free_species(struct brain **species, uint32_t n_species)
+{
+	for (uint32_t i = 0; i < n_species; ++i)
+		brain_free(species[i]);
+	free(species);
+}
+
 #define RETURN_ERR NULL
 /* TODO: Fix all the possible memory leaks here. */
-struct grid *grid_read(FILE *src, const char **err)
+static struct grid *load_records(const uint8_t *save, size_t size,
+	uint32_t version,
+	const char **err)
 {
-	uint32_t version;
-	FREAD(&version, sizeof(version), 1, src, err);
-	if (ntohl(version) != SERIALIZATION_VERSION) {
-		errno = EPROTONOSUPPORT; /* I don't think that this is what
-					  * EPROTONOSUPPORT is meant for, but
-					  * it's close enough. */
-		*err = "format version mismatch";
-		return NULL;
+	struct cursor src = {save + sizeof(uint32_t), save + size};
+	const uint8_t *bytes;
+	TAKE(bytes, 3 * sizeof(uint16_t) + 2 * sizeof(uint32_t)
+		+ sizeof(uint8_t), &src, err);
+	uint16_t fields16[3];
+	decode16(fields16, bytes, 3);
+	uint32_t random = decode32(bytes + 6),
+		 mutate_chance = decode32(bytes + 10);
+	uint8_t drop_amount = bytes[14];
+	uint8_t random_kind = RANDOM_SERIAL;
+	if (version >= 5) {
+		TAKE(bytes, sizeof(random_kind), &src, err);
+		random_kind = *bytes;
+		if (random_kind >= N_RANDOM_KINDS) {
+			errno = EPROTO;
+			*err = "unknown random generator";
+			return NULL;
+		}
 	}
 
-	/* These fields will be converted to host format later. */
-	uint16_t fields16[3];
-	uint32_t fields32[2];
-	uint8_t drop_amount;
-	FREAD(fields16, sizeof(*fields16), 3, src, err);
-	FREAD(fields32, sizeof(*fields32), 2, src, err);
-	FREAD(&drop_amount, sizeof(drop_amount), 1, src, err);
-
-	uint32_t n_species;
-	FREAD(&n_species, sizeof(n_species), 1, src, err);
-	n_species = ntohl(n_species);
+	TAKE(bytes, sizeof(uint32_t), &src, err);
+	uint32_t n_species = decode32(bytes);
 	struct brain **species = calloc(n_species, sizeof(struct brain *));
 	if (!species) {
 		*err = "too many species";
 		return NULL;
 	}
 	for (uint32_t i = 0; i < n_species; ++i) {
-		struct brain *b = brain_read(src, err);
+		struct brain *b = brain_read(&src, err);
 		if (!b)
 			return NULL;
 		species[i] = b;
 	}
-	uint32_t dims[2];
-	FREAD(dims, sizeof(*dims), 2, src, err);
+	TAKE(bytes, 2 * sizeof(uint32_t), &src, err);
+	size_t width = decode32(bytes), height = decode32(bytes + 4);
+	if (width == 0 || height == 0) {
+		free_species(species, n_species);
+		errno = EPROTO;
+		*err = "empty grid";
+		return NULL;
+	}
+	/* This is divided rather than multiplied so that it cannot overflow. */
+	if ((size_t)(src.end - src.at) / STORED_TILE_SIZE < width * height) {
+		free_species(species, n_species);
+		errno = EPROTO;
+		*err = "unexpected end of file";
+		return NULL;
+	}
+	const uint8_t *tiles = src.at;
 	// TODO: Use a function with less built-in initialization.
-	struct grid *g = grid_new(ntohl(dims[0]), ntohl(dims[1]));
-	g->tick = ntohs(fields16[0]);
-	g->drop_interval = ntohs(fields16[1]);
-	g->health = ntohs(fields16[2]);
-	g->random = ntohl(fields32[0]);
-	g->mutate_chance = ntohl(fields32[1]);
+	struct grid *g = grid_new(width, height);
+	if (!g) {
+		free_species(species, n_species);
+		errno = ENOMEM;
+		*err = "grid too big";
+		return NULL;
+	}
+	g->tick = fields16[0];
+	g->drop_interval = fields16[1];
+	g->health = fields16[2];
+	g->random = random;
+	g->random_kind = random_kind;
+	g->mutate_chance = mutate_chance;
 	g->drop_amount = drop_amount;
+	/* Species saved more than once are merged. */
+	for (uint32_t i = 0; i < n_species; ++i)
+		species[i] = registry_add(g->species, species[i]);
 
-	long next_tile = ftell(src);
-	if (next_tile == -1)
-		return NULL;
-	for (size_t i = 0; i < g->width * g->height; ++i) {
-		uint32_t animal;
-		FREAD(&animal, sizeof(animal), 1, src, err);
-		FREAD(g->tiles[i].chemicals, sizeof(*g->tiles[i].chemicals),
-			N_CHEMICALS, src, err);
-		next_tile += STORED_TILE_SIZE;
-		animal = ntohl(animal);
-		if (animal > 1) {
-			FSEEK(src, animal - STORED_TILE_SIZE, SEEK_CUR, err);
-			struct animal *a =
-				animal_read(species, n_species, src, err);
-			if (!a) {
+	for (size_t y = 0; y < height; ++y) {
+		size_t run;
+		for (size_t x = 0; x < width; x += run) {
+			run = grid_run(g, x, y);
+			if (run > 64)
+				run = 64;
+			if (read_tiles(g, species, n_species, x, y, run,
+				tiles + (y * width + x) * STORED_TILE_SIZE,
+				src.end, err))
 				return NULL;
-			}
-			g->tiles[i].animal = a;
-			g->tiles[i].is_solid = true;
-			FSEEK(src, next_tile, SEEK_SET, err);
-		} else {
-			g->tiles[i].animal = NULL;
-			g->tiles[i].is_solid = animal;
 		}
-		g->tiles[i].newly_occupied = false;
 	}
 
-	for (size_t i = 0; i < n_species; ++i) {
-		species[i]->next = g->species;
-		g->species = species[i];
-	}
 	free(species);
 	return g;
 }
+
+/* Reads what is left of src after the format version number, putting the number
+ * back at the start. */
+static uint8_t *read_rest(FILE *src, uint32_t version, size_t *size,
+	const char **err)
+{
+	size_t cap = 1 << 16;
+	uint8_t *copy = malloc(cap);
+	encode32(copy, version);
+	*size = sizeof(uint32_t);
+	for (;;) {
+		*size += fread(copy + *size, 1, cap - *size, src);
+		if (*size < cap)
+			break;
+		cap *= 2;
+		copy = realloc(copy, cap);
+	}
+	if (ferror(src)) {
+		free(copy);
+		FAIL(fread, err);
+	}
+	return copy;
+}
+
+struct grid *grid_read(FILE *src, const char **err)
+{
+	long start = ftell(src);
+	uint32_t version;
+	FREAD(&version, sizeof(version), 1, src, err);
+	version = ntohl(version);
+	if (version < OLDEST_SERIALIZATION_VERSION
+	 || version > SERIALIZATION_VERSION) {
+		errno = EPROTONOSUPPORT; /* I don't think that this is what
+					  * EPROTONOSUPPORT is meant for, but
+					  * it's close enough. */
+		*err = "format version mismatch";
+		return NULL;
+	}
+	if (version == SERIALIZATION_VERSION)
+		return grid_read_stream(src, err);
+
+	/* The save is mapped into memory when it is in a file that can be
+	 * mapped. Otherwise it is read into a copy. */
+	struct stat st;
+	void *mapped = MAP_FAILED;
+	int fd = fileno(src);
+	if (start >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+	 && st.st_size > start)
+		mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	const uint8_t *save;
+	size_t size;
+	uint8_t *copy = NULL;
+	if (mapped != MAP_FAILED) {
+		madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+		save = (const uint8_t *)mapped + start;
+		size = st.st_size - start;
+	} else {
+		copy = read_rest(src, version, &size, err);
+		if (!copy)
+			return NULL;
+		save = copy;
+	}
+	struct grid *g = version >= 6 ? grid_load_sections(save, size, err)
+		: load_records(save, size, version, err);
+	if (mapped != MAP_FAILED)
+		munmap(mapped, st.st_size);
+	free(copy);
+	return g;
+}
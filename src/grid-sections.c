@@ -0,0 +1,1322 @@
+/*
+ * The code for writing grids to and reading grids from saves in sections.
+ *
+ * Copyright (C) 2018 Jude Melton-Houghton
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * */
+
+/* For htole64 and the like. */
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include "save.h"
+
+#include "animal.h"
+#include "grid.h"
+#include "pack.h"
+#include "registry.h"
+#include <arpa/inet.h>
+#include <endian.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A save is a header, an index of sections, then the sections. Each section
+ * starts a multiple of SECTION_ALIGN bytes into the save and is padded with
+ * zeros to the next such multiple. Everything but the format version number is
+ * little-endian, so a save can be used straight from memory. A packed save has
+ * its sections packed instead, so it must be unpacked as it is read. A stream
+ * holds what a packed save does, but with each species next to its code and
+ * each animal next to its RAM, so that it can be read and written in order. */
+enum section {
+	SECTION_SPECIES,
+	SECTION_CODE,
+	SECTION_CHEMICALS,
+	SECTION_SOLID,
+	SECTION_OCCUPIED,
+	SECTION_ANIMALS,
+	SECTION_RAM,
+
+	N_SECTIONS
+};
+
+#define SECTION_ALIGN 64
+#define HEADER_SIZE 64
+#define INDEX_ENTRY_SIZE 24
+#define FIRST_SECTION 256
+#define SPECIES_SIZE 8
+#define INSTRUCTION_SIZE 6
+#define ANIMAL_SIZE 24
+/* How far from where it was expected a packed species may copy code from the
+ * species before it. */
+#define COPY_WINDOW 32
+/* Shorter matches of code are left as they are. */
+#define MIN_COPY 2
+
+/* A stream is split into frames, each put once what has been packed fills the
+ * buffer of a save being written. A frame holds whole runs and animals, so it
+ * is never bigger than that plus the biggest species. */
+#define MAX_FRAME (1 << 20)
+
+#if HEADER_SIZE + N_SECTIONS * INDEX_ENTRY_SIZE > FIRST_SECTION
+	#error "The index of sections runs into the first section!"
+#endif
+
+/* Where the fields are in the header. */
+#define AT_VERSION 0
+#define AT_TICK 4
+#define AT_DROP_INTERVAL 6
+#define AT_HEALTH 8
+#define AT_RANDOM_KIND 10
+#define AT_DROP_AMOUNT 11
+#define AT_RANDOM 12
+#define AT_MUTATE_CHANCE 16
+#define AT_WIDTH 20
+#define AT_HEIGHT 24
+#define AT_N_SPECIES 28
+#define AT_N_ANIMALS 32
+
+#define SUM_START UINT64_C(0xcbf29ce484222325)
+
+static uint64_t align(uint64_t n)
+{
+	return (n + SECTION_ALIGN - 1) / SECTION_ALIGN * SECTION_ALIGN;
+}
+
+static void put16(uint8_t *at, uint16_t n)
+{
+	n = htole16(n);
+	memcpy(at, &n, sizeof(n));
+}
+
+static void put32(uint8_t *at, uint32_t n)
+{
+	n = htole32(n);
+	memcpy(at, &n, sizeof(n));
+}
+
+static void put64(uint8_t *at, uint64_t n)
+{
+	n = htole64(n);
+	memcpy(at, &n, sizeof(n));
+}
+
+static uint16_t get16(const uint8_t *at)
+{
+	uint16_t n;
+	memcpy(&n, at, sizeof(n));
+	return le16toh(n);
+}
+
+static uint32_t get32(const uint8_t *at)
+{
+	uint32_t n;
+	memcpy(&n, at, sizeof(n));
+	return le32toh(n);
+}
+
+static uint64_t get64(const uint8_t *at)
+{
+	uint64_t n;
+	memcpy(&n, at, sizeof(n));
+	return le64toh(n);
+}
+
+/* Adds size bytes, a multiple of eight, to the checksum of a section. A word
+ * is taken in at a time, which is fast enough to check a save as it is read. */
+static uint64_t add_to_sum(uint64_t sum, const uint8_t *bytes, size_t size)
+{
+	for (size_t i = 0; i < size; i += sizeof(uint64_t)) {
+		sum = (sum << 29 | sum >> 35) ^ get64(bytes + i);
+		sum *= UINT64_C(0x9e3779b97f4a7c15);
+	}
+	return sum;
+}
+
+/* Bytes wait in buf to be written, so that writing is done in big pieces. */
+struct out {
+	FILE *dest;
+	const char **err;
+	uint64_t at;	/* How many bytes into the save the next byte goes. */
+	struct {
+		uint64_t offset, size, sum;
+	} index[N_SECTIONS];
+	enum section section;
+	uint64_t sum;
+	/* Whether sections are packed, first into packing, and whether what is
+	 * packed is put as frames of a stream rather than in sections. */
+	bool packed, streamed;
+	struct buffer packing;
+	size_t used;
+	uint8_t buf[1 << 16];
+};
+
+#define RETURN_ERR (-1)
+static int flush(struct out *o)
+{
+	o->sum = add_to_sum(o->sum, o->buf, o->used);
+	FWRITE(o->buf, 1, o->used, o->dest, o->err);
+	o->used = 0;
+	return 0;
+}
+#undef RETURN_ERR
+
+/* Puts n bytes from src, or n zeros if src is NULL. */
+static int put(struct out *o, const void *src, size_t n)
+{
+	const uint8_t *bytes = src;
+	while (n > 0) {
+		size_t part = sizeof(o->buf) - o->used;
+		if (part > n)
+			part = n;
+		if (bytes) {
+			memcpy(o->buf + o->used, bytes, part);
+			bytes += part;
+		} else {
+			memset(o->buf + o->used, 0, part);
+		}
+		o->used += part;
+		o->at += part;
+		n -= part;
+		if (o->used == sizeof(o->buf) && flush(o))
+			return -1;
+	}
+	return 0;
+}
+
+#define RETURN_ERR (-1)
+/* Puts what has been packed as a frame: its size, the bytes, then their
+ * checksum, taken as for a section. */
+static int put_frame(struct out *o)
+{
+	size_t size = o->packing.size;
+	if (size == 0)
+		return 0;
+	memset(buffer_add(&o->packing, sizeof(uint64_t)), 0,
+		sizeof(uint64_t));
+	uint8_t head[4], tail[8];
+	put32(head, size);
+	put64(tail, add_to_sum(SUM_START, o->packing.bytes,
+		(size + 7) / 8 * 8));
+	FWRITE(head, sizeof(head), 1, o->dest, o->err);
+	FWRITE(o->packing.bytes, size, 1, o->dest, o->err);
+	FWRITE(tail, sizeof(tail), 1, o->dest, o->err);
+	return 0;
+}
+#undef RETURN_ERR
+
+/* Puts what has been packed once there is enough of it, or all of it if all is
+ * true. */
+static int put_packing(struct out *o, bool all)
+{
+	if (o->packing.size < sizeof(o->buf) && !all)
+		return 0;
+	int ret = o->streamed ? put_frame(o)
+		: put(o, o->packing.bytes, o->packing.size);
+	o->packing.size = 0;
+	return ret;
+}
+
+static void start_section(struct out *o, enum section s)
+{
+	o->section = s;
+	o->index[s].offset = o->at;
+	o->sum = SUM_START;
+}
+
+static int end_section(struct out *o)
+{
+	if (put_packing(o, true))
+		return -1;
+	if (o->streamed)
+		return 0;
+	o->index[o->section].size = o->at - o->index[o->section].offset;
+	if (put(o, NULL, align(o->at) - o->at) || flush(o))
+		return -1;
+	o->index[o->section].sum = o->sum;
+	return 0;
+}
+
+static void put_instruction(uint8_t *record, const struct instruction *instr)
+{
+	record[0] = instr->opcode;
+	record[1] = instr->l_fmt << 4 | instr->r_fmt;
+	put16(record + 2, instr->left);
+	put16(record + 4, instr->right);
+}
+
+/* Puts the code of a species in dest as records, in place of what it held. */
+static void put_code(struct buffer *dest, const struct brain *b)
+{
+	dest->size = 0;
+	uint8_t *record = buffer_add(dest, b->code_size * INSTRUCTION_SIZE);
+	for (uint16_t i = 0; i < b->code_size; ++i)
+		put_instruction(record + i * INSTRUCTION_SIZE,
+			&BRAIN_INSTR(b, i));
+}
+
+/* Counts how many instructions from a on are the same as those from b on. */
+static size_t match(const uint8_t *a, size_t a_left,
+	const uint8_t *b, size_t b_left)
+{
+	size_t n = 0;
+	while (n < a_left && n < b_left
+	 && !memcmp(a + n * INSTRUCTION_SIZE, b + n * INSTRUCTION_SIZE,
+		INSTRUCTION_SIZE))
+		++n;
+	return n;
+}
+
+/* Puts the instructions from start to before end as they are, if there are
+ * any. */
+static void put_literal(struct buffer *dest, const uint8_t *code,
+	size_t start, size_t end)
+{
+	if (start == end)
+		return;
+	pack_number(dest, (uint64_t)(end - start) << 1);
+	memcpy(buffer_add(dest, (end - start) * INSTRUCTION_SIZE),
+		code + start * INSTRUCTION_SIZE,
+		(end - start) * INSTRUCTION_SIZE);
+}
+
+/* Packs the code of a species as runs copied from the code of the species
+ * before it and runs of instructions as they are. Mutants mostly differ from
+ * the species they came from by a few instructions, and are often next to it.
+ * Each run is a number n, followed by where to copy n >> 1 instructions from in
+ * the code before if n is odd, or by n >> 1 instructions if n is even. */
+static void pack_code(struct buffer *dest, const uint8_t *code, size_t size,
+	const uint8_t *before, size_t before_size)
+{
+	size_t i = 0, literal = 0, expected = 0;
+	while (i < size) {
+		size_t best = 0, from = 0;
+		for (size_t d = 0; d <= 2 * COPY_WINDOW; ++d) {
+			/* The places nearest the one expected come first. */
+			size_t at = d % 2 ? expected + (d + 1) / 2
+				: expected - d / 2;
+			if (at >= before_size)
+				continue;
+			size_t n = match(code + i * INSTRUCTION_SIZE, size - i,
+				before + at * INSTRUCTION_SIZE,
+				before_size - at);
+			if (n > best) {
+				best = n;
+				from = at;
+			}
+		}
+		if (best < MIN_COPY) {
+			++i;
+			++expected;
+			continue;
+		}
+		put_literal(dest, code, literal, i);
+		pack_number(dest, (uint64_t)best << 1 | 1);
+		pack_number(dest, from);
+		i += best;
+		literal = i;
+		expected = from + best;
+	}
+	put_literal(dest, code, literal, size);
+}
+
+static int put_species(struct grid *g, struct out *o, uint32_t *n_species)
+{
+	*n_species = 0;
+	start_section(o, SECTION_SPECIES);
+	for (uint32_t id = 0; id < registry_end(g->species); ++id) {
+		struct brain *b = registry_get(g->species, id);
+		if (!b)
+			continue;
+		b->save_num = (*n_species)++;
+		if (o->packed) {
+			pack_number(&o->packing, b->signature);
+			pack_number(&o->packing, b->ram_size);
+			pack_number(&o->packing, b->code_size);
+			if (put_packing(o, false))
+				return -1;
+			continue;
+		}
+		uint8_t record[SPECIES_SIZE] = {0};
+		put16(record, b->signature);
+		put16(record + 2, b->ram_size);
+		put16(record + 4, b->code_size);
+		if (put(o, record, sizeof(record)))
+			return -1;
+	}
+	if (end_section(o))
+		return -1;
+
+	start_section(o, SECTION_CODE);
+	/* Packed code is copied from the species before. */
+	struct buffer code = {0}, before = {0};
+	int ret = 0;
+	for (uint32_t id = 0; id < registry_end(g->species) && !ret; ++id) {
+		const struct brain *b = registry_get(g->species, id);
+		if (!b)
+			continue;
+		put_code(&code, b);
+		if (!o->packed) {
+			ret = put(o, code.bytes, code.size);
+			continue;
+		}
+		pack_code(&o->packing, code.bytes, b->code_size,
+			before.bytes, before.size / INSTRUCTION_SIZE);
+		ret = put_packing(o, false);
+		struct buffer swap = code;
+		code = before;
+		before = swap;
+	}
+	buffer_free(&code);
+	buffer_free(&before);
+	return ret ? ret : end_section(o);
+}
+
+static int put_chemicals(const struct grid *g, struct out *o)
+{
+	start_section(o, SECTION_CHEMICALS);
+	struct packer packer = {.dest = &o->packing};
+	for (enum chemical id = 0; id < N_CHEMICALS; ++id) {
+		for (size_t y = 0; y < g->height; ++y) {
+			size_t run;
+			for (size_t x = 0; x < g->width; x += run) {
+				/* What is packed is put in bounded pieces. */
+				run = grid_run(g, x, y);
+				if (run > sizeof(o->buf))
+					run = sizeof(o->buf);
+				const uint8_t *amounts = grid_in_use(g, x, y) ?
+					&g->chemicals[id][grid_index(g, x, y)]
+					: NULL;
+				if (!o->packed) {
+					if (put(o, amounts, run))
+						return -1;
+					continue;
+				}
+				pack_bytes(&packer, amounts, run);
+				if (put_packing(o, false))
+					return -1;
+			}
+		}
+	}
+	if (o->packed)
+		pack_end(&packer);
+	return end_section(o);
+}
+
+/* Puts a bit for each tile, the first tile of each byte in its lowest bit. The
+ * bit is whether the tile holds an animal for SECTION_OCCUPIED, or whether it
+ * is a rock for SECTION_SOLID. Packed, each set bit is put as the number of
+ * clear bits since the set bit before it. */
+static int put_bits(const struct grid *g, struct out *o, enum section s)
+{
+	start_section(o, s);
+	uint8_t byte = 0;
+	size_t k = 0;
+	uint64_t gap = 0;
+	for (size_t y = 0; y < g->height; ++y) {
+		size_t run;
+		for (size_t x = 0; x < g->width; x += run) {
+			run = grid_run(g, x, y);
+			bool in_use = grid_in_use(g, x, y);
+			if (!in_use && o->packed) {
+				gap += run;
+				continue;
+			}
+			const struct tile *t = grid_get_const_unck(g, x, y);
+			for (size_t i = 0; i < run; ++i, ++k) {
+				bool bit = in_use && (s == SECTION_OCCUPIED ?
+					t[i].animal != 0
+					: t[i].is_solid && !t[i].animal);
+				if (o->packed) {
+					if (bit)
+						pack_number(&o->packing, gap);
+					gap = bit ? 0 : gap + 1;
+					continue;
+				}
+				byte |= bit << k % 8;
+				if (k % 8 == 7) {
+					if (put(o, &byte, 1))
+						return -1;
+					byte = 0;
+				}
+			}
+		}
+		if (put_packing(o, false))
+			return -1;
+	}
+	if (!o->packed && k % 8 != 0 && put(o, &byte, 1))
+		return -1;
+	return end_section(o);
+}
+
+/* Packs an animal as numbers: its species number, health, energy, instruction
+ * pointer and flags, then a bit for each chemical in its stomach followed by
+ * the amounts of those chemicals. */
+static void pack_animal(struct buffer *dest, const struct animal *a)
+{
+	pack_number(dest, a->brain->save_num);
+	pack_number(dest, a->health);
+	pack_number(dest, a->energy);
+	pack_number(dest, a->instr_ptr);
+	pack_number(dest, a->flags);
+	uint64_t in_stomach = 0;
+	for (enum chemical id = 0; id < N_CHEMICALS; ++id)
+		in_stomach |= (uint64_t)(a->stomach[id] != 0) << id;
+	pack_number(dest, in_stomach);
+	for (enum chemical id = 0; id < N_CHEMICALS; ++id) {
+		if (a->stomach[id])
+			*buffer_add(dest, 1) = a->stomach[id];
+	}
+}
+
+/* Packs the RAM of an animal, gathering it in words first. */
+static void pack_ram(struct buffer *dest, const struct animal *a,
+	uint16_t *words)
+{
+	for (uint16_t w = 0; w < a->brain->ram_size; ++w)
+		words[w] = animal_ram(a, w);
+	pack_words(dest, words, a->brain->ram_size);
+}
+
+/* Puts the animals in the order of their tiles, row by row, or their RAM if
+ * ram is true. */
+static int put_animals(const struct grid *g, struct out *o, bool ram,
+	uint32_t *n_animals)
+{
+	*n_animals = 0;
+	start_section(o, ram ? SECTION_RAM : SECTION_ANIMALS);
+	uint16_t *words = NULL;
+	if (ram && o->packed)
+		words = malloc((UINT16_MAX + 1) * sizeof(*words));
+	for (size_t y = 0; y < g->height; ++y) {
+		size_t run;
+		for (size_t x = 0; x < g->width; x += run) {
+			run = grid_run(g, x, y);
+			if (!grid_in_use(g, x, y))
+				continue;
+			const struct tile *t = grid_get_const_unck(g, x, y);
+			for (size_t i = 0; i < run; ++i) {
+				if (!t[i].animal)
+					continue;
+				++*n_animals;
+				const struct animal *a =
+					grid_animal(g, t[i].animal);
+				if (words) {
+					pack_ram(&o->packing, a, words);
+					continue;
+				}
+				if (o->packed) {
+					pack_animal(&o->packing, a);
+					continue;
+				}
+				if (ram) {
+					for (uint16_t w = 0;
+						w < a->brain->ram_size; ++w) {
+						uint8_t word[2];
+						put16(word, animal_ram(a, w));
+						if (put(o, word, sizeof(word)))
+							return -1;
+					}
+					continue;
+				}
+				uint8_t record[ANIMAL_SIZE] = {0};
+				put32(record, a->brain->save_num);
+				put16(record + 4, a->health);
+				put16(record + 6, a->energy);
+				put16(record + 8, a->instr_ptr);
+				put16(record + 10, a->flags);
+				memcpy(record + 12, a->stomach, N_CHEMICALS);
+				if (put(o, record, sizeof(record)))
+					return -1;
+			}
+		}
+		if (put_packing(o, false)) {
+			free(words);
+			return -1;
+		}
+	}
+	free(words);
+	return end_section(o);
+}
+
+#define RETURN_ERR (-1)
+static int write_sections(struct grid *g, struct out *o)
+{
+	const char **err = o->err;
+	long start;
+	FTELL(&start, o->dest, err);
+	/* The header is written over once the index is known. */
+	if (put(o, NULL, FIRST_SECTION) || flush(o))
+		return -1;
+	uint32_t n_species, n_animals;
+	if (put_species(g, o, &n_species)
+	 || put_chemicals(g, o)
+	 || put_bits(g, o, SECTION_SOLID)
+	 || put_bits(g, o, SECTION_OCCUPIED)
+	 || put_animals(g, o, false, &n_animals)
+	 || put_animals(g, o, true, &n_animals))
+		return -1;
+
+	uint8_t header[FIRST_SECTION] = {0};
+	uint32_t version = htonl(o->packed ? PACKED_VERSION
+		: UNPACKED_VERSION);
+	memcpy(header + AT_VERSION, &version, sizeof(version));
+	put16(header + AT_TICK, g->tick);
+	put16(header + AT_DROP_INTERVAL, g->drop_interval);
+	put16(header + AT_HEALTH, g->health);
+	header[AT_RANDOM_KIND] = g->random_kind;
+	header[AT_DROP_AMOUNT] = g->drop_amount;
+	put32(header + AT_RANDOM, g->random);
+	put32(header + AT_MUTATE_CHANCE, g->mutate_chance);
+	put32(header + AT_WIDTH, g->width);
+	put32(header + AT_HEIGHT, g->height);
+	put32(header + AT_N_SPECIES, n_species);
+	put32(header + AT_N_ANIMALS, n_animals);
+	for (enum section s = 0; s < N_SECTIONS; ++s) {
+		uint8_t *entry = header + HEADER_SIZE + s * INDEX_ENTRY_SIZE;
+		put64(entry, o->index[s].offset);
+		put64(entry + 8, o->index[s].size);
+		put64(entry + 16, o->index[s].sum);
+	}
+	FSEEK(o->dest, start, SEEK_SET, err);
+	FWRITE(header, sizeof(header), 1, o->dest, err);
+	FSEEK(o->dest, start + o->at, SEEK_SET, err);
+	return 0;
+}
+#undef RETURN_ERR
+
+int grid_write_sections(struct grid *g, FILE *dest, bool packed,
+	const char **err)
+{
+	struct out *o = malloc(sizeof(*o));
+	o->dest = dest;
+	o->err = err;
+	o->at = 0;
+	o->packed = packed;
+	o->streamed = false;
+	o->packing = (struct buffer){0};
+	o->used = 0;
+	int ret = write_sections(g, o);
+	buffer_free(&o->packing);
+	free(o);
+	return ret;
+}
+
+/* Puts each species followed by its code, packed as in their sections. */
+static int put_stream_species(struct grid *g, struct out *o)
+{
+	pack_number(&o->packing, registry_size(g->species));
+	struct buffer code = {0}, before = {0};
+	uint32_t n_species = 0;
+	int ret = 0;
+	for (uint32_t id = 0; id < registry_end(g->species) && !ret; ++id) {
+		struct brain *b = registry_get(g->species, id);
+		if (!b)
+			continue;
+		b->save_num = n_species++;
+		pack_number(&o->packing, b->signature);
+		pack_number(&o->packing, b->ram_size);
+		pack_number(&o->packing, b->code_size);
+		put_code(&code, b);
+		pack_code(&o->packing, code.bytes, b->code_size,
+			before.bytes, before.size / INSTRUCTION_SIZE);
+		ret = put_packing(o, false);
+		struct buffer swap = code;
+		code = before;
+		before = swap;
+	}
+	buffer_free(&code);
+	buffer_free(&before);
+	return ret;
+}
+
+/* Puts the rocks and animals in the order of their tiles. Each is put as the
+ * number of tiles since the one before, doubled, plus one for an animal, which
+ * is followed by its packed record and RAM. The number of tiles to the end of
+ * the grid, doubled, comes last. */
+static int put_stream_tiles(const struct grid *g, struct out *o)
+{
+	uint16_t *words = malloc((UINT16_MAX + 1) * sizeof(*words));
+	uint64_t gap = 0;
+	int ret = 0;
+	for (size_t y = 0; y < g->height && !ret; ++y) {
+		size_t run;
+		for (size_t x = 0; x < g->width && !ret; x += run) {
+			run = grid_run(g, x, y);
+			if (!grid_in_use(g, x, y)) {
+				gap += run;
+				continue;
+			}
+			const struct tile *t = grid_get_const_unck(g, x, y);
+			for (size_t i = 0; i < run && !ret; ++i) {
+				if (!t[i].animal && !t[i].is_solid) {
+					++gap;
+					continue;
+				}
+				pack_number(&o->packing,
+					gap << 1 | (t[i].animal != 0));
+				gap = 0;
+				if (t[i].animal) {
+					const struct animal *a =
+						grid_animal(g, t[i].animal);
+					pack_animal(&o->packing, a);
+					pack_ram(&o->packing, a, words);
+				}
+				ret = put_packing(o, false);
+			}
+		}
+	}
+	free(words);
+	pack_number(&o->packing, gap << 1);
+	return ret ? ret : put_packing(o, true);
+}
+
+#define RETURN_ERR (-1)
+int grid_write_stream_sections(struct grid *g, FILE *dest, const char **err)
+{
+	uint32_t version = htonl(SERIALIZATION_VERSION);
+	FWRITE(&version, sizeof(version), 1, dest, err);
+	struct out *o = malloc(sizeof(*o));
+	o->dest = dest;
+	o->err = err;
+	o->at = 0;
+	o->packed = true;
+	o->streamed = true;
+	o->packing = (struct buffer){0};
+	o->used = 0;
+	const uint64_t fields[] = {g->tick, g->drop_interval, g->health,
+		g->random_kind, g->drop_amount, g->random, g->mutate_chance,
+		g->width, g->height};
+	for (size_t f = 0; f < sizeof(fields) / sizeof(*fields); ++f)
+		pack_number(&o->packing, fields[f]);
+	int ret = put_stream_species(g, o) || put_chemicals(g, o)
+		|| put_stream_tiles(g, o) ? -1 : 0;
+	buffer_free(&o->packing);
+	free(o);
+	return ret;
+}
+#undef RETURN_ERR
+
+static struct grid *bad(struct grid *g, int code, const char *why,
+	const char **err)
+{
+	if (g)
+		grid_free(g);
+	errno = code;
+	*err = why;
+	return NULL;
+}
+
+static bool bit_at(const uint8_t *bits, uint64_t k)
+{
+	return bits[k / 8] >> k % 8 & 1;
+}
+
+/* The sections of a save as they are, or unpacked where they were packed.
+ * Chemicals, animals and RAM are unpacked as they are read instead. */
+struct sections {
+	bool packed;
+	const uint8_t *at[N_SECTIONS];
+	uint64_t size[N_SECTIONS];
+	/* What was unpacked, to be freed. */
+	uint8_t *unpacked[N_SECTIONS];
+};
+
+/* Unpacks size instructions of code as records, copying from the code before,
+ * which is before_size instructions long. */
+static bool unpack_code(struct cursor *src, uint8_t *code, size_t size,
+	const uint8_t *before, size_t before_size)
+{
+	for (size_t j = 0; j < size; ) {
+		uint64_t run, from;
+		if (!unpack_number(src, &run) || run >> 1 == 0
+		 || run >> 1 > size - j)
+			return false;
+		size_t n = run >> 1;
+		const uint8_t *instrs;
+		if (run & 1) {
+			if (!unpack_number(src, &from) || from > before_size
+			 || n > before_size - from)
+				return false;
+			instrs = before + from * INSTRUCTION_SIZE;
+		} else if (!(instrs = cursor_take(src, n * INSTRUCTION_SIZE))) {
+			return false;
+		}
+		memcpy(code + j * INSTRUCTION_SIZE, instrs,
+			n * INSTRUCTION_SIZE);
+		j += n;
+	}
+	return true;
+}
+
+static bool unpack_species(struct sections *in, uint32_t n_species)
+{
+	struct cursor src = {in->at[SECTION_SPECIES],
+		in->at[SECTION_SPECIES] + in->size[SECTION_SPECIES]};
+	uint8_t *records = calloc(n_species + 1, SPECIES_SIZE);
+	in->unpacked[SECTION_SPECIES] = records;
+	uint64_t code_size = 0;
+	for (uint32_t i = 0; i < n_species; ++i) {
+		uint64_t fields[3];
+		for (int f = 0; f < 3; ++f) {
+			if (!unpack_number(&src, &fields[f])
+			 || fields[f] > UINT16_MAX)
+				return false;
+			put16(records + i * SPECIES_SIZE + 2 * f, fields[f]);
+		}
+		code_size += fields[2];
+	}
+	if (src.at != src.end)
+		return false;
+	in->at[SECTION_SPECIES] = records;
+	in->size[SECTION_SPECIES] = (uint64_t)n_species * SPECIES_SIZE;
+
+	src = (struct cursor){in->at[SECTION_CODE],
+		in->at[SECTION_CODE] + in->size[SECTION_CODE]};
+	uint8_t *code = malloc(code_size * INSTRUCTION_SIZE + 1),
+		*before = NULL;
+	in->unpacked[SECTION_CODE] = code;
+	in->at[SECTION_CODE] = code;
+	in->size[SECTION_CODE] = code_size * INSTRUCTION_SIZE;
+	size_t before_size = 0;
+	for (uint32_t i = 0; i < n_species; ++i) {
+		size_t size = get16(records + i * SPECIES_SIZE + 4);
+		if (!unpack_code(&src, code, size, before, before_size))
+			return false;
+		before = code;
+		before_size = size;
+		code += size * INSTRUCTION_SIZE;
+	}
+	return src.at == src.end;
+}
+
+/* Unpacks the bits of a section, which were put as gaps between set bits. */
+static bool unpack_bits(struct sections *in, enum section s, uint64_t area)
+{
+	struct cursor src = {in->at[s], in->at[s] + in->size[s]};
+	uint8_t *bits = calloc((area + 7) / 8 + 1, 1);
+	in->unpacked[s] = bits;
+	in->at[s] = bits;
+	in->size[s] = (area + 7) / 8;
+	for (uint64_t k = 0; src.at != src.end; ++k) {
+		uint64_t gap;
+		if (!unpack_number(&src, &gap) || gap >= area - k)
+			return false;
+		k += gap;
+		bits[k / 8] |= 1 << k % 8;
+	}
+	return true;
+}
+
+/* Unpacks the next animal into a record as it would be if not packed. */
+static bool unpack_animal(struct cursor *src, uint8_t *record)
+{
+	uint64_t fields[6];
+	for (int f = 0; f < 6; ++f) {
+		if (!unpack_number(src, &fields[f]))
+			return false;
+	}
+	if (fields[0] > UINT32_MAX || fields[1] > UINT16_MAX
+	 || fields[2] > UINT16_MAX || fields[3] > UINT16_MAX
+	 || fields[4] > UINT16_MAX || fields[5] >> N_CHEMICALS)
+		return false;
+	memset(record, 0, ANIMAL_SIZE);
+	put32(record, fields[0]);
+	for (int f = 1; f < 5; ++f)
+		put16(record + 2 + 2 * f, fields[f]);
+	for (enum chemical id = 0; id < N_CHEMICALS; ++id) {
+		const uint8_t *amount;
+		if (fields[5] >> id & 1) {
+			if (!(amount = cursor_take(src, 1)))
+				return false;
+			record[12 + id] = *amount;
+		}
+	}
+	return true;
+}
+
+/* Makes a species from its record and its code as records. */
+static struct brain *load_species(const uint8_t *record, const uint8_t *code)
+{
+	uint16_t code_size = get16(record + 4);
+	struct instruction *instrs = malloc(code_size * sizeof(*instrs));
+	for (uint16_t j = 0; j < code_size; ++j) {
+		instrs[j].opcode = code[0];
+		instrs[j].l_fmt = code[1] >> 4;
+		instrs[j].r_fmt = code[1] & 3;
+		instrs[j].left = get16(code + 2);
+		instrs[j].right = get16(code + 4);
+		code += INSTRUCTION_SIZE;
+	}
+	struct brain *b = brain_new(get16(record), get16(record + 2),
+		code_size, instrs);
+	free(instrs);
+	return b;
+}
+
+/* Makes an animal of a species from its record and puts it on tile k. Its RAM
+ * is left zero. */
+static struct animal *load_animal(struct grid *g, struct brain *b,
+	const uint8_t *record, uint64_t k)
+{
+	uint32_t handle = animal_new(b, 0, g);
+	struct animal *a = grid_animal(g, handle);
+	a->health = get16(record + 4);
+	a->energy = get16(record + 6);
+	a->instr_ptr = get16(record + 8);
+	a->flags = get16(record + 10);
+	memcpy(a->stomach, record + 12, N_CHEMICALS);
+	struct tile *t = grid_get_unck(g, k % g->width, k / g->width);
+	tile_set_animal(t, g, handle);
+	t->newly_occupied = false;
+	return a;
+}
+
+static void free_sections(struct sections *in)
+{
+	for (enum section s = 0; s < N_SECTIONS; ++s)
+		free(in->unpacked[s]);
+}
+
+static struct grid *bad_sections(struct grid *g, struct sections *in,
+	int code, const char *why,
+	const char **err)
+{
+	free_sections(in);
+	return bad(g, code, why, err);
+}
+
+static bool load_chemicals(struct grid *g, struct sections *in)
+{
+	size_t width = g->width, height = g->height;
+	uint64_t area = (uint64_t)width * height;
+	struct unpacker unpacker = {{in->at[SECTION_CHEMICALS],
+		in->at[SECTION_CHEMICALS] + in->size[SECTION_CHEMICALS]}, 0,
+		false, 0};
+	for (enum chemical id = 0; id < N_CHEMICALS; ++id) {
+		const uint8_t *plane = in->at[SECTION_CHEMICALS] + id * area;
+		for (size_t y = 0; y < height; ++y) {
+			size_t run;
+			for (size_t x = 0; x < width; x += run) {
+				run = grid_run(g, x, y);
+				if (run > 64)
+					run = 64;
+				uint8_t amounts[64];
+				if (in->packed && !unpack_bytes(&unpacker,
+					amounts, run))
+					return false;
+				grid_load_amounts(g, id, in->packed ? amounts
+					: plane + y * width + x, x, y, run);
+			}
+		}
+	}
+	return !in->packed
+		|| (unpacker.left == 0 && unpacker.src.at == unpacker.src.end);
+}
+
+struct grid *grid_load_sections(const uint8_t *save, size_t size,
+	const char **err)
+{
+	if (size < FIRST_SECTION)
+		return bad(NULL, EPROTO, "unexpected end of file", err);
+	struct sections in = {0};
+	uint32_t version;
+	memcpy(&version, save + AT_VERSION, sizeof(version));
+	in.packed = ntohl(version) != UNPACKED_VERSION;
+	for (enum section s = 0; s < N_SECTIONS; ++s) {
+		const uint8_t *entry =
+			save + HEADER_SIZE + s * INDEX_ENTRY_SIZE;
+		uint64_t offset = get64(entry), length = get64(entry + 8);
+		if (offset % SECTION_ALIGN != 0 || offset < FIRST_SECTION
+		 || offset > size || length > size - offset
+		 || align(length) > size - offset)
+			return bad(NULL, EPROTO, "section out of bounds", err);
+		if (add_to_sum(SUM_START, save + offset, align(length))
+			!= get64(entry + 16))
+			return bad(NULL, EPROTO, "section checksum mismatch",
+				err);
+		in.at[s] = save + offset;
+		in.size[s] = length;
+	}
+
+	uint32_t width = get32(save + AT_WIDTH),
+		 height = get32(save + AT_HEIGHT),
+		 n_species = get32(save + AT_N_SPECIES),
+		 n_animals = get32(save + AT_N_ANIMALS);
+	uint64_t area = (uint64_t)width * height;
+	if (save[AT_RANDOM_KIND] >= N_RANDOM_KINDS)
+		return bad(NULL, EPROTO, "unknown random generator", err);
+	if (width == 0 || height == 0)
+		return bad(NULL, EPROTO, "empty grid", err);
+	/* A packed species takes at least three bytes. */
+	if (in.packed && (n_species > in.size[SECTION_SPECIES] / 3
+	 || !unpack_species(&in, n_species)
+	 || !unpack_bits(&in, SECTION_SOLID, area)
+	 || !unpack_bits(&in, SECTION_OCCUPIED, area)))
+		return bad_sections(NULL, &in, EPROTO, "bad packing", err);
+	if (in.size[SECTION_SPECIES] != (uint64_t)n_species * SPECIES_SIZE
+	 || in.size[SECTION_CODE] % INSTRUCTION_SIZE != 0
+	 || (!in.packed && in.size[SECTION_CHEMICALS] != area * N_CHEMICALS)
+	 || in.size[SECTION_SOLID] != (area + 7) / 8
+	 || in.size[SECTION_OCCUPIED] != (area + 7) / 8
+	 || (!in.packed
+	  && in.size[SECTION_ANIMALS] != (uint64_t)n_animals * ANIMAL_SIZE)
+	 || (!in.packed && in.size[SECTION_RAM] % 2 != 0))
+		return bad_sections(NULL, &in, EPROTO, "section size mismatch",
+			err);
+
+	struct grid *g = grid_new(width, height);
+	if (!g)
+		return bad_sections(NULL, &in, ENOMEM, "grid too big", err);
+	g->tick = get16(save + AT_TICK);
+	g->drop_interval = get16(save + AT_DROP_INTERVAL);
+	g->health = get16(save + AT_HEALTH);
+	g->random_kind = save[AT_RANDOM_KIND];
+	g->drop_amount = save[AT_DROP_AMOUNT];
+	g->random = get32(save + AT_RANDOM);
+	g->mutate_chance = get32(save + AT_MUTATE_CHANCE);
+
+	struct brain **species = calloc(n_species + 1, sizeof(*species));
+	const uint8_t *code = in.at[SECTION_CODE];
+	uint64_t code_left = in.size[SECTION_CODE] / INSTRUCTION_SIZE;
+	for (uint32_t i = 0; i < n_species; ++i) {
+		const uint8_t *record = in.at[SECTION_SPECIES]
+			+ i * SPECIES_SIZE;
+		uint16_t code_size = get16(record + 4);
+		if (code_size > code_left) {
+			free(species);
+			return bad_sections(g, &in, EPROTO,
+				"section size mismatch", err);
+		}
+		struct brain *b = load_species(record, code);
+		code += code_size * INSTRUCTION_SIZE;
+		code_left -= code_size;
+		/* Species saved more than once are merged. */
+		species[i] = registry_add(g->species, b);
+	}
+
+	if (!load_chemicals(g, &in)) {
+		free(species);
+		return bad_sections(g, &in, EPROTO, "bad packing", err);
+	}
+
+	const uint8_t *solid = in.at[SECTION_SOLID],
+		      *occupied = in.at[SECTION_OCCUPIED],
+		      *record = in.at[SECTION_ANIMALS],
+		      *ram = in.at[SECTION_RAM];
+	for (uint64_t k = 0; k < area; ++k) {
+		if (!solid[k / 8])
+			k |= 7;
+		else if (bit_at(solid, k))
+			grid_set_solid_unck(g, k % width, k / width,
+				1, 1, true);
+	}
+	struct cursor animals = {record, record + in.size[SECTION_ANIMALS]},
+		      rams = {ram, ram + in.size[SECTION_RAM]};
+	uint8_t unpacked[ANIMAL_SIZE];
+	uint16_t *words = in.packed ?
+		malloc((UINT16_MAX + 1) * sizeof(*words)) : NULL;
+	uint32_t n_read = 0;
+	uint64_t ram_left = in.packed ? 0 : in.size[SECTION_RAM] / 2;
+	const char *why = NULL;
+	int code_err = EPROTO;
+	for (uint64_t k = 0; k < area && !why; ++k) {
+		if (!occupied[k / 8]) {
+			k |= 7;
+			continue;
+		}
+		if (!bit_at(occupied, k))
+			continue;
+		if (n_read == n_animals) {
+			why = "section size mismatch";
+			break;
+		}
+		if (in.packed) {
+			if (!unpack_animal(&animals, unpacked)) {
+				why = "bad packing";
+				break;
+			}
+			record = unpacked;
+		}
+		uint32_t species_num = get32(record);
+		if (species_num >= n_species) {
+			code_err = ENODATA;
+			why = "species number too high";
+			break;
+		}
+		struct brain *b = species[species_num];
+		if (in.packed ? !unpack_words(&rams, words, b->ram_size)
+			: b->ram_size > ram_left) {
+			why = in.packed ? "bad packing"
+				: "section size mismatch";
+			break;
+		}
+		struct animal *a = load_animal(g, b, record, k);
+		for (uint16_t i = 0; i < b->ram_size; ++i) {
+			/* Zero words are left to pages that need not exist. */
+			uint16_t word = in.packed ? words[i]
+				: get16(ram + 2 * i);
+			if (word != 0)
+				*animal_ram_ref(a, i) = word;
+		}
+		if (!in.packed) {
+			ram += 2 * b->ram_size;
+			ram_left -= b->ram_size;
+		}
+		if (!in.packed)
+			record += ANIMAL_SIZE;
+		++n_read;
+	}
+	free(words);
+	free(species);
+	if (!why && (n_read != n_animals || ram_left != 0))
+		why = "section size mismatch";
+	if (!why && in.packed
+	 && (animals.at != animals.end || rams.at != rams.end))
+		why = "bad packing";
+	if (why)
+		return bad_sections(g, &in, code_err, why, err);
+	free_sections(&in);
+	return g;
+}
+
+/* A stream being read a frame at a time, with what is needed to read the rest
+ * of it. */
+struct stream {
+	FILE *src;
+	const char **err;
+	struct buffer frame;
+	/* Unpacks what is left of the frame. */
+	struct unpacker unpacker;
+	struct brain **species;
+	uint32_t n_species;
+	uint16_t *words;
+};
+
+static int bad_stream(struct stream *in, int code, const char *why)
+{
+	errno = code;
+	*in->err = why;
+	return -1;
+}
+
+#define RETURN_ERR (-1)
+/* Reads the next frame once the one before is used up. */
+static int next_frame(struct stream *in)
+{
+	struct cursor *src = &in->unpacker.src;
+	if (src->at != src->end)
+		return 0;
+	uint8_t head[4], tail[8];
+	FREAD(head, sizeof(head), 1, in->src, in->err);
+	uint32_t size = get32(head);
+	if (size == 0 || size > MAX_FRAME)
+		return bad_stream(in, EPROTO, "bad frame size");
+	in->frame.size = 0;
+	uint8_t *bytes = buffer_add(&in->frame, size + sizeof(uint64_t));
+	memset(bytes + size, 0, sizeof(uint64_t));
+	FREAD(bytes, size, 1, in->src, in->err);
+	FREAD(tail, sizeof(tail), 1, in->src, in->err);
+	if (add_to_sum(SUM_START, bytes, (size + 7) / 8 * 8) != get64(tail))
+		return bad_stream(in, EPROTO, "frame checksum mismatch");
+	*src = (struct cursor){bytes, bytes + size};
+	return 0;
+}
+#undef RETURN_ERR
+
+static int read_stream_head(struct stream *in, struct grid **g)
+{
+	/* The fields and the most each may be. */
+	static const uint64_t limits[] = {UINT16_MAX, UINT16_MAX, UINT16_MAX,
+		UINT8_MAX, UINT8_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX,
+		UINT32_MAX, UINT32_MAX};
+	enum {TICK, DROP_INTERVAL, HEALTH, RANDOM_KIND, DROP_AMOUNT, RANDOM,
+		MUTATE_CHANCE, WIDTH, HEIGHT, N_SPECIES, N_FIELDS};
+	uint64_t fields[N_FIELDS];
+	if (next_frame(in))
+		return -1;
+	for (int f = 0; f < N_FIELDS; ++f) {
+		if (!unpack_number(&in->unpacker.src, &fields[f])
+		 || fields[f] > limits[f])
+			return bad_stream(in, EPROTO, "bad packing");
+	}
+	if (fields[RANDOM_KIND] >= N_RANDOM_KINDS)
+		return bad_stream(in, EPROTO, "unknown random generator");
+	if (fields[WIDTH] == 0 || fields[HEIGHT] == 0)
+		return bad_stream(in, EPROTO, "empty grid");
+	in->n_species = fields[N_SPECIES];
+	in->species = calloc(in->n_species + 1, sizeof(*in->species));
+	if (!in->species)
+		return bad_stream(in, ENOMEM, "too many species");
+	/* A stream cannot say how big a grid it backs, so a grid too big to
+	 * make is the only bound. */
+	*g = grid_new(fields[WIDTH], fields[HEIGHT]);
+	if (!*g)
+		return bad_stream(in, ENOMEM, "grid too big");
+	(*g)->tick = fields[TICK];
+	(*g)->drop_interval = fields[DROP_INTERVAL];
+	(*g)->health = fields[HEALTH];
+	(*g)->random_kind = fields[RANDOM_KIND];
+	(*g)->drop_amount = fields[DROP_AMOUNT];
+	(*g)->random = fields[RANDOM];
+	(*g)->mutate_chance = fields[MUTATE_CHANCE];
+	return 0;
+}
+
+static int read_stream_species(struct stream *in, struct grid *g)
+{
+	struct cursor *src = &in->unpacker.src;
+	struct buffer code = {0}, before = {0};
+	int ret = 0;
+	for (uint32_t i = 0; i < in->n_species; ++i) {
+		if ((ret = next_frame(in)))
+			break;
+		uint8_t record[SPECIES_SIZE] = {0};
+		uint64_t fields[3];
+		int f = 0;
+		while (f < 3 && unpack_number(src, &fields[f])
+		 && fields[f] <= UINT16_MAX) {
+			put16(record + 2 * f, fields[f]);
+			++f;
+		}
+		code.size = 0;
+		if (f == 3)
+			buffer_add(&code, fields[2] * INSTRUCTION_SIZE + 1);
+		if (f < 3 || !unpack_code(src, code.bytes, fields[2],
+			before.bytes, before.size / INSTRUCTION_SIZE)) {
+			ret = bad_stream(in, EPROTO, "bad packing");
+			break;
+		}
+		code.size = fields[2] * INSTRUCTION_SIZE;
+		/* Species saved more than once are merged. */
+		in->species[i] = registry_add(g->species,
+			load_species(record, code.bytes));
+		struct buffer swap = code;
+		code = before;
+		before = swap;
+	}
+	buffer_free(&code);
+	buffer_free(&before);
+	return ret;
+}
+
+/* Unpacks n amounts of chemicals. A run may start in the next frame, so only
+ * its first byte is taken until its length is known. */
+static int read_stream_amounts(struct stream *in, uint8_t *dest, size_t n)
+{
+	struct unpacker *u = &in->unpacker;
+	while (n > 0) {
+		size_t part = n;
+		if (u->left == 0) {
+			if (next_frame(in))
+				return -1;
+			part = 1;
+		} else if (u->left < n) {
+			part = u->left;
+		}
+		if (!unpack_bytes(u, dest, part))
+			return bad_stream(in, EPROTO, "bad packing");
+		dest += part;
+		n -= part;
+	}
+	return 0;
+}
+
+static int read_stream_chemicals(struct stream *in, struct grid *g)
+{
+	for (enum chemical id = 0; id < N_CHEMICALS; ++id) {
+		for (size_t y = 0; y < g->height; ++y) {
+			size_t run;
+			for (size_t x = 0; x < g->width; x += run) {
+				run = grid_run(g, x, y);
+				if (run > 64)
+					run = 64;
+				uint8_t amounts[64];
+				if (read_stream_amounts(in, amounts, run))
+					return -1;
+				grid_load_amounts(g, id, amounts, x, y, run);
+			}
+		}
+	}
+	if (in->unpacker.left != 0)
+		return bad_stream(in, EPROTO, "bad packing");
+	return 0;
+}
+
+static int read_stream_tiles(struct stream *in, struct grid *g)
+{
+	struct cursor *src = &in->unpacker.src;
+	uint64_t area = (uint64_t)g->width * g->height, k = 0;
+	in->words = malloc((UINT16_MAX + 1) * sizeof(*in->words));
+	for (;; ++k) {
+		uint64_t tile;
+		if (next_frame(in))
+			return -1;
+		if (!unpack_number(src, &tile) || tile >> 1 > area - k)
+			return bad_stream(in, EPROTO, "bad packing");
+		k += tile >> 1;
+		if (k == area && !(tile & 1))
+			break;
+		if (k == area)
+			return bad_stream(in, EPROTO, "bad packing");
+		if (!(tile & 1)) {
+			grid_set_solid_unck(g, k % g->width, k / g->width,
+				1, 1, true);
+			continue;
+		}
+		uint8_t record[ANIMAL_SIZE];
+		if (!unpack_animal(src, record))
+			return bad_stream(in, EPROTO, "bad packing");
+		uint32_t species_num = get32(record);
+		if (species_num >= in->n_species)
+			return bad_stream(in, ENODATA,
+				"species number too high");
+		struct brain *b = in->species[species_num];
+		if (!unpack_words(src, in->words, b->ram_size))
+			return bad_stream(in, EPROTO, "bad packing");
+		struct animal *a = load_animal(g, b, record, k);
+		for (uint16_t i = 0; i < b->ram_size; ++i) {
+			/* Zero words are left to pages that need not exist. */
+			if (in->words[i] != 0)
+				*animal_ram_ref(a, i) = in->words[i];
+		}
+	}
+	/* Nothing follows the end of the grid in its frame. */
+	if (src->at != src->end)
+		return bad_stream(in, EPROTO, "bad packing");
+	return 0;
+}
+
+struct grid *grid_read_stream(FILE *src, const char **err)
+{
+	struct stream in = {0};
+	in.src = src;
+	in.err = err;
+	struct grid *g = NULL;
+	int ret = read_stream_head(&in, &g);
+	if (!ret)
+		ret = read_stream_species(&in, g);
+	if (!ret)
+		ret = read_stream_chemicals(&in, g);
+	if (!ret)
+		ret = read_stream_tiles(&in, g);
+	buffer_free(&in.frame);
+	free(in.species);
+	free(in.words);
+	if (ret && g) {
+		grid_free(g);
+		g = NULL;
+	}
+	return g;
+}
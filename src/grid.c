@@ -19,35 +19,425 @@
 
 #include "grid.h"
 
+#include "arena.h"
+#include "batch.h"
+#include "flow.h"
+#include "pool.h"
 #include "random.h"
+#include "registry.h"
+#include <sched.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef SPARSE_GRID
+#	include <sys/mman.h>
+#endif
 
-void tile_set_animal(struct tile *self, struct animal *a)
+#if defined(SPARSE_GRID)
+/* Tiles are kept in chunks of CHUNK rows of CHUNK tiles, laid out like the
+ * blocks below. A chunk only takes up memory once something is put in it, and
+ * gives it back once it is empty again, so a huge grid that is mostly empty
+ * takes up little memory. The bit maps are in chunks too, with a word for
+ * each row of a chunk. The border before the grid is a span wide, so spans
+ * stay inside the rows of chunks. */
+#	define CHUNK 64
+#	define CHUNK_TILES (CHUNK * CHUNK)
+#	define BLOCK CHUNK
+#	define BEFORE FLOW_SPAN
+#elif defined(TILE_BLOCKS)
+/* Tiles are kept in square blocks of BLOCK rows of BLOCK tiles, so that tiles
+ * above and below each other are close however wide the grid is. The blocks
+ * are in rows, as are the tiles of each block. A whole block of border comes
+ * before the grid so that spans line up with blocks. */
+#	define BLOCK FLOW_SPAN
+#	define BEFORE BLOCK
+#else
+#	define BLOCK 1
+#	define BEFORE GRID_BORDER
+#endif
+
+#ifdef SPARSE_GRID
+#	define WORD_STEP CHUNK
+#	define BIT_OFFSET BEFORE
+#else
+/* The bit maps have a row of words for each row of tiles, starting at x = 0. */
+#	define WORD_STEP 1
+#	define BIT_OFFSET 0
+#endif
+
+/* Rounds n up to a whole number of blocks. */
+static size_t whole_blocks(size_t n)
+{
+	return (n + BLOCK - 1) / BLOCK * BLOCK;
+}
+
+/* Finds where tile i is. */
+static void locate(const struct grid *g, size_t i, size_t *x, size_t *y)
+{
+#if BLOCK > 1
+	size_t block = i / (BLOCK * BLOCK), blocks_per_row = g->stride / BLOCK;
+	*x = block % blocks_per_row * BLOCK + i % BLOCK;
+	*y = block / blocks_per_row * BLOCK + i / BLOCK % BLOCK;
+#else
+	*x = i % g->stride;
+	*y = i / g->stride;
+#endif
+	*x -= BEFORE;
+	*y -= BEFORE;
+}
+
+/* Gets where the tile dx across and dy down from tile i at (x, y) is. */
+static inline size_t neighbour(const struct grid *g, size_t i,
+	size_t x, size_t y, int dx, int dy)
+{
+#if BLOCK > 1
+	(void)i;
+	return grid_index(g, x + dx, y + dy);
+#else
+	(void)x, (void)y;
+	return i + dy * (ptrdiff_t)g->stride + dx;
+#endif
+}
+
+static size_t n_tiles(const struct grid *g)
+{
+	return g->stride * whole_blocks(BEFORE + g->height + GRID_BORDER);
+}
+
+static size_t words_per_row(const struct grid *g)
+{
+#ifdef SPARSE_GRID
+	return g->stride / 64;
+#else
+	return (g->width + 63) / 64;
+#endif
+}
+
+static size_t n_words(const struct grid *g)
+{
+#ifdef SPARSE_GRID
+	return n_tiles(g) / 64;
+#else
+	return g->height * words_per_row(g);
+#endif
+}
+
+/* Gets the word of a bit map with the bit of the tile at (x, y). */
+static size_t word_index(const struct grid *g, size_t x, size_t y)
+{
+	x += BIT_OFFSET;
+#ifdef SPARSE_GRID
+	y += BEFORE;
+	return (y / CHUNK * words_per_row(g) + x / 64) * CHUNK + y % CHUNK;
+#else
+	return y * words_per_row(g) + x / 64;
+#endif
+}
+
+/* Gets which bit of its word the tile at x has. */
+static unsigned bit_of(size_t x)
+{
+	return (x + BIT_OFFSET) % 64;
+}
+
+/* Gets n (at most 64) bits starting shift into a word and going on into the
+ * next word of the row. Other threads may be changing bits sharing the
+ * words. */
+static uint64_t get_at(const uint64_t *word, unsigned shift, size_t n)
+{
+	uint64_t bits = __atomic_load_n(&word[0], __ATOMIC_RELAXED) >> shift;
+	if (shift > 0 && shift + n > 64)
+		bits |= __atomic_load_n(&word[WORD_STEP], __ATOMIC_RELAXED)
+			<< (64 - shift);
+	return n < 64 ? bits & (((uint64_t)1 << n) - 1) : bits;
+}
+
+/* Gets n (at most 64) bits of a row from x on. */
+static uint64_t get_bits(const struct grid *g, const uint64_t *map,
+	size_t x, size_t y, size_t n)
+{
+	return get_at(&map[word_index(g, x, y)], bit_of(x), n);
+}
+
+/* Sets the bits of a word that are set in on and clears those set in off.
+ * Words are only written if that changes them, and only with atomics while
+ * threads are updating rows, since rows next to each other share words. */
+static void change_word(const struct grid *g, uint64_t *word,
+	uint64_t on, uint64_t off)
+{
+	uint64_t old = __atomic_load_n(word, __ATOMIC_RELAXED);
+	on &= ~old;
+	off &= old;
+	if (!(on | off))
+		return;
+	if (!g->pool) {
+		__atomic_store_n(word, (old | on) & ~off, __ATOMIC_RELAXED);
+		return;
+	}
+	if (on)
+		__atomic_fetch_or(word, on, __ATOMIC_RELAXED);
+	if (off)
+		__atomic_fetch_and(word, ~off, __ATOMIC_RELAXED);
+}
+
+/* Does change_word for bits starting shift into a word and going on into the
+ * next word of the row. */
+static void change_at(const struct grid *g, uint64_t *word, unsigned shift,
+	uint64_t on, uint64_t off)
+{
+	change_word(g, &word[0], on << shift, off << shift);
+	if (shift > 0)
+		change_word(g, &word[WORD_STEP], on >> (64 - shift),
+			off >> (64 - shift));
+}
+
+/* Sets the bits of a row from x on that are set in on and clears those set in
+ * off. */
+static void change_bits(const struct grid *g, uint64_t *map,
+	size_t x, size_t y,
+	uint64_t on, uint64_t off)
+{
+	change_at(g, &map[word_index(g, x, y)], bit_of(x), on, off);
+}
+
+/* Gets memory reading as zeros. */
+static void *alloc_zeroed(size_t size)
+{
+#ifdef SPARSE_GRID
+	/* Pages are only taken up once they are written. */
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return mem != MAP_FAILED ? mem : NULL;
+#else
+	return calloc(1, size);
+#endif
+}
+
+static void free_zeroed(void *mem, size_t size)
+{
+#ifdef SPARSE_GRID
+	munmap(mem, size);
+#else
+	(void)size;
+	free(mem);
+#endif
+}
+
+#ifdef SPARSE_GRID
+static size_t n_chunks(const struct grid *g)
+{
+	return n_tiles(g) / CHUNK_TILES;
+}
+
+static bool chunk_in_use(const struct grid *g, size_t c)
+{
+	return __atomic_load_n(&g->in_use[c / 64], __ATOMIC_RELAXED)
+		>> c % 64 & 1;
+}
+
+/* Finds the first chunk in use from c on, returning n_chunks if there is
+ * none. */
+static size_t next_chunk(const struct grid *g, size_t c)
+{
+	while (c < n_chunks(g)) {
+		uint64_t word = __atomic_load_n(&g->in_use[c / 64],
+			__ATOMIC_RELAXED) >> c % 64;
+		if (word != 0) {
+			c += __builtin_ctzll(word);
+			break;
+		}
+		c = (c / 64 + 1) * 64;
+	}
+	return c < n_chunks(g) ? c : n_chunks(g);
+}
+#endif
+
+/* Notes that something may be put on tile i, so that its chunk is looked at
+ * from now on. */
+static inline void use_tile(struct grid *g, size_t i)
+{
+#ifdef SPARSE_GRID
+	size_t c = i / CHUNK_TILES;
+	if (!chunk_in_use(g, c))
+		__atomic_fetch_or(&g->in_use[c / 64], (uint64_t)1 << c % 64,
+			__ATOMIC_RELAXED);
+#else
+	(void)g, (void)i;
+#endif
+}
+
+/* Finds the first tile of row y from x to before end whose chunk is in use,
+ * returning end if there is none. */
+static size_t next_in_use(const struct grid *g, size_t x, size_t end, size_t y)
+{
+#ifdef SPARSE_GRID
+	if (x >= end)
+		return end;
+	size_t c = grid_index(g, x, y) / CHUNK_TILES, next = next_chunk(g, c);
+	if (next == c)
+		return x;
+	/* Chunks of the same row of chunks are numbered in order. */
+	x += (next - c) * CHUNK - bit_of(x);
+	return x < end ? x : end;
+#else
+	(void)g, (void)end, (void)y;
+	return x;
+#endif
+}
+
+/* Finds the first animal from (x, y) on in scan order, whether updated this
+ * tick or not. Returns false if there is none. */
+static bool next_occupied(const struct grid *g, size_t *x, size_t *y)
+{
+	for (; *y < g->height; ++*y, *x = 0) {
+		while ((*x = next_in_use(g, *x, g->width, *y)) < g->width) {
+			uint64_t word = g->occupied[word_index(g, *x, *y)]
+				>> bit_of(*x);
+			if (word != 0) {
+				*x += __builtin_ctzll(word);
+				return true;
+			}
+			*x += 64 - bit_of(*x);
+		}
+	}
+	return false;
+}
+
+static void mark_occupied(struct grid *g, const struct tile *t, bool occupied)
+{
+	size_t x, y;
+	locate(g, t - g->tiles, &x, &y);
+	change_bits(g, g->occupied, x, y, occupied, !occupied);
+	if (occupied)
+		use_tile(g, t - g->tiles);
+}
+
+void tile_set_animal(struct tile *self, struct grid *g, uint32_t animal)
 {
-	self->animal = a;
+	self->animal = animal;
 	self->newly_occupied = true;
 	self->is_solid = true;
+	mark_occupied(g, self, true);
 }
 
-void tile_clear_animal(struct tile *self)
+void tile_clear_animal(struct tile *self, struct grid *g)
 {
-	self->animal = NULL;
+	self->animal = 0;
 	self->is_solid = false;
+	mark_occupied(g, self, false);
 }
 
+/* Makes the tiles around the grid solid border tiles full of every chemical.
+ * The tiles of the grid are not looked at. */
+static void init_border(struct grid *g)
+{
+	size_t rows = n_tiles(g) / g->stride;
+	for (size_t y = 0; y < rows; ++y) {
+		bool in_grid = y >= BEFORE && y < BEFORE + g->height;
+		for (size_t x = 0; x < g->stride; ++x) {
+			if (in_grid && x == BEFORE)
+				x += g->width;
+			/* grid_index adds BEFORE back. */
+			size_t i = grid_index(g, x - BEFORE, y - BEFORE);
+			g->tiles[i].is_solid = true;
+			g->tiles[i].is_border = true;
+			for (size_t id = 0; id < N_CHEMICALS; ++id)
+				g->chemicals[id][i] = UINT8_MAX;
+			use_tile(g, i);
+		}
+	}
+}
+
+/* No tile takes up more bytes than this across all of the grid's arrays. */
+#define MAX_TILE_BYTES 64
+
 struct grid *grid_new(size_t width, size_t height)
 {
-	struct grid *self = calloc(1, offsetof(struct grid, tiles) +
-		width * height * sizeof(struct tile));
+	/* The border rows and columns must not overflow the sizes. */
+	size_t max_side = SIZE_MAX / 2 / MAX_TILE_BYTES;
+	if (width > max_side || height > max_side)
+		return NULL;
+	size_t rows = whole_blocks(BEFORE + height + GRID_BORDER),
+	       stride = whole_blocks(BEFORE + width + GRID_BORDER);
+	if (stride > SIZE_MAX / MAX_TILE_BYTES / rows)
+		return NULL;
+	struct grid *self = calloc(1, sizeof(*self));
 	self->width = width;
 	self->height = height;
+	self->stride = stride;
+	self->animals = arena_new();
+	self->species = registry_new();
 	self->drop_interval = 1;
+	size_t size = n_tiles(self), words = n_words(self);
+	self->tiles = alloc_zeroed(size * sizeof(*self->tiles));
+	self->occupied = alloc_zeroed(words * sizeof(*self->occupied));
+	uint8_t *planes = alloc_zeroed(N_CHEMICALS * size);
+	uint64_t *flowable = alloc_zeroed(N_CHEMICALS * words
+		* sizeof(*flowable));
+	self->evaporated = alloc_zeroed(size * sizeof(*self->evaporated));
+	for (size_t i = 0; i < N_CHEMICALS; ++i) {
+		self->chemicals[i] = planes + i * size;
+		self->flowable[i] = flowable + i * words;
+	}
+	bool failed = !self->tiles || !self->occupied || !planes || !flowable
+		|| !self->evaporated;
+#ifdef SPARSE_GRID
+	self->in_use = calloc((n_chunks(self) + 63) / 64,
+		sizeof(*self->in_use));
+	failed = failed || !self->in_use;
+#endif
+	if (failed) {
+		if (self->tiles)
+			free_zeroed(self->tiles, size * sizeof(*self->tiles));
+		if (self->occupied)
+			free_zeroed(self->occupied,
+				words * sizeof(*self->occupied));
+		if (planes)
+			free_zeroed(planes, N_CHEMICALS * size);
+		if (flowable)
+			free_zeroed(flowable,
+				N_CHEMICALS * words * sizeof(*flowable));
+		if (self->evaporated)
+			free_zeroed(self->evaporated,
+				size * sizeof(*self->evaporated));
+#ifdef SPARSE_GRID
+		free(self->in_use);
+#endif
+		arena_free(self->animals);
+		registry_free(self->species);
+		free(self);
+		return NULL;
+	}
+	init_border(self);
 	return self;
 }
 
+size_t grid_index(const struct grid *self, size_t x, size_t y)
+{
+	x += BEFORE;
+	y += BEFORE;
+#if BLOCK > 1
+	return (y / BLOCK * self->stride + x / BLOCK * BLOCK) * BLOCK
+		+ y % BLOCK * BLOCK + x % BLOCK;
+#else
+	return y * self->stride + x;
+#endif
+}
+
+size_t grid_run(const struct grid *self, size_t x, size_t y)
+{
+	size_t run = self->width - x;
+	(void)y;
+#if BLOCK > 1
+	size_t in_block = BLOCK - (x + BEFORE) % BLOCK;
+	if (in_block < run)
+		run = in_block;
+#endif
+	return run;
+}
+
 struct tile *grid_get_unck(struct grid *self, size_t x, size_t y)
 {
-	return &self->tiles[y * self->width + x];
+	return &self->tiles[grid_index(self, x, y)];
 }
 
 struct tile *grid_get(struct grid *self, size_t x, size_t y)
@@ -61,7 +451,7 @@ struct tile *grid_get(struct grid *self, size_t x, size_t y)
 const struct tile *grid_get_const_unck(const struct grid *self,
 	size_t x, size_t y)
 {
-	return &self->tiles[y * self->width + x];
+	return &self->tiles[grid_index(self, x, y)];
 }
 
 const struct tile *grid_get_const(const struct grid *self, size_t x, size_t y)
@@ -72,11 +462,213 @@ const struct tile *grid_get_const(const struct grid *self, size_t x, size_t y)
 		return NULL;
 }
 
-static void print_color(const struct tile *t, FILE *dest)
+bool grid_in_use(const struct grid *self, size_t x, size_t y)
+{
+#ifdef SPARSE_GRID
+	return chunk_in_use(self, grid_index(self, x, y) / CHUNK_TILES);
+#else
+	(void)self, (void)x, (void)y;
+	return true;
+#endif
+}
+
+struct animal *grid_animal(const struct grid *self, uint32_t handle)
+{
+	return arena_get(self->animals, handle);
+}
+
+uint8_t *grid_chemical(const struct grid *self, const struct tile *t,
+	enum chemical id)
+{
+	return &self->chemicals[id][t - self->tiles];
+}
+
+void grid_chemical_added(struct grid *self, const struct tile *t,
+	enum chemical id)
+{
+	size_t i = t - self->tiles, x, y;
+	use_tile(self, i);
+	if (self->chemicals[id][i] > 4) {
+		locate(self, i, &x, &y);
+		grid_mark_flowable(self, id, x, y, 1, 0);
+	}
+}
+
+uint64_t grid_flowable(const struct grid *self, enum chemical id,
+	size_t x, size_t y, size_t n)
+{
+	return get_bits(self, self->flowable[id], x, y, n);
+}
+
+void grid_mark_flowable(struct grid *self, enum chemical id,
+	size_t x, size_t y,
+	uint64_t more, uint64_t fewer)
+{
+	change_bits(self, self->flowable[id], x, y, more, fewer);
+}
+
+void grid_load_amounts(struct grid *self, enum chemical id,
+	const uint8_t *amounts,
+	size_t x, size_t y, size_t n)
+{
+	size_t i = grid_index(self, x, y);
+	uint64_t more = 0;
+	bool any = false;
+	for (size_t j = 0; j < n; ++j) {
+		if (!amounts[j])
+			continue;
+		self->chemicals[id][i + j] = amounts[j];
+		self->evaporated[i + j] = self->tick;
+		more |= (uint64_t)(amounts[j] > 4) << j;
+		any = true;
+	}
+	if (any) {
+		use_tile(self, i);
+		grid_mark_flowable(self, id, x, y, more, 0);
+	}
+}
+
+/* Counts the ticks from from to before until when a chemical evaporates. */
+static unsigned evaporations(enum chemical id, uint16_t from, uint16_t until)
+{
+	unsigned every = chemical_table[id].evaporation;
+	/* There are (n + every - 1) / every multiples of every before n. */
+	unsigned before_from = (from + every - 1) / every,
+		 before_until = (until + every - 1) / every;
+	if (from <= until)
+		return before_until - before_from;
+	return (UINT16_MAX + every) / every - before_from + before_until;
+}
+
+static void init_evaporation(struct evaporation *e, uint16_t until)
+{
+	e->until = until;
+	e->last_any = UINT16_MAX;
+	for (size_t i = 0; i < N_CHEMICALS; ++i) {
+		uint16_t every = chemical_table[i].evaporation,
+			 last = until - 1, previous;
+		last -= last % every;
+		previous = last - 1;
+		previous -= previous % every;
+		e->last[i] = until - last;
+		e->previous[i] = until - previous;
+		if (e->last[i] < e->last_any)
+			e->last_any = e->last[i];
+	}
+}
+
+/* Gets what an amount of a chemical comes to once evaporated from the tick from
+ * as far as e says. */
+static uint8_t evaporate(uint8_t amount, enum chemical id, uint16_t from,
+	const struct evaporation *e)
+{
+	uint16_t behind = e->until - from;
+	if (behind < e->last[id] || amount == 0)
+		return amount;
+	if (behind < e->previous[id])
+		return amount - 1;
+	unsigned n = evaporations(id, from, e->until);
+	return amount > n ? amount - n : 0;
+}
+
+static void catch_up_chemicals(struct grid *g, size_t i,
+	const struct evaporation *e)
+{
+	/* Border tiles stay full. */
+	if (g->tiles[i].is_border)
+		return;
+	uint16_t from = g->evaporated[i], behind = e->until - from;
+	for (size_t id = 0; id < N_CHEMICALS; ++id) {
+		if (behind >= e->last[id])
+			g->chemicals[id][i] =
+				evaporate(g->chemicals[id][i], id, from, e);
+	}
+	g->evaporated[i] = e->until;
+}
+
+/* Does the evaporation due on tile i. Only the chemicals that have evaporated
+ * since the tile last did are looked at. A tile with nothing due keeps its old
+ * tick, which is just as right. */
+static inline void catch_up(struct grid *g, size_t i,
+	const struct evaporation *e)
 {
-	int r = t->chemicals[CHEM_RED],
-	    g = t->chemicals[CHEM_GREEN],
-	    b = t->chemicals[CHEM_BLUE];
+	if ((uint16_t)(e->until - g->evaporated[i]) >= e->last_any)
+		catch_up_chemicals(g, i, e);
+}
+
+/* Gets how far evaporation should have got on tile i for the update of the tile
+ * at (x, y). Tiles before it have evaporated this tick. */
+static const struct evaporation *due(const struct grid *g, size_t i,
+	size_t x, size_t y)
+{
+#if BLOCK > 1
+	size_t tile_x, tile_y;
+	locate(g, i, &tile_x, &tile_y);
+	return &g->evaporation[tile_y < y || (tile_y == y && tile_x < x)];
+#else
+	return &g->evaporation[i < grid_index(g, x, y)];
+#endif
+}
+
+void grid_evaporate(struct grid *self, const struct tile *t,
+	size_t x, size_t y)
+{
+	size_t i = t - self->tiles;
+	catch_up(self, i, due(self, i, x, y));
+}
+
+uint8_t grid_amount(const struct grid *self, const struct tile *t,
+	enum chemical id,
+	size_t x, size_t y)
+{
+	size_t i = t - self->tiles;
+	return evaporate(self->chemicals[id][i], id, self->evaporated[i],
+		due(self, i, x, y));
+}
+
+void grid_evaporate_all(struct grid *self)
+{
+	struct evaporation e;
+	init_evaporation(&e, self->tick);
+#ifdef SPARSE_GRID
+	/* Chunks not in use have nothing to evaporate. */
+	for (size_t c = next_chunk(self, 0); c < n_chunks(self);
+		c = next_chunk(self, c + 1)) {
+		for (size_t i = c * CHUNK_TILES; i < (c + 1) * CHUNK_TILES; ++i)
+			catch_up(self, i, &e);
+	}
+#else
+	for (size_t y = 0; y < self->height; ++y) {
+		for (size_t x = 0; x < self->width; ++x)
+			catch_up(self, grid_index(self, x, y), &e);
+	}
+#endif
+}
+
+void grid_mark_evaporated(struct grid *self)
+{
+#ifdef SPARSE_GRID
+	for (size_t c = next_chunk(self, 0); c < n_chunks(self);
+		c = next_chunk(self, c + 1)) {
+		for (size_t i = c * CHUNK_TILES; i < (c + 1) * CHUNK_TILES; ++i)
+			self->evaporated[i] = self->tick;
+	}
+#else
+	for (size_t y = 0; y < self->height; ++y) {
+		for (size_t x = 0; x < self->width; ++x)
+			self->evaporated[grid_index(self, x, y)] = self->tick;
+	}
+#endif
+}
+
+static void print_color(const struct grid *grid, const struct tile *t,
+	const struct evaporation *e, FILE *dest)
+{
+	size_t i = t - grid->tiles;
+	uint16_t from = grid->evaporated[i];
+	int r = evaporate(grid->chemicals[CHEM_RED][i], CHEM_RED, from, e),
+	    g = evaporate(grid->chemicals[CHEM_GREEN][i], CHEM_GREEN, from, e),
+	    b = evaporate(grid->chemicals[CHEM_BLUE][i], CHEM_BLUE, from, e);
 	if (r) {
 		r /= 51;
 		if (r > 4)
@@ -102,9 +694,10 @@ static void print_color(const struct tile *t, FILE *dest)
 
 #define EMPTY_GRAY "237"
 
-static void draw_tile(const struct tile *t, FILE *dest)
+static void draw_tile(const struct grid *g, const struct tile *t,
+	const struct evaporation *e, FILE *dest)
 {
-	print_color(t, dest);
+	print_color(g, t, e, dest);
 	if (t->animal)
 		fprintf(dest, "\x1B[37m[]\x1B[38;5;"EMPTY_GRAY"m");
 	else if (t->is_solid)
@@ -116,11 +709,16 @@ static void draw_tile(const struct tile *t, FILE *dest)
 void grid_draw(const struct grid *self, FILE *dest)
 {
 	fprintf(dest, "\x1B[38;5;"EMPTY_GRAY"m");
+	struct evaporation e;
+	init_evaporation(&e, self->tick);
 	size_t x, y;
 	for (y = 0; y < self->height; ++y) {
 		for (x = 0; x < self->width; ++x) {
 			const struct tile *t = grid_get_const_unck(self, x, y);
-			draw_tile(t, dest);
+			if (grid_in_use(self, x, y))
+				draw_tile(self, t, &e, dest);
+			else
+				fprintf(dest, "\x1B[48;5;16m[]");
 		}
 		fprintf(dest, "\x1B[49m\n");
 	}
@@ -128,13 +726,29 @@ void grid_draw(const struct grid *self, FILE *dest)
 	fflush(dest);
 }
 
+static int by_population(const void *a, const void *b)
+{
+	const struct brain *brain_a = *(struct brain *const *)a,
+			   *brain_b = *(struct brain *const *)b;
+	if (brain_a->refcount != brain_b->refcount)
+		return brain_a->refcount < brain_b->refcount ? 1 : -1;
+	return (brain_a->id > brain_b->id) - (brain_a->id < brain_b->id);
+}
+
 void grid_print_species(const struct grid *self, size_t threshold, FILE *dest)
 {
-	const struct brain *b;
-	SLLIST_FOR_EACH(self->species, b) {
-		if (b->refcount >= threshold)
-			brain_print(b, dest);
+	struct brain **shown =
+		malloc(registry_size(self->species) * sizeof(*shown));
+	size_t n_shown = 0;
+	for (uint32_t id = 0; id < registry_end(self->species); ++id) {
+		struct brain *b = registry_get(self->species, id);
+		if (b && b->refcount >= threshold)
+			shown[n_shown++] = b;
 	}
+	qsort(shown, n_shown, sizeof(*shown), by_population);
+	for (size_t i = 0; i < n_shown; ++i)
+		brain_print(shown[i], dest);
+	free(shown);
 }
 
 static uint16_t init_flow_mask(uint16_t tick)
@@ -155,46 +769,291 @@ static uint16_t init_evaporation_mask(uint16_t tick)
 	return evaporating;
 }
 
-static void flow_fluids(uint16_t flowing, struct grid *g, struct tile *t,
-	size_t x, size_t y)
+/* Nothing flows off the grid since border tiles are full. */
+#define FLOW_TO(to, to_x, to_y) \
+	if (c[to] != UINT8_MAX) { \
+		if (++c[to] == 5) \
+			change_bits(g, g->flowable[idx], to_x, to_y, 1, 0); \
+		--c[i]; \
+	}
+
+/* Does the evaporation due on the tile at (x, y) and the tiles it flows to
+ * before it flows. */
+static void catch_up_around(struct grid *g, size_t x, size_t y)
+{
+	size_t i = grid_index(g, x, y),
+	       above = neighbour(g, i, x, y, 0, -1),
+	       right = neighbour(g, i, x, y, 1, 0),
+	       below = neighbour(g, i, x, y, 0, 1),
+	       left = neighbour(g, i, x, y, -1, 0);
+	catch_up(g, i, &g->evaporation[0]);
+	catch_up(g, above, &g->evaporation[1]);
+	catch_up(g, right, &g->evaporation[0]);
+	catch_up(g, below, &g->evaporation[0]);
+	catch_up(g, left, &g->evaporation[1]);
+	use_tile(g, above);
+	use_tile(g, right);
+	use_tile(g, below);
+	use_tile(g, left);
+}
+
+static void flow_fluids(uint16_t flowing, struct grid *g, size_t x, size_t y)
 {
+	size_t i = grid_index(g, x, y);
+	bool caught_up = false;
 	uint16_t idx;
 	for (; flowing != 0; flowing &= flowing - 1) {
 		idx = __builtin_ctz(flowing);
-		if (t->chemicals[idx] > 4) {
-			struct tile *flow_to;
-			if ((flow_to = grid_get(g, x, y - 1)) != NULL
-			 && flow_to->chemicals[idx] != UINT8_MAX) {
-				++flow_to->chemicals[idx];
-				--t->chemicals[idx];
-			}
-			if ((flow_to = grid_get(g, x + 1, y)) != NULL
-			 && flow_to->chemicals[idx] != UINT8_MAX) {
-				++flow_to->chemicals[idx];
-				--t->chemicals[idx];
-			}
-			if ((flow_to = grid_get(g, x, y + 1)) != NULL
-			 && flow_to->chemicals[idx] != UINT8_MAX) {
-				++flow_to->chemicals[idx];
-				--t->chemicals[idx];
-			}
-			if ((flow_to = grid_get(g, x - 1, y)) != NULL
-			 && flow_to->chemicals[idx] != UINT8_MAX) {
-				++flow_to->chemicals[idx];
-				--t->chemicals[idx];
-			}
+		uint8_t *c = g->chemicals[idx];
+		if (c[i] > 4 && !caught_up) {
+			catch_up_around(g, x, y);
+			caught_up = true;
+		}
+		if (c[i] > 4) {
+			FLOW_TO(neighbour(g, i, x, y, 0, -1), x, y - 1);
+			FLOW_TO(neighbour(g, i, x, y, 1, 0), x + 1, y);
+			FLOW_TO(neighbour(g, i, x, y, 0, 1), x, y + 1);
+			FLOW_TO(neighbour(g, i, x, y, -1, 0), x - 1, y);
 		}
+		if (c[i] <= 4)
+			change_bits(g, g->flowable[idx], x, y, 0, 1);
 	}
 }
 
-static void evaporate_fluids(uint16_t evaporating, struct tile *t)
+/* Wakes a sleeping animal if sludge would change its steps, if it was attacked
+ * to death, or if its energy would have run out. Returns whether it is still
+ * asleep. */
+static bool still_asleep(struct animal *a, uint16_t tick, uint16_t sludge_cost)
 {
-	uint16_t idx;
-	for (; evaporating != 0; evaporating &= evaporating - 1) {
-		idx = __builtin_ctz(evaporating);
-		if (t->chemicals[idx] > 0)
-			--t->chemicals[idx];
+	if (a->sleep_steps == 0)
+		return false;
+	if (sludge_cost > 0 || a->health == 0
+	 || (uint16_t)(tick - a->sleep_start) >= a->sleep_steps) {
+		animal_wake(a, tick);
+		return false;
 	}
+	return true;
+}
+
+static void update_animal(struct grid *g, struct batch *batch,
+	struct tile *t,
+	size_t x, size_t y)
+{
+	struct animal *a = grid_animal(g, t->animal);
+	catch_up(g, t - g->tiles, &g->evaporation[0]);
+	uint16_t sludge_cost = *grid_chemical(g, t, CHEM_SLUDGE) / 2;
+	if (still_asleep(a, g->tick, sludge_cost))
+		return;
+	if (animal_is_dead(a)) {
+		animal_spill_guts(a, g, t);
+		animal_free(g, t->animal);
+		tile_clear_animal(t, g);
+	} else if ((sludge_cost > 0 || !animal_sleep(a, g->tick))
+	 && (!batch || !batch_defer(batch, a, sludge_cost)))
+		animal_step(a, g, x, y);
+}
+
+static void update_tile(struct grid *g, struct batch *batch, uint16_t flowing,
+	size_t x, size_t y)
+{
+	struct tile *t = grid_get_unck(g, x, y);
+	if (t->animal && !t->newly_occupied)
+		update_animal(g, batch, t, x, y);
+	t->newly_occupied = false;
+	flow_fluids(flowing, g, x, y);
+}
+
+/* Finds the first tile of row y from x to before end with an animal to update,
+ * returning end if there is none. Only the occupied tiles are looked at. */
+static size_t next_animal(struct grid *g, size_t x, size_t end, size_t y)
+{
+	while (x < end) {
+		uint64_t word = __atomic_load_n(
+			&g->occupied[word_index(g, x, y)], __ATOMIC_RELAXED)
+			>> bit_of(x);
+		if (word == 0) {
+			x += 64 - bit_of(x);
+			continue;
+		}
+		x += __builtin_ctzll(word);
+		if (x < end && !grid_get_unck(g, x, y)->newly_occupied)
+			return x;
+		++x;
+	}
+	return end;
+}
+
+/* Finds the first tile of row y from x to before end that has an animal or may
+ * have a flowing chemical to move, returning end if there is none. Chunks not
+ * in use are skipped. */
+static size_t next_busy(struct grid *g, uint16_t flowing,
+	size_t x, size_t end, size_t y)
+{
+	while ((x = next_in_use(g, x, end, y)) < end) {
+		size_t w = word_index(g, x, y);
+		uint64_t word = __atomic_load_n(&g->occupied[w], __ATOMIC_RELAXED);
+		for (uint16_t f = flowing; f != 0; f &= f - 1)
+			word |= __atomic_load_n(&g->flowable[__builtin_ctz(f)][w],
+				__ATOMIC_RELAXED);
+		word >>= bit_of(x);
+		if (word != 0) {
+			x += __builtin_ctzll(word);
+			return x < end ? x : end;
+		}
+		x += 64 - bit_of(x);
+	}
+	return end;
+}
+
+/* Drops the chemicals from flowing that no tile of the span of row y from x on
+ * has enough of to flow. */
+static uint16_t flowing_in_span(const struct grid *g, uint16_t flowing,
+	size_t x, size_t y)
+{
+	size_t w = word_index(g, x, y);
+	unsigned shift = bit_of(x);
+	for (uint16_t f = flowing; f != 0; f &= f - 1) {
+		unsigned idx = __builtin_ctz(f);
+		if (!get_at(&g->flowable[idx][w], shift, FLOW_SPAN))
+			flowing &= ~(1 << idx);
+	}
+	return flowing;
+}
+
+static void catch_up_tiles(struct grid *g, size_t i,
+	const struct evaporation *e)
+{
+	if (g->tiles[i].is_border)
+		return;
+	uint16_t *stamps = &g->evaporated[i], from = stamps[0], differ = 0;
+	for (size_t j = 0; j < FLOW_SPAN; ++j)
+		differ |= stamps[j] ^ from;
+	if (differ) {
+		for (size_t j = 0; j < FLOW_SPAN; ++j)
+			catch_up(g, i + j, e);
+		return;
+	}
+	uint16_t behind = e->until - from;
+	for (size_t id = 0; id < N_CHEMICALS; ++id) {
+		if (behind < e->last[id])
+			continue;
+		unsigned n = evaporations(id, from, e->until);
+		uint8_t *c = &g->chemicals[id][i];
+		for (size_t j = 0; j < FLOW_SPAN; ++j)
+			c[j] = c[j] > n ? c[j] - n : 0;
+	}
+	for (size_t j = 0; j < FLOW_SPAN; ++j)
+		stamps[j] = e->until;
+}
+
+/* Does the evaporation due on the tiles of a span from tile i on. Tiles next to
+ * each other have usually evaporated as far, so then they are done at once. */
+static inline void catch_up_run(struct grid *g, size_t i,
+	const struct evaporation *e)
+{
+	uint16_t most_behind = 0;
+	for (size_t j = 0; j < FLOW_SPAN; ++j) {
+		uint16_t behind = e->until - g->evaporated[i + j];
+		most_behind = behind > most_behind ? behind : most_behind;
+	}
+	if (most_behind >= e->last_any)
+		catch_up_tiles(g, i, e);
+}
+
+/* Does the evaporation due on the tiles a span of row y from x on flows with
+ * before it flows. */
+static void catch_up_span(struct grid *g, size_t x, size_t y)
+{
+	size_t i = grid_index(g, x, y),
+	       above = neighbour(g, i, x, y, 0, -1),
+	       below = neighbour(g, i, x, y, 0, 1),
+	       left = neighbour(g, i, x, y, -1, 0),
+	       right = neighbour(g, i, x, y, FLOW_SPAN, 0);
+	catch_up_run(g, above, &g->evaporation[1]);
+	catch_up_run(g, i, &g->evaporation[0]);
+	catch_up_run(g, below, &g->evaporation[0]);
+	catch_up(g, left, &g->evaporation[1]);
+	catch_up(g, right, &g->evaporation[0]);
+	/* The runs above and below are each in one chunk. */
+	use_tile(g, above);
+	use_tile(g, below);
+	use_tile(g, left);
+	use_tile(g, right);
+}
+
+/* Puts the flowable bits flow_span found for the span of row y from x on into
+ * the grid. The words are found once for all the chemicals. Rows at the edges
+ * of the grid get no bits, since their border tiles are full. */
+static void mark_span(struct grid *g, uint16_t flowing,
+	const struct span_flowable *marks, size_t x, size_t y)
+{
+	size_t here = word_index(g, x, y),
+	       above = y > 0 ? word_index(g, x, y - 1) : here,
+	       below = y + 1 < g->height ? word_index(g, x, y + 1) : here;
+	unsigned shift = bit_of(x);
+	for (; flowing != 0; flowing &= flowing - 1) {
+		unsigned idx = __builtin_ctz(flowing);
+		uint64_t *map = g->flowable[idx];
+		uint32_t more = marks->here[idx];
+		change_at(g, &map[here], shift, more, (uint32_t)~more);
+		if (marks->above[idx])
+			change_at(g, &map[above], shift, marks->above[idx], 0);
+		if (marks->below[idx])
+			change_at(g, &map[below], shift, marks->below[idx], 0);
+	}
+}
+
+/* Gets how many tiles from x on can be in a span. The tiles of a span have to
+ * be kept in a row, so with blocks spans start a whole number of spans into a
+ * block. */
+static size_t span_room(const struct grid *g, size_t x)
+{
+	size_t room = FLOW_SPAN - (x + BEFORE) % BLOCK % FLOW_SPAN;
+	return g->width - x < room ? g->width - x : room;
+}
+
+/* Updates some tiles of row y from x on, returning how many. Nothing before
+ * limit can be changed by updates yet to come from other rows. Tiles without an
+ * animal or a chemical to flow stay the same, so they are skipped up to limit.
+ * Tiles where no animal acts only move chemicals, so a span of them is done at
+ * once if the CPU can. Otherwise, the tiles up to and including the next where
+ * an animal acts are done one by one. */
+static size_t update_stretch(struct grid *g, struct batch *batch,
+	uint16_t flowing, uint16_t evaporating,
+	size_t x, size_t limit, size_t y)
+{
+	size_t busy = next_busy(g, flowing, x, limit, y);
+	if (busy > x)
+		return busy - x;
+	struct tile *t = grid_get_unck(g, x, y);
+	size_t end = span_room(g, x), n = next_animal(g, x, x + end, y) - x;
+	if (n == FLOW_SPAN) {
+		flowing = flowing_in_span(g, flowing, x, y);
+		if (!flowing) {
+			for (size_t i = 0; i < n; ++i)
+				t[i].newly_occupied = false;
+			return n;
+		}
+		/* flow_span does this tick's evaporation as it goes, since units
+		 * flowing left arrive after it. */
+		catch_up_span(g, x, y);
+		struct span_flowable marks;
+		if (flow_span(g, flowing, evaporating, x, y, &marks)) {
+			mark_span(g, flowing, &marks, x, y);
+			for (size_t i = 0; i < n; ++i) {
+				t[i].newly_occupied = false;
+				if (evaporating)
+					g->evaporated[grid_index(g, x, y) + i] =
+						g->evaporation[1].until;
+			}
+			return n;
+		}
+	}
+	if (n < end)
+		++n;
+	for (size_t i = 0; i < n; ++i)
+		update_tile(g, batch, flowing, x + i, y);
+	return n;
 }
 
 static void update_tiles(struct grid *g)
@@ -203,59 +1062,229 @@ static void update_tiles(struct grid *g)
 		 evaporating = init_evaporation_mask(g->tick);
 	size_t x, y;
 	for (y = 0; y < g->height; ++y)
-		for (x = 0; x < g->width; ++x) {
-			struct tile *t = grid_get_unck(g, x, y);
-			struct animal *a = t->animal;
-			if (a && !t->newly_occupied) {
-				if (animal_is_dead(a)) {
-					animal_spill_guts(a, t);
-					animal_free(a);
-					tile_clear_animal(t);
-				} else
-					animal_step(a, g, x, y);
+		for (x = 0; x < g->width; )
+			x += update_stretch(g, g->batch, flowing, evaporating,
+				x, g->width, y);
+	if (g->batch)
+		batch_run(g->batch);
+}
+
+/* How far apart two tile updates must be not to affect each other. Animals look
+ * at tiles up to 16 away and change tiles next to them. */
+#define REACH 17
+
+struct wave {
+	uint16_t flowing, evaporating;
+	size_t next_row;
+	struct batch **batches;	/* Each worker's own batch, made when needed. */
+	size_t done[];		/* How many tiles of each row are updated. */
+};
+
+/* Returns how far the row has got, at least done. */
+static size_t wait_for_row(struct wave *w, size_t y, size_t done)
+{
+	size_t got;
+	for (unsigned spins = 0;
+		(got = __atomic_load_n(&w->done[y], __ATOMIC_ACQUIRE)) < done;
+		++spins)
+		if (spins >= 64)
+			sched_yield();
+	return got;
+}
+
+/* Rows are handed out top to bottom. A tile is updated once the row above has
+ * got out of reach of it, so every pair of updates that could affect each
+ * other happens in scan order. */
+static void update_rows(void *arg, size_t worker)
+{
+	struct grid *g = arg;
+	struct wave *w = g->wave;
+	struct batch *batch = NULL;
+	if (g->batch) {
+		if (!w->batches[worker])
+			w->batches[worker] = batch_new();
+		batch = w->batches[worker];
+	}
+	size_t y;
+	while ((y = __atomic_fetch_add(&w->next_row, 1, __ATOMIC_RELAXED))
+		< g->height) {
+		for (size_t x = 0; x < g->width; ) {
+			/* The stretch may be as long as a span. */
+			size_t limit = g->width;
+			if (y > 0) {
+				size_t above = wait_for_row(w, y - 1,
+					x + FLOW_SPAN + REACH < g->width ?
+					x + FLOW_SPAN + REACH : g->width);
+				if (above < g->width)
+					limit = above - REACH;
 			}
-			t->newly_occupied = false;
-			flow_fluids(flowing, g, t, x, y);
-			evaporate_fluids(evaporating, t);
+			x += update_stretch(g, batch,
+				w->flowing, w->evaporating, x, limit, y);
+			__atomic_store_n(&w->done[y], x, __ATOMIC_RELEASE);
 		}
+	}
+	/* Deferred steps are local, so they can run while other rows update. */
+	if (batch)
+		batch_run(batch);
+}
+
+static void update_tiles_at_once(struct grid *g)
+{
+	struct wave *w = g->wave;
+	w->flowing = init_flow_mask(g->tick);
+	w->evaporating = init_evaporation_mask(g->tick);
+	w->next_row = 0;
+	memset(w->done, 0, g->height * sizeof(*w->done));
+	pool_run(g->pool, update_rows, g);
+}
+
+void grid_wait_turn(struct grid *self, size_t y)
+{
+	if (self->wave && y > 0)
+		wait_for_row(self->wave, y - 1, self->width);
+}
+
+static void free_wave(struct grid *g)
+{
+	if (!g->wave)
+		return;
+	for (size_t i = 0; i < pool_size(g->pool); ++i)
+		batch_free(g->wave->batches[i]);
+	free(g->wave->batches);
+	free(g->wave);
+	g->wave = NULL;
+}
+
+void grid_set_threads(struct grid *self, size_t n_threads)
+{
+	free_wave(self);
+	pool_free(self->pool);
+	self->pool = NULL;
+	if (n_threads <= 1)
+		return;
+	self->pool = pool_new(n_threads);
+	self->wave = malloc(offsetof(struct wave, done)
+		+ self->height * sizeof(*self->wave->done));
+	self->wave->batches = calloc(pool_size(self->pool),
+		sizeof(*self->wave->batches));
+}
+
+/* Moves the animals into a new arena in the order of their tiles, so that
+ * updates go through memory in order and freed slots are given back. */
+static void compact_animals(struct grid *g)
+{
+	struct arena *old = g->animals;
+	g->animals = arena_new();
+	for (size_t x = 0, y = 0; next_occupied(g, &x, &y); ++x) {
+		struct tile *t = grid_get_unck(g, x, y);
+		t->animal = arena_copy(g->animals, old, t->animal);
+	}
+	arena_free(old);
 }
 
-static void free_extinct(struct grid *g)
+#ifdef SPARSE_GRID
+/* Whether chunk c has nothing in it once evaporated as far as e says. Border
+ * tiles are solid, so chunks with border are never empty. */
+static bool chunk_empty(struct grid *g, size_t c, const struct evaporation *e)
 {
-	struct brain *b, **last_b = &g->species;
-	for (b = g->species, last_b = &g->species; b != NULL; )
-		if (b->refcount == 0) {
-			struct brain *next = b->next;
-			*last_b = next;
-			free(b);
-			b = next;
-		} else {
-			last_b = &b->next;
-			b = b->next;
+	size_t first = c * CHUNK_TILES;
+	for (size_t i = first; i < first + CHUNK_TILES; ++i) {
+		if (g->tiles[i].animal || g->tiles[i].is_solid)
+			return false;
+	}
+	for (size_t i = first; i < first + CHUNK_TILES; ++i)
+		catch_up(g, i, e);
+	for (size_t id = 0; id < N_CHEMICALS; ++id) {
+		for (size_t i = first; i < first + CHUNK_TILES; ++i) {
+			if (g->chemicals[id][i])
+				return false;
 		}
+	}
+	return true;
+}
+
+/* Gives back the memory of the chunks which have nothing in them. Their tiles
+ * read as zeros afterwards, and any evaporation stamp does for a tile with no
+ * chemicals. */
+static void release_chunks(struct grid *g)
+{
+	struct evaporation e;
+	init_evaporation(&e, g->tick);
+	for (size_t c = next_chunk(g, 0); c < n_chunks(g);
+		c = next_chunk(g, c + 1)) {
+		if (!chunk_empty(g, c, &e))
+			continue;
+		size_t first = c * CHUNK_TILES;
+		madvise(&g->tiles[first], CHUNK_TILES * sizeof(*g->tiles),
+			MADV_DONTNEED);
+		for (size_t id = 0; id < N_CHEMICALS; ++id)
+			madvise(&g->chemicals[id][first], CHUNK_TILES,
+				MADV_DONTNEED);
+		madvise(&g->evaporated[first],
+			CHUNK_TILES * sizeof(*g->evaporated), MADV_DONTNEED);
+		/* Flowable bits may be left over. */
+		for (size_t id = 0; id < N_CHEMICALS; ++id)
+			memset(&g->flowable[id][c * CHUNK], 0,
+				CHUNK * sizeof(*g->flowable[id]));
+		g->in_use[c / 64] &= ~((uint64_t)1 << c % 64);
+	}
+}
+#endif
+
+struct random_stream grid_stream(const struct grid *self,
+	enum random_purpose purpose,
+	uint64_t where)
+{
+	return random_stream(self->random, self->tick, where, purpose);
 }
 
-uint32_t grid_rand(struct grid *self)
+uint32_t grid_rand(struct grid *self, struct random_stream *s)
 {
+	if (self->random_kind == RANDOM_COUNTER)
+		return random_next(s);
 	return self->random = randomize(self->random);
 }
 
-bool grid_next_mutant(struct grid *self)
+bool grid_next_mutant(struct grid *self, struct random_stream *s)
 {
-	return grid_rand(self) < self->mutate_chance;
+	return grid_rand(self, s) < self->mutate_chance;
 }
 
 void grid_update(struct grid *self)
 {
-	update_tiles(self);
-	free_extinct(self);
+	init_evaporation(&self->evaporation[0], self->tick);
+	init_evaporation(&self->evaporation[1], self->tick + 1);
+	if (self->pool)
+		update_tiles_at_once(self);
+	else
+		update_tiles(self);
+	registry_free_extinct(self->species);
 	if (self->tick % self->drop_interval == 0) {
-		grid_get_unck(self,
-			grid_rand(self) % self->width,
-			grid_rand(self) % self->height
-		)->chemicals[grid_rand(self) % 3 + 1] = self->drop_amount;
+		struct random_stream s = grid_stream(self, RANDOM_DROP, 0);
+		/* The random numbers are used in the order they always were. */
+		size_t y = grid_rand(self, &s) % self->height,
+		       x = grid_rand(self, &s) % self->width;
+		enum chemical id = grid_rand(self, &s) % 3 + 1;
+		struct tile *t = grid_get_unck(self, x, y);
+		catch_up(self, t - self->tiles, &self->evaporation[1]);
+		*grid_chemical(self, t, id) = self->drop_amount;
+		grid_chemical_added(self, t, id);
 	}
 	++self->tick;
+	/* Counter-based streams would repeat once the tick wraps around. */
+	if (self->tick == 0 && self->random_kind == RANDOM_COUNTER) {
+		struct random_stream s = grid_stream(self, RANDOM_RESEED, 0);
+		self->random = random_next(&s);
+	}
+	/* Tiles can only tell how far behind they are within 65536 ticks. */
+	if (self->tick % 32768 == 0)
+		grid_evaporate_all(self);
+	if (self->tick % 1024 == 0) {
+		compact_animals(self);
+#ifdef SPARSE_GRID
+		release_chunks(self);
+#endif
+	}
 }
 
 void grid_set_solid_unck(struct grid *self,
@@ -266,11 +1295,13 @@ void grid_set_solid_unck(struct grid *self,
 	for (size_t iy = y; iy < y + height; ++iy) {
 		for (size_t ix = x; ix < x + width; ++ix) {
 			struct tile *t = grid_get_unck(self, ix, iy);
-			t->is_solid = is_solid;
 			if (t->animal) {
-				animal_free(t->animal);
-				t->animal = NULL;
+				animal_free(self, t->animal);
+				tile_clear_animal(t, self);
 			}
+			t->is_solid = is_solid;
+			if (is_solid)
+				use_tile(self, t - self->tiles);
 		}
 	}
 }
@@ -293,15 +1324,22 @@ void grid_set_solid(struct grid *self,
 
 void grid_free(struct grid *self)
 {
-	for (size_t i = 0; i < self->width * self->height; ++i) {
-		if (self->tiles[i].animal)
-			animal_free(self->tiles[i].animal);
-	}
-	struct brain *b = self->species;
-	while (b != NULL) {
-		struct brain *next = b->next;
-		free(b);
-		b = next;
-	}
+	for (size_t x = 0, y = 0; next_occupied(self, &x, &y); ++x)
+		animal_free(self, grid_get_unck(self, x, y)->animal);
+	batch_free(self->batch);
+	free_wave(self);
+	pool_free(self->pool);
+	size_t size = n_tiles(self), words = n_words(self);
+	free_zeroed(self->tiles, size * sizeof(*self->tiles));
+	free_zeroed(self->chemicals[0], N_CHEMICALS * size);
+	free_zeroed(self->occupied, words * sizeof(*self->occupied));
+	free_zeroed(self->flowable[0],
+		N_CHEMICALS * words * sizeof(*self->flowable[0]));
+	free_zeroed(self->evaporated, size * sizeof(*self->evaporated));
+#ifdef SPARSE_GRID
+	free(self->in_use);
+#endif
+	arena_free(self->animals);
+	registry_free(self->species);
 	free(self);
 }
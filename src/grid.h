@@ -23,34 +23,101 @@
 
 #include "animal.h"
 #include "chemicals.h"
+#include "random.h"
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 
+/* How many tiles of border surround the grid on each side. Animals look at
+ * most this far away. */
+#define GRID_BORDER 16
+
 struct tile {
-	struct animal *animal;
-	uint8_t chemicals[N_CHEMICALS];
+	uint32_t animal;	/* The handle of the animal here, or 0. */
 	bool newly_occupied : 1;
 	bool is_solid : 1;
+	bool is_border : 1;
+};
+
+/* How far the chemicals of tiles should have evaporated. */
+struct evaporation {
+	uint16_t until;	/* Evaporation is done for the ticks before this. */
+	/* How many ticks before until each chemical last evaporated, the time
+	 * before that, and any chemical last evaporated. */
+	uint16_t last[N_CHEMICALS], previous[N_CHEMICALS], last_any;
 };
 
+struct arena;
+struct batch;
+struct pool;
+struct registry;
+struct wave;
+
 struct grid {
-	struct brain *species;
+	struct registry *species;
+	/* Where the animals are kept. */
+	struct arena *animals;
+	/* Where local steps are deferred to, or NULL to run them in place. */
+	struct batch *batch;
+	/* The threads updating rows at once, or NULL to update them in order. */
+	struct pool *pool;
+	/* How far each row has got while rows are updated at once. */
+	struct wave *wave;
 	uint16_t tick, drop_interval;
 	uint16_t health;
+	/* The state of the serial generator or the seed of the counter-based
+	 * one. */
 	uint32_t random;
+	enum random_kind random_kind;
 	uint32_t mutate_chance;
 	uint8_t drop_amount;
 	size_t width, height;
-	struct tile tiles[];
+	/* How many tiles wide the grid is with its border. */
+	size_t stride;
+	/* The amount of each chemical on each tile. Every chemical has a plane of
+	 * its own laid out like the tiles, so that many tiles can be worked on at
+	 * once. */
+	uint8_t *chemicals[N_CHEMICALS];
+	/* A bit for each tile holding an animal, so that updates can skip empty
+	 * tiles. Each row starts a new word. */
+	uint64_t *occupied;
+	/* For each chemical, a bit for each tile that may have more than four
+	 * units of it, laid out like occupied. Only these tiles can flow. A bit
+	 * may stay set for a while after its tile drops to four or fewer. */
+	uint64_t *flowable[N_CHEMICALS];
+	/* The tick from which evaporation is yet to be done on each tile. */
+	uint16_t *evaporated;
+	/* Chemicals only evaporate when a tile is used. These are how far they
+	 * should have got for tiles yet to be updated this tick and for those
+	 * already updated. */
+	struct evaporation evaporation[2];
+	/* The tiles surrounded by GRID_BORDER solid border tiles on each side, so
+	 * that neighbours can be reached without checking bounds. Border tiles are
+	 * full of every chemical so nothing flows onto them. The tiles are in
+	 * rows, in square blocks if TILE_BLOCKS is defined, or in chunks taking
+	 * up memory only while in use if SPARSE_GRID is defined. */
+	struct tile *tiles;
+#ifdef SPARSE_GRID
+	/* A bit for each chunk that may have something in it. */
+	uint64_t *in_use;
+#endif
 };
 
-void tile_set_animal(struct tile *self, struct animal *a);
+void tile_set_animal(struct tile *self, struct grid *g, uint32_t animal);
 
-void tile_clear_animal(struct tile *self);
+void tile_clear_animal(struct tile *self, struct grid *g);
 
+/* Makes a grid, or returns NULL if it is too big to make. */
 struct grid *grid_new(size_t width, size_t height);
 
+/* Gets where the tile at (x, y) is in tiles and in the planes laid out like
+ * them. */
+size_t grid_index(const struct grid *self, size_t x, size_t y);
+
+/* Gets how many tiles of row y from x on come one after another in tiles and
+ * the planes laid out like them. They are all in use or all not. */
+size_t grid_run(const struct grid *self, size_t x, size_t y);
+
 struct tile *grid_get_unck(struct grid *self, size_t x, size_t y);
 
 struct tile *grid_get(struct grid *self, size_t x, size_t y);
@@ -60,16 +127,88 @@ const struct tile *grid_get_const_unck(const struct grid *self,
 
 const struct tile *grid_get_const(const struct grid *self, size_t x, size_t y);
 
+/* Whether anything may be on the tile at (x, y). If not, the tile is empty and
+ * does not need to be looked at. */
+bool grid_in_use(const struct grid *self, size_t x, size_t y);
+
+/* Gets the animal of a handle. */
+struct animal *grid_animal(const struct grid *self, uint32_t handle);
+
+/* Gets where the amount of a chemical on a tile of the grid is kept. */
+uint8_t *grid_chemical(const struct grid *self, const struct tile *t,
+	enum chemical id);
+
+/* Notes that some of a chemical was put on a tile. Whatever adds chemicals to
+ * tiles other than flow calls this so that flow does not miss the tile. */
+void grid_chemical_added(struct grid *self, const struct tile *t,
+	enum chemical id);
+
+/* Gets the flowable bits of a chemical for the n (at most 64) tiles of row y
+ * from x on, the leftmost in the lowest bit. */
+uint64_t grid_flowable(const struct grid *self, enum chemical id,
+	size_t x, size_t y, size_t n);
+
+/* Marks the tiles of row y from x on with bits set in more as flowable for a
+ * chemical and those with bits set in fewer as not. */
+void grid_mark_flowable(struct grid *self, enum chemical id,
+	size_t x, size_t y,
+	uint64_t more, uint64_t fewer);
+
+/* Puts the amounts of a chemical on the n (at most 64) tiles of row y from x on
+ * in a grid being loaded, where n is at most what grid_run gives. Tiles with
+ * none of it are not touched, so that the memory of empty parts of the grid is
+ * not taken up. */
+void grid_load_amounts(struct grid *self, enum chemical id,
+	const uint8_t *amounts,
+	size_t x, size_t y, size_t n);
+
+/* Does the evaporation due on a tile for the update of the tile at (x, y). This
+ * comes before anything else touches its chemicals during an update. */
+void grid_evaporate(struct grid *self, const struct tile *t,
+	size_t x, size_t y);
+
+/* Gets the amount of a chemical on a tile as seen by the update of the tile at
+ * (x, y), without doing any evaporation. */
+uint8_t grid_amount(const struct grid *self, const struct tile *t,
+	enum chemical id,
+	size_t x, size_t y);
+
+/* Does all the evaporation due on every tile between ticks. */
+void grid_evaporate_all(struct grid *self);
+
+/* Marks every tile as having evaporated up to the current tick, as if the grid
+ * had just been loaded. This is only right for tiles whose amounts are already
+ * what they would be then. */
+void grid_mark_evaporated(struct grid *self);
+
 void grid_draw(const struct grid *self, FILE *dest);
 
+/* Prints the species with at least threshold members, the most populous
+ * first. */
 void grid_print_species(const struct grid *self, size_t threshold, FILE *dest);
 
-uint32_t grid_rand(struct grid *self);
+/* Starts the stream of random numbers for a purpose at a place this tick. */
+struct random_stream grid_stream(const struct grid *self,
+	enum random_purpose purpose,
+	uint64_t where);
 
-bool grid_next_mutant(struct grid *self);
+/* Draws the next number of a stream. The serial generator draws from the state
+ * of the grid instead, so with it numbers are drawn in one order. */
+uint32_t grid_rand(struct grid *self, struct random_stream *s);
+
+bool grid_next_mutant(struct grid *self, struct random_stream *s);
 
 void grid_update(struct grid *self);
 
+/* Makes updates use n_threads threads. The results are the same for any number
+ * of threads. */
+void grid_set_threads(struct grid *self, size_t n_threads);
+
+/* Waits until every tile before row y has been updated this tick. Updates that
+ * use the serial random state or the species list call this first so that they
+ * happen in scan order even when rows are updated at once. */
+void grid_wait_turn(struct grid *self, size_t y);
+
 void grid_set_solid_unck(struct grid *self,
 	size_t x, size_t y,
 	size_t width, size_t height,
@@ -82,8 +221,48 @@ void grid_set_solid(struct grid *self,
 
 int grid_write(struct grid *g, FILE *dest, const char **err);
 
+/* Writes a save with its sections packed, which is smaller but cannot be used
+ * straight from memory. */
+int grid_write_packed(struct grid *g, FILE *dest, const char **err);
+
+/* Writes a save that is never sought through, so it can go down a pipe. It is
+ * packed and read a piece at a time. */
+int grid_write_stream(struct grid *g, FILE *dest, const char **err);
+
+/* Writes a save in the older format of records, version 5. */
+int grid_write_v5(struct grid *g, FILE *dest, const char **err);
+
+/* Reads a save of any version. Only a stream is read from src in order, with
+ * nothing after it taken; other saves are mapped or read into memory whole. */
 struct grid *grid_read(FILE *src, const char **err);
 
+/* How many bytes at the start of a save tell it apart from other saves. Deltas
+ * name the save they follow by them. */
+#define GRID_SAVE_ID_SIZE 256
+
+/* Gets how many blocks deltas split the grid into. */
+size_t grid_n_blocks(const struct grid *self);
+
+/* Catches up the grid as a save would, then puts a fingerprint of each block in
+ * sums. Returns how many of them differ from those in old, which may be NULL
+ * to count them all. */
+size_t grid_sum_blocks(struct grid *self, uint64_t *sums,
+	const uint64_t *old);
+
+/* Writes the blocks whose fingerprints in sums differ from those in old as
+ * delta number seq after the save with the given id. The fingerprints must
+ * have just been taken by grid_sum_blocks. */
+int grid_write_delta(struct grid *g, const uint64_t *old,
+	const uint64_t *sums, const uint8_t *save_id, uint32_t seq,
+	FILE *dest, const char **err);
+
+/* Applies a delta of size bytes to a grid read from the save with the given id
+ * with the deltas before number seq applied. Returns 1 if it was applied, 0 if
+ * it does not come next, or -1 on an error, after which the grid is only fit
+ * to be freed. */
+int grid_apply_delta(struct grid *g, const uint8_t *delta, size_t size,
+	const uint8_t *save_id, uint32_t seq, const char **err);
+
 void grid_free(struct grid *self);
 
 #endif /* Header guard */
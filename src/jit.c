@@ -0,0 +1,585 @@
+/*
+ * The code for compiling brains to native code.
+ *
+ * Copyright (C) 2018 Jude Melton-Houghton
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * */
+
+/* For MAP_ANONYMOUS. */
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include "jit.h"
+
+#include <stdlib.h>
+
+#if defined(__x86_64__) && !defined(NO_JIT)
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* Only instructions which touch nothing but the animal are compiled, and only
+ * with argument classes that the interpreter has specialized handlers for.
+ *
+ * Register use: rdi holds the animal and esi the sludge cost until it is
+ * charged. rdx and rsi hold destination pointers, eax and edx source values,
+ * and ecx is scratch for double indirection. Nothing needs saving. */
+
+#define FERRORS \
+	(FINVAL_ARG | FROOB | FCOOB | FINVAL_OPCODE | FEMPTY | FFULL | FBLOCKED)
+
+#define OFF_HEALTH offsetof(struct animal, health)
+#define OFF_ENERGY offsetof(struct animal, energy)
+#define OFF_IP offsetof(struct animal, instr_ptr)
+#define OFF_FLAGS offsetof(struct animal, flags)
+#define OFF_STOMACH offsetof(struct animal, stomach)
+#define OFF_RAM offsetof(struct animal, ram)
+
+enum reg {
+	RAX = 0,
+	RCX = 1,
+	RDX = 2,
+	RSI = 6,
+};
+
+enum cond {
+	CC_B = 0x2,
+	CC_AE = 0x3,
+	CC_E = 0x4,
+	CC_NE = 0x5,
+	CC_A = 0x7,
+	CC_L = 0xC,
+	CC_G = 0xF,
+};
+
+struct emitter {
+	uint8_t *buf;
+	size_t len, cap;
+	bool failed;
+};
+
+static void emit(struct emitter *e, const void *bytes, size_t n)
+{
+	if (e->len + n > e->cap) {
+		size_t cap = e->cap * 2 + n;
+		uint8_t *buf = realloc(e->buf, cap);
+		if (!buf) {
+			e->failed = true;
+			return;
+		}
+		e->buf = buf;
+		e->cap = cap;
+	}
+	memcpy(e->buf + e->len, bytes, n);
+	e->len += n;
+}
+
+#define EMIT(e, ...) do { \
+	const uint8_t _bytes[] = {__VA_ARGS__}; \
+	emit((e), _bytes, sizeof(_bytes)); \
+} while (0)
+
+static void emit16(struct emitter *e, uint16_t v)
+{
+	EMIT(e, v & 0xFF, v >> 8);
+}
+
+static void emit32(struct emitter *e, uint32_t v)
+{
+	EMIT(e, v & 0xFF, (v >> 8) & 0xFF, (v >> 16) & 0xFF, v >> 24);
+}
+
+/* A ModR/M byte addressing [rdi + disp32], then the displacement. */
+static void at_rdi(struct emitter *e, unsigned reg, uint32_t disp)
+{
+	EMIT(e, 0x80 | reg << 3 | 7);
+	emit32(e, disp);
+}
+
+/* A ModR/M byte addressing [rdi + rcx * 2 + disp32], then the rest. */
+static void at_rdi_rcx2(struct emitter *e, unsigned reg, uint32_t disp)
+{
+	EMIT(e, 0x84 | reg << 3, 0x4F);
+	emit32(e, disp);
+}
+
+/* Emits a jump with a 32-bit displacement and returns where the displacement
+ * is so that it can be patched. */
+static size_t jump_from(struct emitter *e, int cond)
+{
+	if (cond < 0)
+		EMIT(e, 0xE9);
+	else
+		EMIT(e, 0x0F, 0x80 | cond);
+	emit32(e, 0);
+	return e->len - 4;
+}
+
+static void patch(struct emitter *e, size_t at, size_t target)
+{
+	if (e->failed)
+		return;
+	uint32_t rel = target - (at + 4);
+	memcpy(e->buf + at, &rel, 4);
+}
+
+/* Jumps that are only resolved once the end of the instruction is emitted. */
+struct pending {
+	size_t at[8];
+	size_t n;
+};
+
+static void jump_to_pending(struct emitter *e, int cond, struct pending *p)
+{
+	p->at[p->n++] = jump_from(e, cond);
+}
+
+static void resolve(struct emitter *e, struct pending *p)
+{
+	for (size_t i = 0; i < p->n; ++i)
+		patch(e, p->at[i], e->len);
+	p->n = 0;
+}
+
+/* Where failing argument checks go: a shared stub or the instruction's own
+ * successful ending, for instructions that ignore argument errors. */
+struct failure {
+	size_t stub;
+	struct pending *quiet;
+};
+
+static void jump_to_failure(struct emitter *e, int cond, struct failure f)
+{
+	if (f.quiet)
+		jump_to_pending(e, cond, f.quiet);
+	else
+		patch(e, jump_from(e, cond), f.stub);
+}
+
+/* Subtracts an immediate from a 16-bit field of the animal, saturating. */
+static void sub_saturate_imm(struct emitter *e, uint32_t off, uint16_t imm)
+{
+	EMIT(e, 0x66, 0x81);
+	at_rdi(e, 5, off);
+	emit16(e, imm);
+	size_t skip = jump_from(e, CC_AE);
+	EMIT(e, 0x66, 0xC7);
+	at_rdi(e, 0, off);
+	emit16(e, 0);
+	patch(e, skip, e->len);
+}
+
+static void set_error(struct emitter *e, uint16_t errs)
+{
+	/* and word [rdi + flags], ~FERRORS */
+	EMIT(e, 0x66, 0x81);
+	at_rdi(e, 4, OFF_FLAGS);
+	emit16(e, ~FERRORS);
+	/* or word [rdi + flags], errs */
+	EMIT(e, 0x66, 0x81);
+	at_rdi(e, 1, OFF_FLAGS);
+	emit16(e, errs);
+}
+
+/* Loads ram[value] into ecx, failing unless it is within RAM. */
+static void load_index(struct emitter *e,
+	const struct brain *b,
+	uint16_t value,
+	struct failure fail)
+{
+	/* movzx ecx, word [rdi + ram + value * 2] */
+	EMIT(e, 0x0F, 0xB7);
+	at_rdi(e, RCX, OFF_RAM + value * 2);
+	/* cmp ecx, ram_size */
+	EMIT(e, 0x81, 0xF9);
+	emit32(e, b->ram_size);
+	jump_to_failure(e, CC_AE, fail);
+}
+
+/* Loads a source argument zero-extended into reg. */
+static void load_src(struct emitter *e,
+	const struct brain *b,
+	enum reg reg,
+	uint_fast8_t arg,
+	uint16_t value,
+	struct failure fail)
+{
+	switch (arg) {
+	case ARG_IMM:
+		EMIT(e, 0xB8 + reg);
+		emit32(e, value);
+		break;
+	case ARG_RAM:
+		EMIT(e, 0x0F, 0xB7);
+		at_rdi(e, reg, OFF_RAM + value * 2);
+		break;
+	case ARG_IND:
+		load_index(e, b, value, fail);
+		EMIT(e, 0x0F, 0xB7);
+		at_rdi_rcx2(e, reg, OFF_RAM);
+		break;
+	}
+}
+
+/* Loads the address of a destination argument into reg. */
+static void load_dest(struct emitter *e,
+	const struct brain *b,
+	enum reg reg,
+	uint_fast8_t arg,
+	uint16_t value,
+	struct failure fail)
+{
+	switch (arg) {
+	case ARG_RAM:
+		EMIT(e, 0x48, 0x8D);
+		at_rdi(e, reg, OFF_RAM + value * 2);
+		break;
+	case ARG_IND:
+		load_index(e, b, value, fail);
+		EMIT(e, 0x48, 0x8D);
+		at_rdi_rcx2(e, reg, OFF_RAM);
+		break;
+	}
+}
+
+/* Compares eax to ecx and sets the comparison flags like CMPR. */
+static void compare(struct emitter *e)
+{
+	struct pending store = {.n = 0}, sign = {.n = 0};
+	/* movzx edx, word [rdi + flags] */
+	EMIT(e, 0x0F, 0xB7);
+	at_rdi(e, RDX, OFF_FLAGS);
+	/* cmp ax, cx */
+	EMIT(e, 0x66, 0x39, 0xC8);
+	size_t above = jump_from(e, CC_A);
+	size_t below = jump_from(e, CC_B);
+	/* and edx, ~(FULESSER | FUGREATER | FSLESSER | FSGREATER) */
+	EMIT(e, 0x81, 0xE2);
+	emit32(e, ~(FULESSER | FUGREATER | FSLESSER | FSGREATER));
+	/* or edx, FEQUAL */
+	EMIT(e, 0x81, 0xCA);
+	emit32(e, FEQUAL);
+	jump_to_pending(e, -1, &store);
+	patch(e, above, e->len);
+	EMIT(e, 0x81, 0xE2);
+	emit32(e, ~(FULESSER | FEQUAL));
+	EMIT(e, 0x81, 0xCA);
+	emit32(e, FUGREATER);
+	jump_to_pending(e, -1, &sign);
+	patch(e, below, e->len);
+	EMIT(e, 0x81, 0xE2);
+	emit32(e, ~(FUGREATER | FEQUAL));
+	EMIT(e, 0x81, 0xCA);
+	emit32(e, FULESSER);
+	resolve(e, &sign);
+	/* The values differ, so they differ when signed too. */
+	EMIT(e, 0x66, 0x39, 0xC8);
+	size_t greater = jump_from(e, CC_G);
+	EMIT(e, 0x81, 0xE2);
+	emit32(e, ~FSGREATER);
+	EMIT(e, 0x81, 0xCA);
+	emit32(e, FSLESSER);
+	jump_to_pending(e, -1, &store);
+	patch(e, greater, e->len);
+	EMIT(e, 0x81, 0xE2);
+	emit32(e, ~FSLESSER);
+	EMIT(e, 0x81, 0xCA);
+	emit32(e, FSGREATER);
+	resolve(e, &store);
+	/* mov word [rdi + flags], dx */
+	EMIT(e, 0x66, 0x89);
+	at_rdi(e, RDX, OFF_FLAGS);
+}
+
+/* Jumps to the target in eax, checking it unless it was immediate. */
+static void jump_to_target(struct emitter *e,
+	const struct brain *b,
+	uint_fast8_t arg,
+	uint16_t target,
+	size_t coob,
+	struct pending *jumped)
+{
+	if (arg == ARG_IMM) {
+		EMIT(e, 0x66, 0xC7);
+		at_rdi(e, 0, OFF_IP);
+		emit16(e, target);
+	} else {
+		/* cmp eax, code_size */
+		EMIT(e, 0x3D);
+		emit32(e, b->code_size);
+		patch(e, jump_from(e, CC_AE), coob);
+		/* mov word [rdi + instr_ptr], ax */
+		EMIT(e, 0x66, 0x89);
+		at_rdi(e, RAX, OFF_IP);
+	}
+	jump_to_pending(e, -1, jumped);
+}
+
+/* The shared code that instructions jump to on failure. */
+struct stubs {
+	size_t error, roob, coob, inval;
+};
+
+static void emit_stubs(struct emitter *e, struct stubs *s)
+{
+	s->error = e->len;
+	/* inc word [rdi + instr_ptr] */
+	EMIT(e, 0x66, 0xFF);
+	at_rdi(e, 0, OFF_IP);
+	sub_saturate_imm(e, OFF_ENERGY, 1);
+	EMIT(e, 0xC3);
+	s->roob = e->len;
+	set_error(e, FROOB);
+	patch(e, jump_from(e, -1), s->error);
+	s->coob = e->len;
+	set_error(e, FCOOB);
+	patch(e, jump_from(e, -1), s->error);
+	s->inval = e->len;
+	set_error(e, FINVAL_ARG);
+	patch(e, jump_from(e, -1), s->error);
+}
+
+static void emit_instruction(struct emitter *e,
+	const struct brain *b,
+	uint16_t i,
+	const struct stubs *s)
+{
+	const struct compiled *c = &b->compiled[i];
+	uint_fast8_t op = BRAIN_INSTR(b, i).opcode;
+	struct pending next = {.n = 0}, jumped = {.n = 0};
+	struct failure fail = {s->roob, NULL},
+		       quiet = {s->roob, &next};
+	/* sub word [rdi + energy], si, saturating. */
+	EMIT(e, 0x66, 0x29);
+	at_rdi(e, RSI, OFF_ENERGY);
+	size_t skip = jump_from(e, CC_AE);
+	EMIT(e, 0x66, 0xC7);
+	at_rdi(e, 0, OFF_ENERGY);
+	emit16(e, 0);
+	patch(e, skip, e->len);
+	switch (op) {
+	case OP_MOVE:
+		load_dest(e, b, RDX, c->l_arg, c->left, fail);
+		load_src(e, b, RAX, c->r_arg, c->right, fail);
+		/* mov word [rdx], ax */
+		EMIT(e, 0x66, 0x89, 0x02);
+		break;
+	case OP_XCHG:
+		load_dest(e, b, RDX, c->l_arg, c->left, fail);
+		load_dest(e, b, RSI, c->r_arg, c->right, fail);
+		/* movzx eax, word [rdx]; movzx ecx, word [rsi] */
+		EMIT(e, 0x0F, 0xB7, 0x02, 0x0F, 0xB7, 0x0E);
+		/* mov word [rdx], cx; mov word [rsi], ax */
+		EMIT(e, 0x66, 0x89, 0x0A, 0x66, 0x89, 0x06);
+		break;
+	case OP_GFLG:
+	case OP_GIPT:
+	case OP_GHLT:
+	case OP_GNRG: {
+		uint32_t off = op == OP_GFLG ? OFF_FLAGS
+			     : op == OP_GIPT ? OFF_IP
+			     : op == OP_GHLT ? OFF_HEALTH
+			     : OFF_ENERGY;
+		load_dest(e, b, RDX, c->l_arg, c->left, fail);
+		EMIT(e, 0x0F, 0xB7);
+		at_rdi(e, RAX, off);
+		if (op == OP_GNRG) {
+			/* sub eax, GNRG_COST */
+			EMIT(e, 0x2D);
+			emit32(e, GNRG_COST);
+		}
+		EMIT(e, 0x66, 0x89, 0x02);
+	} break;
+	case OP_SFLG:
+		load_src(e, b, RAX, c->l_arg, c->left, fail);
+		EMIT(e, 0x66, 0x89);
+		at_rdi(e, RAX, OFF_FLAGS);
+		break;
+	case OP_AND:
+	case OP_OR:
+	case OP_XOR:
+	case OP_ADD:
+	case OP_SUB: {
+		uint8_t alu = op == OP_AND ? 0x21
+			    : op == OP_OR ? 0x09
+			    : op == OP_XOR ? 0x31
+			    : op == OP_ADD ? 0x01
+			    : 0x29;
+		load_dest(e, b, RDX, c->l_arg, c->left, quiet);
+		load_src(e, b, RAX, c->r_arg, c->right, quiet);
+		/* <alu> word [rdx], ax */
+		EMIT(e, 0x66, alu, 0x02);
+	} break;
+	case OP_SHFR:
+	case OP_SHFL:
+		load_dest(e, b, RDX, c->l_arg, c->left, quiet);
+		load_src(e, b, RCX, c->r_arg, c->right, quiet);
+		/* movzx eax, word [rdx]; shr/shl eax, cl; mov word [rdx], ax
+		 * The count is masked just as it is for the interpreter's
+		 * shifts of promoted values. */
+		EMIT(e, 0x0F, 0xB7, 0x02,
+			0xD3, op == OP_SHFR ? 0xE8 : 0xE0,
+			0x66, 0x89, 0x02);
+		break;
+	case OP_NOT:
+	case OP_INCR:
+	case OP_DECR:
+		load_dest(e, b, RDX, c->l_arg, c->left, fail);
+		/* not/inc/dec word [rdx] */
+		if (op == OP_NOT)
+			EMIT(e, 0x66, 0xF7, 0x12);
+		else
+			EMIT(e, 0x66, 0xFF, op == OP_INCR ? 0x02 : 0x0A);
+		break;
+	case OP_JUMP:
+		load_src(e, b, RAX, c->l_arg, c->left, fail);
+		jump_to_target(e, b, c->l_arg, c->left, s->coob, &jumped);
+		break;
+	case OP_CMPR:
+		load_src(e, b, RAX, c->l_arg, c->left, fail);
+		load_src(e, b, RCX, c->r_arg, c->right, fail);
+		compare(e);
+		break;
+	case OP_JMPA:
+	case OP_JPNA:
+	case OP_JMPO:
+	case OP_JPNO: {
+		load_src(e, b, RAX, c->l_arg, c->left, fail);
+		load_src(e, b, RDX, c->r_arg, c->right, fail);
+		/* movzx ecx, word [rdi + flags] */
+		EMIT(e, 0x0F, 0xB7);
+		at_rdi(e, RCX, OFF_FLAGS);
+		int not_taken;
+		switch (op) {
+		case OP_JMPA:
+			/* (flags | test) == flags when test & ~flags is 0 */
+			EMIT(e, 0xF7, 0xD1, 0x21, 0xD1);
+			not_taken = CC_NE;
+			break;
+		case OP_JPNA:
+			EMIT(e, 0x21, 0xD1);
+			not_taken = CC_NE;
+			break;
+		case OP_JMPO:
+			EMIT(e, 0x21, 0xD1);
+			not_taken = CC_E;
+			break;
+		default:
+			/* and ecx, edx; cmp ecx, edx */
+			EMIT(e, 0x21, 0xD1, 0x39, 0xD1);
+			not_taken = CC_E;
+			break;
+		}
+		jump_to_pending(e, not_taken, &next);
+		jump_to_target(e, b, c->l_arg, c->left, s->coob, &jumped);
+	} break;
+	case OP_GCHM:
+		load_dest(e, b, RDX, c->l_arg, c->left, fail);
+		load_src(e, b, RAX, c->r_arg, c->right, fail);
+		/* cmp eax, N_CHEMICALS */
+		EMIT(e, 0x3D);
+		emit32(e, N_CHEMICALS);
+		patch(e, jump_from(e, CC_AE), s->inval);
+		/* movzx eax, byte [rdi + rax + stomach] */
+		EMIT(e, 0x0F, 0xB6, 0x84, 0x07);
+		emit32(e, OFF_STOMACH);
+		EMIT(e, 0x66, 0x89, 0x02);
+		break;
+	}
+	resolve(e, &next);
+	/* inc word [rdi + instr_ptr] */
+	EMIT(e, 0x66, 0xFF);
+	at_rdi(e, 0, OFF_IP);
+	resolve(e, &jumped);
+	EMIT(e, 0x66, 0x81);
+	at_rdi(e, 4, OFF_FLAGS);
+	emit16(e, ~FERRORS);
+	sub_saturate_imm(e, OFF_ENERGY, c->energy);
+	EMIT(e, 0xC3);
+}
+
+struct jit *jit_compile(const struct brain *brain)
+{
+	struct jit *self = malloc(offsetof(struct jit, entry)
+		+ brain->code_size * sizeof(*self->entry));
+	if (!self)
+		return NULL;
+	size_t *starts = malloc(brain->code_size * sizeof(*starts));
+	struct emitter e = {.buf = NULL, .len = 0, .cap = 0, .failed = !starts};
+	struct stubs stubs;
+	emit_stubs(&e, &stubs);
+	for (uint16_t i = 0; i < brain->code_size && !e.failed; ++i) {
+		if (animal_is_local(brain, i)) {
+			starts[i] = e.len;
+			emit_instruction(&e, brain, i, &stubs);
+		} else {
+			starts[i] = SIZE_MAX;
+		}
+	}
+	void *code = MAP_FAILED;
+	if (!e.failed)
+		code = mmap(NULL, e.len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED) {
+		free(e.buf);
+		free(starts);
+		free(self);
+		return NULL;
+	}
+	memcpy(code, e.buf, e.len);
+	free(e.buf);
+	if (mprotect(code, e.len, PROT_READ | PROT_EXEC)) {
+		munmap(code, e.len);
+		free(starts);
+		free(self);
+		return NULL;
+	}
+	self->code = code;
+	self->code_len = e.len;
+	for (uint16_t i = 0; i < brain->code_size; ++i) {
+		if (starts[i] == SIZE_MAX)
+			self->entry[i] = NULL;
+		else
+			self->entry[i] = (void (*)(struct animal *, unsigned))
+				((uint8_t *)code + starts[i]);
+	}
+	free(starts);
+	return self;
+}
+
+void jit_free(struct jit *self)
+{
+	if (!self)
+		return;
+	munmap(self->code, self->code_len);
+	free(self);
+}
+
+#else /* No JIT */
+
+struct jit *jit_compile(const struct brain *brain)
+{
+	(void)brain;
+	return NULL;
+}
+
+void jit_free(struct jit *self)
+{
+	(void)self;
+}
+
+#endif
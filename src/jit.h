@@ -0,0 +1,49 @@
+/*
+ * The interface for compiling brains to native code.
+ *
+ * Copyright (C) 2018 Jude Melton-Houghton
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * */
+
+#ifndef _JIT_H
+
+#define _JIT_H
+
+#include "animal.h"
+#include "brain.h"
+#include <stddef.h>
+
+/* Brains are compiled once this many animals use them. Define NO_JIT to never
+ * compile them, and JIT_CHECK to check every natively executed instruction
+ * against the interpreter. */
+#ifndef JIT_THRESHOLD
+#	define JIT_THRESHOLD 1000
+#endif
+
+/* A brain compiled to x86-64 code. entry[i] executes the instruction at index
+ * i just like the interpreter, given the energy lost to sludge beforehand, or
+ * is NULL if the instruction was left to the interpreter. */
+struct jit {
+	void *code;
+	size_t code_len;
+	void (*entry[])(struct animal *self, unsigned sludge_cost);
+};
+
+/* Returns NULL if the brain could not be compiled. */
+struct jit *jit_compile(const struct brain *brain);
+
+void jit_free(struct jit *self);
+
+#endif /* Header guard */
@@ -18,8 +18,11 @@
  * */
 
 #include "animal.h"
+#include "batch.h"
+#include "chain.h"
 #include "chemicals.h"
 #include "grid.h"
+#include "registry.h"
 #include "save.h"
 #include <errno.h>
 #include <stdbool.h>
@@ -63,6 +66,15 @@ static const enum chemical spring_colors[] = {CHEM_RED, CHEM_GREEN, CHEM_BLUE};
 
 volatile sig_atomic_t running = 1;
 
+/* Whether local steps are executed in batches. */
+bool batched = false;
+
+/* How many threads update the grid. */
+size_t n_threads = 1;
+
+/* Whether saves are packed. */
+bool packed = false;
+
 void canceller(int _)
 {
 	(void)_;
@@ -88,7 +100,11 @@ void simulate_grid(struct grid *g, long ticks, char visual)
 void save_grid(const char *file_name, long ticks, char visual)
 {
 	srand(time(NULL));
-	FILE *file = fopen(file_name, "wb");
+	/* A save down standard output is streamed, and what would be printed
+	 * goes to standard error instead. */
+	bool streamed = !strcmp(file_name, "-");
+	FILE *file = streamed ? stdout : fopen(file_name, "wb"),
+	     *out = streamed ? stderr : stdout;
 	if (!file) {
 		printf("no such file\n");
 		exit(EXIT_FAILURE);
@@ -99,30 +115,33 @@ void save_grid(const char *file_name, long ticks, char visual)
 	g->drop_interval = 17;
 	g->drop_amount = 210;
 	g->random = rand();
-	struct brain *b = brain_new(0xdead, 1, array_len(code));
-	memcpy(b->code, code, sizeof(code));
-	b->next = g->species;
-	g->species = b;
+	g->random_kind = RANDOM_COUNTER;
+	if (batched)
+		g->batch = batch_new();
+	grid_set_threads(g, n_threads);
+	struct brain *b = registry_add(g->species,
+		brain_new(0xdead, 1, array_len(code), code));
+	struct random_stream r = grid_stream(g, RANDOM_PLACE, 0);
 	for (size_t i = 0; i < N_ROCKS; ++i) {
-		size_t x = grid_rand(g) % g->width,
-		       y = grid_rand(g) % g->height;
+		size_t x = grid_rand(g, &r) % g->width,
+		       y = grid_rand(g, &r) % g->height;
 		grid_set_solid(g, x, y, 3, 3, true);
 	}
 	for (size_t i = 0; i < N_ANIMALS; ) {
 		struct tile *t =
 			grid_get_unck(g, rand() % g->width, rand() % g->height);
 		if (!t->is_solid) {
-			struct animal *a = animal_new(b, 10000);
-			tile_set_animal(t, a);
-			a->health = g->health;
+			tile_set_animal(t, g, animal_new(b, 10000, g));
+			grid_animal(g, t->animal)->health = g->health;
 			++i;
 		}
 	}
 	simulate_grid(g, ticks, visual);
 	const char *err;
-	grid_print_species(g, 9, stdout);
-	if (grid_write(g, file, &err))
-		printf("%s; %s.\n", strerror(errno), err);
+	grid_print_species(g, 9, out);
+	if ((streamed ? grid_write_stream : packed ? grid_write_packed
+		: grid_write)(g, file, &err))
+		fprintf(out, "%s; %s.\n", strerror(errno), err);
 	fclose(file);
 	grid_free(g);
 	exit(EXIT_SUCCESS);
@@ -130,32 +149,129 @@ void save_grid(const char *file_name, long ticks, char visual)
 
 void run_grid(const char *file_name, long ticks, char visual)
 {
-	FILE *file = fopen(file_name, "rb");
-	if (!file) {
-		printf("no such file\n");
-		exit(EXIT_FAILURE);
-	}
 	const char *err;
-	struct grid *g = grid_read(file, &err);
+	struct grid *g = chain_read(file_name, &err);
 	if (!g) {
-		printf("%s; %s.\n", strerror(errno), err);
+		fprintf(stderr, "%s; %s.\n", strerror(errno), err);
 		exit(EXIT_FAILURE);
 	}
+	if (batched)
+		g->batch = batch_new();
+	grid_set_threads(g, n_threads);
+	struct chain *chain = chain_new(file_name, g, packed);
 	while (running) {
 		simulate_grid(g, ticks, visual);
-		if (g->species != NULL) {
-			freopen(file_name, "wb", file);
-			if (grid_write(g, file, &err))
-				fprintf(stderr, "%s; %s.\n",
-					strerror(errno), err);
+		if (registry_size(g->species) > 0) {
+			chain_checkpoint(chain, g);
 		} else {
 			fprintf(stderr, "Extinct!\n");
 			break;
 		}
 	}
+	chain_finish(chain, g);
+	chain_free(chain);
 	grid_print_species(g, 9, stderr);
 	grid_free(g);
+	exit(EXIT_SUCCESS);
+}
+
+/* Returns whether two grids would be saved the same. */
+static bool same_saves(struct grid *a, struct grid *b)
+{
+	FILE *file_a = tmpfile(), *file_b = tmpfile();
+	const char *err;
+	if (!file_a || !file_b
+	 || grid_write(a, file_a, &err) || grid_write(b, file_b, &err)) {
+		printf("%s; could not save for comparison.\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	rewind(file_a);
+	rewind(file_b);
+	int c;
+	while ((c = getc(file_a)) == getc(file_b) && c != EOF) ;
+	fclose(file_a);
+	fclose(file_b);
+	return c == EOF;
+}
+
+/* Removes a chain's save and its deltas. */
+static void remove_chain(const char *file_name)
+{
+	size_t size = strlen(file_name) + sizeof(".delta.4294967295");
+	char *name = malloc(size);
+	unlink(file_name);
+	for (unsigned n = 1; ; ++n) {
+		snprintf(name, size, "%s.delta.%u", file_name, n);
+		if (unlink(name))
+			break;
+	}
+	free(name);
+}
+
+void check_grid(const char *file_name, long ticks)
+{
+	FILE *file = fopen(file_name, "rb");
+	if (!file) {
+		printf("no such file\n");
+		exit(EXIT_FAILURE);
+	}
+	const char *err;
+	struct grid *in_order = grid_read(file, &err), *at_once = NULL;
+	if (in_order) {
+		rewind(file);
+		at_once = grid_read(file, &err);
+	}
 	fclose(file);
+	if (!at_once) {
+		printf("%s; %s.\n", strerror(errno), err);
+		exit(EXIT_FAILURE);
+	}
+	if (batched) {
+		in_order->batch = batch_new();
+		at_once->batch = batch_new();
+	}
+	grid_set_threads(at_once, n_threads);
+	/* The grid updated in order is also checkpointed every tick, so that
+	 * the chain read back at the end can be checked against it. */
+	char *chain_name = malloc(strlen(file_name) + sizeof(".check.XXXXXX"));
+	sprintf(chain_name, "%s.check.XXXXXX", file_name);
+	int fd = mkstemp(chain_name);
+	if (fd < 0) {
+		printf("could not make a file for checkpoints\n");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	struct chain *chain = chain_new(chain_name, in_order, packed);
+	for (long tick = 1; tick <= ticks; ++tick) {
+		grid_update(in_order);
+		grid_update(at_once);
+		if (!same_saves(in_order, at_once)) {
+			printf("Updating with %zu threads differs after %ld "
+				"ticks.\n", n_threads, tick);
+			remove_chain(chain_name);
+			exit(EXIT_FAILURE);
+		}
+		chain_checkpoint(chain, in_order);
+	}
+	printf("Updating with %zu threads matches for %ld ticks.\n",
+		n_threads, ticks);
+	chain_finish(chain, in_order);
+	chain_free(chain);
+	struct grid *reread = chain_read(chain_name, &err);
+	remove_chain(chain_name);
+	free(chain_name);
+	if (!reread) {
+		printf("%s; %s.\n", strerror(errno), err);
+		exit(EXIT_FAILURE);
+	}
+	if (!same_saves(reread, in_order)) {
+		printf("Reading the checkpoints back differs.\n");
+		exit(EXIT_FAILURE);
+	}
+	printf("Reading the checkpoints back matches.\n");
+	grid_free(reread);
+	grid_free(in_order);
+	grid_free(at_once);
 	exit(EXIT_SUCCESS);
 }
 
@@ -164,6 +280,28 @@ int main(int argc, char *argv[])
 	struct sigaction cancel_handler;
 	cancel_handler.sa_handler = canceller;
 	sigaction(SIGINT, &cancel_handler, NULL);
+	int opt;
+	while ((opt = getopt(argc, argv, "bt:z")) != -1) {
+		switch (opt) {
+		case 'b':
+			batched = true;
+			break;
+		case 't':
+			n_threads = strtoul(optarg, NULL, 10);
+			if (n_threads < 1) {
+				printf("at least one thread is needed\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'z':
+			packed = true;
+			break;
+		default:
+			exit(EXIT_FAILURE);
+		}
+	}
+	/* Skip the options so that the positional arguments start at 1. */
+	argv += optind - 1;
 	long ticks = strtol(argv[4], NULL, 10);
 	switch (argv[1][0]) {
 	case 'w':
@@ -172,6 +310,9 @@ int main(int argc, char *argv[])
 	case 'r':
 		run_grid(argv[3], ticks, argv[2][0]);
 		break;
+	case 'c':
+		check_grid(argv[3], ticks);
+		break;
 	default:
 		break;
 	}
@@ -0,0 +1,176 @@
+/*
+ * The code for packing saves into fewer bytes.
+ *
+ * Copyright (C) 2018 Jude Melton-Houghton
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * */
+
+#include "pack.h"
+
+#include <string.h>
+
+/* Fewer repeats of a byte than this are kept with the bytes around them. */
+#define MIN_REPEATS 3
+
+void pack_number(struct buffer *dest, uint64_t n)
+{
+	uint8_t bytes[10];
+	size_t len = 0;
+	do {
+		bytes[len++] = (n & 0x7f) | (n > 0x7f) << 7;
+		n >>= 7;
+	} while (n);
+	memcpy(buffer_add(dest, len), bytes, len);
+}
+
+bool unpack_number(struct cursor *src, uint64_t *n)
+{
+	*n = 0;
+	for (unsigned shift = 0; shift < 64 && src->at < src->end; shift += 7) {
+		uint8_t byte = *src->at++;
+		*n |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+static void end_literal(struct packer *self)
+{
+	if (self->n_literal == 0)
+		return;
+	pack_number(self->dest, self->n_literal << 1 | 1);
+	memcpy(buffer_add(self->dest, self->n_literal), self->literal,
+		self->n_literal);
+	self->n_literal = 0;
+}
+
+/* Puts the repeats of the last byte, in a run of their own if there are
+ * enough of them. */
+static void end_repeats(struct packer *self)
+{
+	if (self->repeats >= MIN_REPEATS) {
+		end_literal(self);
+		pack_number(self->dest, self->repeats << 1);
+		*buffer_add(self->dest, 1) = self->byte;
+	} else {
+		for (uint64_t i = 0; i < self->repeats; ++i) {
+			if (self->n_literal == sizeof(self->literal))
+				end_literal(self);
+			self->literal[self->n_literal++] = self->byte;
+		}
+	}
+	self->repeats = 0;
+}
+
+void pack_bytes(struct packer *self, const uint8_t *src, size_t n)
+{
+	size_t i = 0;
+	while (i < n) {
+		uint8_t byte = src ? src[i] : 0;
+		if (self->repeats > 0 && byte != self->byte)
+			end_repeats(self);
+		self->byte = byte;
+		size_t j = src ? i + 1 : n;
+		while (j < n && src[j] == byte)
+			++j;
+		self->repeats += j - i;
+		i = j;
+	}
+}
+
+void pack_end(struct packer *self)
+{
+	end_repeats(self);
+	end_literal(self);
+}
+
+bool unpack_bytes(struct unpacker *self, uint8_t *dest, size_t n)
+{
+	while (n > 0) {
+		if (self->left == 0) {
+			uint64_t run;
+			if (!unpack_number(&self->src, &run) || run >> 1 == 0)
+				return false;
+			self->left = run >> 1;
+			self->repeat = !(run & 1);
+			if (self->repeat) {
+				const uint8_t *byte =
+					cursor_take(&self->src, 1);
+				if (!byte)
+					return false;
+				self->byte = *byte;
+			}
+		}
+		size_t part = self->left < n ? self->left : n;
+		if (self->repeat) {
+			memset(dest, self->byte, part);
+		} else {
+			const uint8_t *bytes = cursor_take(&self->src, part);
+			if (!bytes)
+				return false;
+			memcpy(dest, bytes, part);
+		}
+		dest += part;
+		n -= part;
+		self->left -= part;
+	}
+	return true;
+}
+
+void pack_words(struct buffer *dest, const uint16_t *words, size_t n)
+{
+	size_t i = 0;
+	while (i < n) {
+		size_t j = i;
+		if (words[i] == 0) {
+			while (j < n && words[j] == 0)
+				++j;
+			pack_number(dest, (uint64_t)(j - i) << 1);
+			i = j;
+			continue;
+		}
+		/* A lone zero costs less kept with the words around it. */
+		while (j < n && (words[j] || (j + 1 < n && words[j + 1])))
+			++j;
+		pack_number(dest, (uint64_t)(j - i) << 1 | 1);
+		for (; i < j; ++i)
+			pack_number(dest, words[i]);
+	}
+}
+
+bool unpack_words(struct cursor *src, uint16_t *words, size_t n)
+{
+	size_t i = 0;
+	while (i < n) {
+		uint64_t run;
+		if (!unpack_number(src, &run) || run >> 1 == 0
+		 || run >> 1 > n - i)
+			return false;
+		size_t end = i + (run >> 1);
+		if (!(run & 1)) {
+			memset(words + i, 0, (end - i) * sizeof(*words));
+			i = end;
+			continue;
+		}
+		for (; i < end; ++i) {
+			uint64_t word;
+			if (!unpack_number(src, &word) || word > UINT16_MAX)
+				return false;
+			words[i] = word;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,73 @@
+/*
+ * The interface for packing saves into fewer bytes.
+ *
+ * Copyright (C) 2018 Jude Melton-Houghton
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * */
+
+#ifndef _PACK_H
+
+#define _PACK_H
+
+#include "buffer.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Puts a number seven bits to a byte, the lowest first, with the top bit set
+ * on every byte but the last. */
+void pack_number(struct buffer *dest, uint64_t n);
+
+/* Gets a number, returning false if it runs past the end. */
+bool unpack_number(struct cursor *src, uint64_t *n);
+
+/* A packer puts bytes as runs. Each run is a number n followed by the n >> 1
+ * bytes of the run as they are if n is odd, or by one byte standing for n >> 1
+ * of itself if n is even. Runs may cross the pieces bytes are put in. */
+struct packer {
+	struct buffer *dest;
+	/* The bytes waiting to go in a run of bytes as they are. */
+	uint8_t literal[256];
+	size_t n_literal;
+	/* The last byte put and how many times in a row it has come. */
+	uint8_t byte;
+	uint64_t repeats;
+};
+
+/* Puts n bytes, or n zeros if src is NULL. */
+void pack_bytes(struct packer *self, const uint8_t *src, size_t n);
+
+/* Puts the bytes still waiting. */
+void pack_end(struct packer *self);
+
+struct unpacker {
+	struct cursor src;
+	/* How much of the current run is left. */
+	uint64_t left;
+	bool repeat;
+	uint8_t byte;
+};
+
+/* Gets n bytes, returning false if the runs end first or are bad. */
+bool unpack_bytes(struct unpacker *self, uint8_t *dest, size_t n);
+
+/* Puts n words as runs. Each run is a number n followed by n >> 1 words as
+ * numbers if n is odd, or standing for n >> 1 zeros if n is even. */
+void pack_words(struct buffer *dest, const uint16_t *words, size_t n);
+
+/* Gets n words, returning false if the runs end first or are bad. */
+bool unpack_words(struct cursor *src, uint16_t *words, size_t n);
+
+#endif /* Header guard */
@@ -0,0 +1,127 @@
+/*
+ * The code for running work on several threads.
+ *
+ * Copyright (C) 2018 Jude Melton-Houghton
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * */
+
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+struct worker {
+	struct pool *pool;
+	size_t index;
+	pthread_t thread;
+};
+
+struct pool {
+	pthread_mutex_t lock;
+	pthread_cond_t start, finish;
+	void (*work)(void *arg, size_t worker);
+	void *arg;
+	unsigned long round;	/* Incremented whenever work is given out. */
+	size_t n_busy;		/* The threads still working this round. */
+	bool stopping;
+	size_t n_workers;
+	struct worker workers[];	/* Worker 0 has no thread of its own. */
+};
+
+static void *work_loop(void *arg)
+{
+	struct worker *w = arg;
+	struct pool *p = w->pool;
+	unsigned long round = 0;
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (p->round == round && !p->stopping)
+			pthread_cond_wait(&p->start, &p->lock);
+		if (p->stopping)
+			break;
+		round = p->round;
+		pthread_mutex_unlock(&p->lock);
+		p->work(p->arg, w->index);
+		pthread_mutex_lock(&p->lock);
+		if (--p->n_busy == 0)
+			pthread_cond_signal(&p->finish);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+struct pool *pool_new(size_t n_workers)
+{
+	if (n_workers < 1)
+		n_workers = 1;
+	struct pool *self = malloc(offsetof(struct pool, workers)
+		+ n_workers * sizeof(*self->workers));
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_cond_init(&self->start, NULL);
+	pthread_cond_init(&self->finish, NULL);
+	self->round = 0;
+	self->n_busy = 0;
+	self->stopping = false;
+	self->workers[0].pool = self;
+	self->workers[0].index = 0;
+	for (self->n_workers = 1; self->n_workers < n_workers;
+		++self->n_workers) {
+		struct worker *w = &self->workers[self->n_workers];
+		w->pool = self;
+		w->index = self->n_workers;
+		if (pthread_create(&w->thread, NULL, work_loop, w))
+			break;
+	}
+	return self;
+}
+
+size_t pool_size(const struct pool *self)
+{
+	return self->n_workers;
+}
+
+void pool_run(struct pool *self, void (*work)(void *arg, size_t worker),
+	void *arg)
+{
+	pthread_mutex_lock(&self->lock);
+	self->work = work;
+	self->arg = arg;
+	self->n_busy = self->n_workers - 1;
+	++self->round;
+	pthread_cond_broadcast(&self->start);
+	pthread_mutex_unlock(&self->lock);
+	work(arg, 0);
+	pthread_mutex_lock(&self->lock);
+	while (self->n_busy > 0)
+		pthread_cond_wait(&self->finish, &self->lock);
+	pthread_mutex_unlock(&self->lock);
+}
+
+void pool_free(struct pool *self)
+{
+	if (!self)
+		return;
+	pthread_mutex_lock(&self->lock);
+	self->stopping = true;
+	pthread_cond_broadcast(&self->start);
+	pthread_mutex_unlock(&self->lock);
+	for (size_t i = 1; i < self->n_workers; ++i)
+		pthread_join(self->workers[i].thread, NULL);
+	pthread_cond_destroy(&self->finish);
+	pthread_cond_destroy(&self->start);
+	pthread_mutex_destroy(&self->lock);
+	free(self);
+}
@@ -0,0 +1,41 @@
+/*
+ * The interface for running work on several threads.
+ *
+ * Copyright (C) 2018 Jude Melton-Houghton
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * */
+
+#ifndef _POOL_H
+
+#define _POOL_H
+
+#include <stddef.h>
+
+/* A pool keeps threads waiting for work. The thread that gives out the work
+ * does its share too, as worker 0. */
+struct pool;
+
+/* Creates a pool of n_workers workers, or fewer if threads cannot be made. */
+struct pool *pool_new(size_t n_workers);
+
+size_t pool_size(const struct pool *self);
+
+/* Calls work(arg, i) for every worker i at once, returning when all are done. */
+void pool_run(struct pool *self, void (*work)(void *arg, size_t worker),
+	void *arg);
+
+void pool_free(struct pool *self);
+
+#endif /* Header guard */
@@ -30,3 +30,43 @@ uint32_t randomize(uint32_t seed)
 	return seed ^ rotright(seed ^ (seed * 31 - 1), seed);
 }
 
+/* Scrambles the bits of a word so that close inputs give unrelated outputs. */
+static uint64_t mix(uint64_t z)
+{
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+	return z ^ (z >> 31);
+}
+
+struct random_stream random_stream(uint32_t seed,
+	uint32_t tick,
+	uint64_t where,
+	enum random_purpose purpose)
+{
+	uint64_t when = (uint64_t)seed << 32 | tick,
+		 what = (where & 0xffffffff) << 8 | purpose;
+	struct random_stream s = {
+		.key = mix(mix(when) ^ what),
+		.counter = 0
+	};
+	/* The high half is only mixed in when it is used, so that places that
+	 * fit in 32 bits keep the streams they had before. */
+	if (where >> 32)
+		s.key = mix(s.key ^ (where >> 32));
+	return s;
+}
+
+uint32_t random_at(const struct random_stream *self, uint64_t position)
+{
+	return mix(self->key ^ mix(position + 0x9e3779b97f4a7c15)) >> 32;
+}
+
+uint32_t random_next(struct random_stream *self)
+{
+	return random_at(self, self->counter++);
+}
+
+void random_skip(struct random_stream *self, uint64_t n)
+{
+	self->counter += n;
+}
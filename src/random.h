@@ -23,6 +23,50 @@
 
 #include <stdint.h>
 
+/* The kinds of generator a grid can draw random numbers from. */
+enum random_kind {
+	/* Each number is made from the one before, so numbers are drawn in
+	 * one order across the grid. Grids saved before there were kinds use
+	 * this. */
+	RANDOM_SERIAL,
+	/* Each number is worked out from the key of its stream and where it
+	 * is in the stream, so streams can be drawn from in any order. */
+	RANDOM_COUNTER,
+
+	N_RANDOM_KINDS
+};
+
+/* What random numbers are for, so that different uses get different
+ * streams. */
+enum random_purpose {
+	RANDOM_BIRTH,
+	RANDOM_DROP,
+	RANDOM_PLACE,
+	RANDOM_RESEED
+};
+
+/* A stream of numbers from a counter-based generator. */
+struct random_stream {
+	uint64_t key;
+	uint64_t counter;
+};
+
+/* The serial generator. Gets the number after seed. */
 uint32_t randomize(uint32_t seed);
 
+/* Starts the stream for a purpose at a place, such as a tile, on a tick. */
+struct random_stream random_stream(uint32_t seed,
+	uint32_t tick,
+	uint64_t where,
+	enum random_purpose purpose);
+
+/* Gets the number at a position in a stream without moving through it. */
+uint32_t random_at(const struct random_stream *self, uint64_t position);
+
+/* Gets the next number of a stream. */
+uint32_t random_next(struct random_stream *self);
+
+/* Moves past n numbers of a stream at once. */
+void random_skip(struct random_stream *self, uint64_t n);
+
 #endif /* Header guard */
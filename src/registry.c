@@ -0,0 +1,204 @@
+/*
+ * The code for keeping track of the species of a grid.
+ *
+ * Copyright (C) 2018 Jude Melton-Houghton
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * */
+
+#include "registry.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+struct registry {
+	/* Guards the queue, which threads stepping animals add to. */
+	pthread_mutex_t lock;
+	/* The species in buckets by hash. The number of buckets is a power of
+	 * two. */
+	struct brain **table;
+	size_t table_size, n_species;
+	/* The species by id, with NULL where an id is not in use. */
+	struct brain **by_id;
+	uint32_t end, by_id_cap;
+	/* The ids not in use below end, the last freed given out first. */
+	uint32_t *free_ids;
+	size_t n_free_ids, free_ids_cap;
+	/* The species which may have died out. */
+	struct brain **queue;
+	size_t queue_len, queue_cap;
+};
+
+struct registry *registry_new(void)
+{
+	struct registry *self = calloc(1, sizeof(*self));
+	pthread_mutex_init(&self->lock, NULL);
+	return self;
+}
+
+static struct brain **bucket(const struct registry *self, size_t hash)
+{
+	return &self->table[hash & (self->table_size - 1)];
+}
+
+static void grow_table(struct registry *self)
+{
+	struct brain **old = self->table;
+	size_t old_size = self->table_size;
+	self->table_size = old_size * 2 + 64;
+	self->table = calloc(self->table_size, sizeof(*self->table));
+	for (size_t i = 0; i < old_size; ++i) {
+		struct brain *b = old[i];
+		while (b != NULL) {
+			struct brain *next = b->next_same_hash,
+				     **in = bucket(self, b->hash);
+			b->next_same_hash = *in;
+			*in = b;
+			b = next;
+		}
+	}
+	free(old);
+}
+
+static void enqueue(struct registry *self, struct brain *b)
+{
+	pthread_mutex_lock(&self->lock);
+	if (!b->queued) {
+		b->queued = true;
+		if (self->queue_len == self->queue_cap) {
+			self->queue_cap = self->queue_cap * 2 + 16;
+			self->queue = realloc(self->queue,
+				self->queue_cap * sizeof(*self->queue));
+		}
+		self->queue[self->queue_len++] = b;
+	}
+	pthread_mutex_unlock(&self->lock);
+}
+
+static uint32_t new_id(struct registry *self)
+{
+	if (self->n_free_ids > 0)
+		return self->free_ids[--self->n_free_ids];
+	if (self->end == self->by_id_cap) {
+		self->by_id_cap = self->by_id_cap * 2 + 16;
+		self->by_id = realloc(self->by_id,
+			self->by_id_cap * sizeof(*self->by_id));
+	}
+	return self->end++;
+}
+
+struct brain *registry_add(struct registry *self, struct brain *b)
+{
+	b->hash = brain_hash(b);
+	if (self->table_size > 0) {
+		struct brain *same;
+		for (same = *bucket(self, b->hash); same != NULL;
+			same = same->next_same_hash) {
+			if (same->hash == b->hash && brain_equal(same, b)) {
+				brain_free(b);
+				return same;
+			}
+		}
+	}
+	if (self->n_species >= self->table_size)
+		grow_table(self);
+	++self->n_species;
+	struct brain **in = bucket(self, b->hash);
+	b->next_same_hash = *in;
+	*in = b;
+	b->id = new_id(self);
+	self->by_id[b->id] = b;
+	b->queued = false;
+	enqueue(self, b);
+	return b;
+}
+
+void registry_died_out(struct registry *self, struct brain *b)
+{
+	enqueue(self, b);
+}
+
+static void remove_species(struct registry *self, struct brain *b)
+{
+	for (struct brain **at = bucket(self, b->hash); *at != NULL;
+		at = &(*at)->next_same_hash) {
+		if (*at == b) {
+			*at = b->next_same_hash;
+			break;
+		}
+	}
+	self->by_id[b->id] = NULL;
+	if (self->n_free_ids == self->free_ids_cap) {
+		self->free_ids_cap = self->free_ids_cap * 2 + 16;
+		self->free_ids = realloc(self->free_ids,
+			self->free_ids_cap * sizeof(*self->free_ids));
+	}
+	self->free_ids[self->n_free_ids++] = b->id;
+	--self->n_species;
+}
+
+static int by_id_descending(const void *a, const void *b)
+{
+	uint32_t id_a = (*(struct brain *const *)a)->id,
+		 id_b = (*(struct brain *const *)b)->id;
+	return (id_a < id_b) - (id_a > id_b);
+}
+
+void registry_free_extinct(struct registry *self)
+{
+	if (self->queue_len == 0)
+		return;
+	/* Threads queue species in any order, but ids must be given out again
+	 * in the same order every time. */
+	qsort(self->queue, self->queue_len, sizeof(*self->queue),
+		by_id_descending);
+	for (size_t i = 0; i < self->queue_len; ++i) {
+		struct brain *b = self->queue[i];
+		b->queued = false;
+		if (b->refcount == 0) {
+			remove_species(self, b);
+			brain_free(b);
+		}
+	}
+	self->queue_len = 0;
+}
+
+size_t registry_size(const struct registry *self)
+{
+	return self->n_species;
+}
+
+uint32_t registry_end(const struct registry *self)
+{
+	return self->end;
+}
+
+struct brain *registry_get(const struct registry *self, uint32_t id)
+{
+	return id < self->end ? self->by_id[id] : NULL;
+}
+
+void registry_free(struct registry *self)
+{
+	for (uint32_t id = 0; id < self->end; ++id) {
+		if (self->by_id[id])
+			brain_free(self->by_id[id]);
+	}
+	free(self->table);
+	free(self->by_id);
+	free(self->free_ids);
+	free(self->queue);
+	pthread_mutex_destroy(&self->lock);
+	free(self);
+}
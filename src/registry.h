@@ -0,0 +1,61 @@
+/*
+ * The interface for keeping track of the species of a grid.
+ *
+ * Copyright (C) 2018 Jude Melton-Houghton
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * */
+
+#ifndef _REGISTRY_H
+
+#define _REGISTRY_H
+
+#include "brain.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* A registry holds species by their contents and by ids. A species keeps its
+ * id until it is freed, after which the id is given out again. Species that
+ * may have died out wait in a queue, so finding them does not take a look at
+ * every species. */
+struct registry;
+
+struct registry *registry_new(void);
+
+/* Adds a brain and returns it, unless there is a species with the same
+ * contents already. Then the brain is freed and that species is returned
+ * instead. Only one thread may add at a time. */
+struct brain *registry_add(struct registry *self, struct brain *b);
+
+/* Queues a species whose population has dropped to zero. Other threads may be
+ * queueing species at the same time. */
+void registry_died_out(struct registry *self, struct brain *b);
+
+/* Frees the queued species which still have no members. New species are
+ * queued too, in case no members are ever added. */
+void registry_free_extinct(struct registry *self);
+
+/* How many species there are. */
+size_t registry_size(const struct registry *self);
+
+/* Ids are below this. */
+uint32_t registry_end(const struct registry *self);
+
+/* Gets the species with an id, or NULL if no species has it. */
+struct brain *registry_get(const struct registry *self, uint32_t id);
+
+/* Frees the registry and all of its species. */
+void registry_free(struct registry *self);
+
+#endif /* Header guard */
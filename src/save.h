@@ -21,14 +21,45 @@
 
 #define _SAVE_H
 
+#include "buffer.h"
 #include "chemicals.h"
 #include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #if N_CHEMICALS != 11
 	#error "Be sure to change the version number when changing N_CHEMICALS!"
 #endif
-#define SERIALIZATION_VERSION 4
+#define SERIALIZATION_VERSION 8
+/* Version 8 saves are streams of what version 7 saves pack in their sections,
+ * in an order that can be written and read without seeking. Version 7 saves
+ * are version 6 saves with their sections packed. Versions 4 and 5 are made of
+ * records rather than sections, and version 4 has no random generator kind. */
+#define PACKED_VERSION 7
+#define UNPACKED_VERSION 6
+#define OLDEST_SERIALIZATION_VERSION 4
+
+struct grid;
+
+/* Brings every tile and animal up to date so that a save need not hold how far
+ * behind they are. */
+void grid_catch_up_all(struct grid *g);
+
+/* Writes a grid in sections, starting with the format version number. */
+int grid_write_sections(struct grid *g, FILE *dest, bool packed,
+	const char **err);
+
+/* Reads a grid in sections from a save of size bytes in memory. */
+struct grid *grid_load_sections(const uint8_t *save, size_t size,
+	const char **err);
+
+/* Writes a grid as a stream, starting with the format version number. */
+int grid_write_stream_sections(struct grid *g, FILE *dest, const char **err);
+
+/* Reads a grid from a stream whose format version number has been read,
+ * taking no more from it than the save holds. */
+struct grid *grid_read_stream(FILE *src, const char **err);
 
 #define FAIL(fn, e) do { *(e) = #fn " failed"; return RETURN_ERR; } while (0)
 
@@ -59,4 +90,13 @@
 	} \
 } while (0)
 
+/* Takes n bytes from a cursor into dest, failing if there are fewer left. */
+#define TAKE(dest, n, src, e) do { \
+	if (!((dest) = cursor_take((src), (n)))) { \
+		errno = EPROTO; \
+		*(e) = "unexpected end of file"; \
+		return RETURN_ERR; \
+	} \
+} while (0)
+
 #endif /* Header guard */